@@ -0,0 +1,193 @@
+/*
+** Images derived from the current frame, e.g. an MJPEG frame squeezed down to
+** a lower quality. Making one is expensive, so each is made at most once per
+** frame serial and shared by every request that wants it.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinycamd.h"
+
+#define MAX_DERIVED 16
+#define KEY_SIZE 160         // a camera name, a view name and a recipe, usually
+
+struct derived {
+    pthread_mutex_t mutex;   // held while the image is being made
+    char key[KEY_SIZE];      // following 3 fields guarded by derived_mutex
+    unsigned long used;
+    int busy;
+
+    int serial;              // these guarded by mutex
+    struct image *image;
+};
+
+static struct derived derived[MAX_DERIVED];
+static pthread_mutex_t derived_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long derived_clock = 0;
+static int derivedWaiting = 0;   // requests making or waiting for an image
+
+struct image *new_image( unsigned int size)
+{
+    struct image *im = calloc( 1, sizeof(*im));
+
+    if ( !im) fatal_f("Out of memory\n");
+    im->refs = 1;
+    im->size = size;
+    im->data = malloc( size);
+    if ( !im->data) fatal_f("Out of memory\n");
+    return im;
+}
+
+/*
+** Wrap a malloc()ed buffer, which now belongs to the image.
+*/
+struct image *adopt_image( unsigned char *data, unsigned int length)
+{
+    struct image *im = calloc( 1, sizeof(*im));
+
+    if ( !im) fatal_f("Out of memory\n");
+    im->refs = 1;
+    im->size = im->length = length;
+    im->data = data;
+    return im;
+}
+
+void grow_image( struct image *im, unsigned int size)
+{
+    if ( size <= im->size) return;
+    im->data = realloc( im->data, size);
+    if ( !im->data) fatal_f("Out of memory\n");
+    im->size = size;
+}
+
+void retain_image( struct image *im)
+{
+    __sync_add_and_fetch( &im->refs, 1);
+}
+
+void release_image( struct image *im)
+{
+    if ( __sync_sub_and_fetch( &im->refs, 1) != 0) return;
+    free( im->data);
+    free( im);
+}
+
+static void release_image_cleanup( void *arg)
+{
+    release_image( (struct image *)arg);
+}
+
+/*
+** Find the slot for key, or take over the least recently used idle one.
+** The slot is marked busy so nobody steals it out from under us.
+*/
+static struct derived *claim_derived( const char *key)
+{
+    struct derived *d, *victim = 0;
+    int i;
+
+    pthread_mutex_lock( &derived_mutex);
+    for ( i = 0; i < MAX_DERIVED; i++) {
+	d = &derived[i];
+	if ( strcmp( d->key, key) == 0) break;
+	if ( !d->busy && ( !victim || d->used < victim->used)) victim = d;
+    }
+    if ( i == MAX_DERIVED) {
+	d = victim;
+	if ( d) {
+	    if ( d->key[0] == 0) pthread_mutex_init( &d->mutex, 0);
+	    snprintf( d->key, sizeof(d->key), "%s", key);
+	    if ( d->image) release_image( d->image);
+	    d->image = 0;
+	    d->serial = 0;
+	}
+    }
+    if ( d) {
+	d->busy++;
+	d->used = ++derived_clock;
+    }
+    pthread_mutex_unlock( &derived_mutex);
+    return d;
+}
+
+static void unclaim_derived( struct derived *d)
+{
+    pthread_mutex_lock( &derived_mutex);
+    d->busy--;
+    pthread_mutex_unlock( &derived_mutex);
+}
+
+struct refresh {
+    struct derived *d;
+    image_maker make;
+    void *makeArg;
+};
+
+static void refresh_derived( const struct chunk *c, void *arg)
+{
+    struct refresh *r = (struct refresh *)arg;
+    struct derived *d = r->d;
+    int serial = current_frame_serial();
+
+    if ( d->image && d->serial == serial) return;
+
+    if ( d->image) release_image( d->image);
+    d->image = (*r->make)( c, r->makeArg);
+    d->serial = serial;
+}
+
+/*
+** Hand func the image made by make() from the current frame, making it only
+** if nobody already has for this frame. A key too long to keep whole could
+** match another one cut short the same way, so that image is made just for
+** this request. Returns 0 if it could not be made.
+*/
+int with_derived_image( const char *key, image_maker make, void *makeArg, frame_sender func, void *arg)
+{
+    struct refresh r = { .make = make, .makeArg = makeArg };
+    struct derived own = { .image = 0 };
+    struct image *im = 0;
+    struct chunk c[2];
+    char fullKey[KEY_SIZE];
+    int oldState;
+
+    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &oldState);
+    __atomic_add_fetch( &derivedWaiting, 1, __ATOMIC_RELAXED);
+    // each camera has its own frames, so its own images
+    if ( snprintf( fullKey, sizeof(fullKey), "%s/%s", this_camera()->name, key) >= sizeof(fullKey)) {
+	r.d = &own;
+	with_current_frame( refresh_derived, &r);
+	im = own.image;
+    } else if ( (r.d = claim_derived( fullKey))) {
+	pthread_mutex_lock( &r.d->mutex);
+	with_current_frame( refresh_derived, &r);
+	im = r.d->image;
+	if ( im) retain_image( im);
+	pthread_mutex_unlock( &r.d->mutex);
+	unclaim_derived( r.d);
+    }
+    __atomic_sub_fetch( &derivedWaiting, 1, __ATOMIC_RELAXED);
+    pthread_setcancelstate( oldState, 0);
+
+    if ( !im) return 0;
+
+    pthread_cleanup_push( release_image_cleanup, im);
+    c[0].data = im->data;
+    c[0].length = im->length;
+    c[1].data = 0;
+    (*func)( c, arg);
+    pthread_cleanup_pop( 1);
+
+    return 1;
+}
+
+/*
+** How many requests are making derived images or waiting their turn, the
+** nearest thing we have to an encoder queue.
+*/
+int derived_backlog(void)
+{
+    return __atomic_load_n( &derivedWaiting, __ATOMIC_RELAXED);
+}
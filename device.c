@@ -1,28 +1,53 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <linux/videodev2.h>
 #include "tinycamd.h"
 
-int videodev = -1;
-
 struct buffer {
         void *                  start;
         size_t                  length;
+        int                     inDriver;   // queued with the driver
+        int                     idle;       // ours, to queue when streaming starts
+        int                     dmafd;      // exported with VIDIOC_EXPBUF, or -1
+        size_t                  mapped;     // bytes we mmap()ed at start, the whole userp pool for the first
 };
-static struct buffer *buffers = NULL;
-static unsigned int n_buffers = 0;
 
-pthread_mutex_t video_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct camera *cameras = 0;
+static __thread struct camera *myCamera = 0;
+
+static long captureStops = 0;
+static long captureStarts = 0;
+static long warmStartMs = 0;
+static long captureStalls = 0;
+static long captureErrors = 0;
+static long captureRecoveries = 0;
+static long recoveryMs = 0;
+static long camerasDown = 0;
+static long streaming = 0;
+static long framesDrained = 0;
+static long drainSavedMs = 0;
+static long frameAgeMs = 0;
+
+/*
+** Gauges each camera has its own value of. The metric is the largest,
+** the camera worst off.
+*/
+enum { WARM_START, RECOVERY, DRAIN_SAVED, FRAME_AGE };
+static long *gauges[] = { &warmStartMs, &recoveryMs, &drainSavedMs, &frameAgeMs };
 
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
@@ -31,6 +56,31 @@ static void errno_exit(const char *s)
     fatal_f("%s error %d, %s\n", s, errno, strerror (errno));
 }
 
+/*
+** Setting the device up. At startup anything wrong is fatal, but when
+** recover() sets it up again it is only logged, to be tried again later.
+** Keeps errno for recover() to look at.
+*/
+static int setup_failed( int again, const char *format, ...)
+{
+    char msg[256];
+    va_list args;
+    int err = errno;
+
+    va_start( args, format);
+    vsnprintf( msg, sizeof(msg), format, args);
+    va_end( args);
+    if ( !again) fatal_f( "%s", msg);
+    log_f( "%s", msg);
+    errno = err;
+    return -1;
+}
+
+static int setup_error( int again, const char *s)
+{
+    return setup_failed( again, "%s error %d, %s\n", s, errno, strerror (errno));
+}
+
 static int xioctl(int fd, int request, void *arg)
 {
     int r;
@@ -41,276 +91,837 @@ static int xioctl(int fd, int request, void *arg)
     return r;
 }
 
-static int read_frame(void)
+/*
+** The camera this thread is working for. Capture threads and requests under
+** /cam/NAME/ pick theirs, everything else gets the first.
+*/
+struct camera *this_camera(void)
+{
+    return myCamera ? myCamera : cameras;
+}
+
+void use_camera( struct camera *c)
+{
+    myCamera = c;
+}
+
+struct camera *find_camera( const char *name, int length)
+{
+    struct camera *c;
+
+    for ( c = cameras; c; c = c->next) {
+	if ( strlen( c->name) == length && strncmp( c->name, name, length) == 0) return c;
+    }
+    return 0;
+}
+
+static long long now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static enum v4l2_buf_type capture_type( struct camera *c)
+{
+    return c->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+}
+
+/*
+** Describe buffer i to the driver. The multi-planar API wants its one
+** plane described separately, in plane.
+*/
+static void describe_buffer( struct camera *c, unsigned int i, struct v4l2_buffer *buf, struct v4l2_plane *plane)
+{
+    memset( buf, 0, sizeof(*buf));
+    memset( plane, 0, sizeof(*plane));
+    buf->type = capture_type( c);
+    buf->memory = c->io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    buf->index = i;
+    if ( c->mplane) {
+	buf->m.planes = plane;
+	buf->length = 1;
+    }
+    if ( c->io == IO_METHOD_USERPTR && c->buffers) {
+	if ( c->mplane) {
+	    plane->m.userptr = (unsigned long) c->buffers[i].start;
+	    plane->length = c->buffers[i].length;
+	} else {
+	    buf->m.userptr = (unsigned long) c->buffers[i].start;
+	    buf->length = c->buffers[i].length;
+	}
+    }
+}
+
+static void set_gauge( struct camera *c, int g, long value)
+{
+    struct camera *o;
+    long worst = value;
+
+    __atomic_store_n( &c->gauge[g], value, __ATOMIC_RELAXED);
+    for ( o = cameras; o; o = o->next) {
+	long v = __atomic_load_n( &o->gauge[g], __ATOMIC_RELAXED);
+
+	if ( v > worst) worst = v;
+    }
+    __atomic_store_n( gauges[g], worst, __ATOMIC_RELAXED);
+}
+
+/*
+** Errors that mean the device went away, or broke, rather than that we
+** asked it something wrong. Capture is then started over, see recover().
+*/
+static int device_lost( struct camera *c, int err)
+{
+    if ( err != ENODEV && err != EIO && err != ENXIO) return 0;
+    c->broken = err;
+    return 1;
+}
+
+/*
+** Frame.c hands buffers back here once no reader can see them. Only from
+** the camera's capture thread. While the camera is stopped they wait for
+** it to start again.
+*/
+void requeue_buffer( struct v4l2_buffer *buf)
+{
+    struct camera *c = this_camera();
+    struct v4l2_buffer qbuf;
+    struct v4l2_plane plane;
+
+    if ( c->io == IO_METHOD_READ) {   // free to read into again
+	c->buffers[buf->index].idle = 1;
+	c->queued++;
+	return;
+    }
+    if ( !c->streaming) {
+	c->buffers[buf->index].idle = 1;
+	return;
+    }
+    describe_buffer( c, buf->index, &qbuf, &plane);
+    if (-1 == xioctl (c->fd, VIDIOC_QBUF, &qbuf)) {
+	if ( !device_lost( c, errno)) errno_exit ("VIDIOC_QBUF");
+	c->buffers[buf->index].idle = 1;
+	return;
+    }
+    c->buffers[buf->index].inDriver = 1;
+    c->queued++;
+}
+
+/*
+** Take the next filled buffer from the driver, 0 if there is none yet. The
+** frame starts *offset bytes into it.
+*/
+static int dequeue( struct camera *c, struct v4l2_buffer *buf, unsigned int *offset)
+{
+    struct v4l2_plane plane;
+    unsigned long userptr;
+    unsigned int i;
+
+    describe_buffer( c, 0, buf, &plane);
+    if (-1 == xioctl (c->fd, VIDIOC_DQBUF, buf)) {
+	switch (errno) {
+	  case EAGAIN:
+	    return 0;
+	  default:
+	    if ( device_lost( c, errno)) return 0;
+	    errno_exit ("VIDIOC_DQBUF");
+	}
+    }
+
+    *offset = 0;
+    userptr = buf->m.userptr;
+    if ( c->mplane) {
+	*offset = plane.data_offset;
+	buf->bytesused = plane.bytesused > plane.data_offset ? plane.bytesused - plane.data_offset : 0;
+	userptr = plane.m.userptr;
+	buf->m.planes = 0;   // plane is about to go
+	buf->length = 0;
+    }
+    if ( c->io == IO_METHOD_USERPTR) {
+	for (i = 0; i < c->n_buffers; ++i)
+	    if (userptr == (unsigned long) c->buffers[i].start) break;
+	buf->index = i;
+    }
+    assert (buf->index < c->n_buffers);
+    c->queued--;
+    c->buffers[buf->index].inDriver = 0;
+    return 1;
+}
+
+/*
+** When the driver filled the buffer, monotonic microseconds, or -1 if it
+** doesn't say.
+*/
+static long long buffer_time( const struct v4l2_buffer *buf)
 {
-    unsigned int i, len;
+    if ( !buf->timestamp.tv_sec ||
+	 (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) return -1;
+    return buf->timestamp.tv_sec * 1000000LL + buf->timestamp.tv_usec;
+}
+
+static int read_frame( struct camera *c)
+{
+    struct buffer *buffers = c->buffers;
+    struct v4l2_buffer buf, newer;
+    unsigned int i, len, offset, newerOffset;
+    long long when;
     
-    switch (io_method) {
+    switch (c->io) {
       case IO_METHOD_READ:
-	if (-1 == (len = read (videodev, buffers[0].start, buffers[0].length))) {
+	//
+	// Readers may still be sending earlier frames, so each read goes
+	// into a buffer no frame uses. It comes back through requeue_buffer()
+	// once its frame is retired and nobody holds it, as with mmap.
+	//
+	for (i = 0; i < c->n_buffers && !buffers[i].idle; ++i) ;
+	if (i == c->n_buffers) return 0;
+	if (-1 == (len = read (c->fd, buffers[i].start, buffers[i].length))) {
 	    switch (errno) {
 	      case EAGAIN:
 		return 0;
-		
-	      case EIO:
-		/* Could ignore EIO, see spec. */
-		/* fall through */
 	      default:
+		if ( device_lost( c, errno)) return 0;
 		errno_exit ("read");
 	    }
 	}
-	new_frame (buffers[0].start, len, 0);
+	buffers[i].idle = 0;
+	c->queued--;
+	memset( &buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.index = i;
+	buf.bytesused = len;
+	new_frame (buffers[i].start, len, &buf);
 	break;
       case IO_METHOD_MMAP:
-	  {
-	      struct v4l2_buffer buf = {
-		  .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		  .memory = V4L2_MEMORY_MMAP,
-	      };
-	      if (-1 == xioctl (videodev, VIDIOC_DQBUF, &buf)) {
-		  switch (errno) {
-		    case EAGAIN:
-		      return 0;
-		    case EIO:
-		      /* Could ignore EIO, see spec. */
-		      /* fall through */
-		    default:
-		      errno_exit ("VIDIOC_DQBUF");
-		  }
-	      }
-	      
-	      assert (buf.index < n_buffers);
-	      new_frame (buffers[buf.index].start, buf.bytesused, &buf);
-	      if ( buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-		  if (-1 == xioctl (videodev, VIDIOC_QBUF, &buf)) errno_exit ("VIDIOC_QBUF");
-	      }
-	  }
-	  break;
-	  
       case IO_METHOD_USERPTR:
-	  {
-	      struct v4l2_buffer buf = {
-		  .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		  .memory = V4L2_MEMORY_USERPTR,
-	      };
-	      
-	      if (-1 == xioctl (videodev, VIDIOC_DQBUF, &buf)) {
-		  switch (errno) {
-		    case EAGAIN:
-		      return 0;
-		    case EIO:
-		      /* Could ignore EIO, see spec. */
-		      /* fall through */
-		    default:
-		      errno_exit ("VIDIOC_DQBUF");
-		  }
-	      }
-	      
-	      for (i = 0; i < n_buffers; ++i)
-		  if (buf.m.userptr == (unsigned long) buffers[i].start
-		      && buf.length == buffers[i].length)
-		      break;
-	      
-	      assert (i < n_buffers);
-	      new_frame ((void *) buf.m.userptr, buf.bytesused, &buf);
-	      if ( buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-		  if (-1 == xioctl (videodev, VIDIOC_QBUF, &buf)) errno_exit ("VIDIOC_QBUF");
-	      }
-	  }
-	  break;
+	if ( !dequeue( c, &buf, &offset)) return 0;
+
+	//
+	// If we fell behind there are older frames ready too. With --latest
+	// only the newest is worth showing, the rest go straight back.
+	//
+	if ( c->latest) {
+	    long long oldest = buffer_time( &buf);
+	    int drained = 0;
+
+	    while ( dequeue( c, &newer, &newerOffset)) {
+		requeue_buffer( &buf);
+		buf = newer;
+		offset = newerOffset;
+		drained++;
+	    }
+	    if ( drained) {
+		__atomic_fetch_add( &framesDrained, drained, __ATOMIC_RELAXED);
+		if ( oldest >= 0 && buffer_time( &buf) >= 0) {
+		    set_gauge( c, DRAIN_SAVED, (buffer_time( &buf) - oldest) / 1000);
+		}
+	    }
+	}
+	when = buffer_time( &buf);
+	if ( when >= 0) set_gauge( c, FRAME_AGE, (now_us() - when) / 1000);
+	new_frame ((char *)buffers[buf.index].start + offset, buf.bytesused, &buf);
+	break;
+    }
+
+    // how long the camera took to get going, see stream_on()
+    c->lastFrame = now_us();
+    c->kicked = 0;
+    if ( c->started) {
+	set_gauge( c, WARM_START, (c->lastFrame - c->started) / 1000);
+	c->started = 0;
+    }
+    // and to come back, see recover()
+    if ( c->downSince) {
+	long ms = (c->lastFrame - c->downSince) / 1000;
+
+	set_gauge( c, RECOVERY, ms);
+	__atomic_fetch_add( &captureRecoveries, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub( &camerasDown, 1, __ATOMIC_RELAXED);
+	__atomic_store_n( &c->downSince, 0, __ATOMIC_RELAXED);
+	log_f("%s: back after %ld ms\n", c->name, ms);
     }
     return 1;
 }
 
-void *main_loop (void *args)
+/*
+** Hand the driver every buffer that is ours and start it streaming. The
+** buffers readers still hold follow as they are reclaimed. The device stays
+** open and its format set, so this is as quick as the camera allows.
+*/
+static void stream_on( struct camera *c)
+{
+    enum v4l2_buf_type type = capture_type( c);
+    unsigned int i;
+
+    __atomic_store_n( &c->streaming, 1, __ATOMIC_SEQ_CST);
+    __sync_add_and_fetch( &streaming, 1);
+    c->started = c->lastFrame = now_us();
+    if ( c->io == IO_METHOD_READ) return;   // reading is what starts it
+
+    for ( i = 0; i < c->n_buffers; i++) {
+	struct v4l2_buffer buf = { .index = i };
+
+	if ( !c->buffers[i].idle) continue;
+	c->buffers[i].idle = 0;
+	requeue_buffer( &buf);
+    }
+    if (-1 == xioctl (c->fd, VIDIOC_STREAMON, &type) && !device_lost( c, errno)) errno_exit ("VIDIOC_STREAMON");
+}
+
+/*
+** STREAMOFF gives back every queued buffer, they are ours again until the
+** next stream_on(). Frames readers hold keep theirs, and the current one
+** stays current, so there is still something to show.
+*/
+static void stream_off( struct camera *c)
+{
+    enum v4l2_buf_type type = capture_type( c);
+    unsigned int i;
+
+    __atomic_store_n( &c->streaming, 0, __ATOMIC_SEQ_CST);
+    __sync_sub_and_fetch( &streaming, 1);
+    c->started = 0;
+    if ( c->io == IO_METHOD_READ) return;
+
+    if (-1 == xioctl (c->fd, VIDIOC_STREAMOFF, &type) && !device_lost( c, errno)) errno_exit ("VIDIOC_STREAMOFF");
+    for ( i = 0; i < c->n_buffers; i++) {
+	if ( !c->buffers[i].inDriver) continue;
+	c->buffers[i].inDriver = 0;
+	c->buffers[i].idle = 1;
+    }
+    c->queued = 0;
+}
+
+/*
+** Let go of the buffers. Only once no frame uses them. The driver frees
+** its own too, or it stays busy and refuses a new format.
+*/
+static void release_buffers( struct camera *c)
+{
+    struct v4l2_requestbuffers req = {
+	.count = 0,
+	.type = capture_type( c),
+	.memory = c->io == IO_METHOD_MMAP ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR,
+    };
+    unsigned int i;
+
+    for ( i = 0; i < c->n_buffers; i++) {
+	if ( c->buffers[i].dmafd >= 0) close( c->buffers[i].dmafd);
+	if ( c->buffers[i].mapped) munmap( c->buffers[i].start, c->buffers[i].mapped);
+	else if ( c->io == IO_METHOD_READ) free( c->buffers[i].start);
+    }
+    if ( c->io != IO_METHOD_READ) xioctl( c->fd, VIDIOC_REQBUFS, &req);   // may be gone already
+    free( c->buffers);
+    c->buffers = 0;
+    c->n_buffers = 0;
+    c->queued = 0;
+}
+
+static int configure_device( struct camera *c, int again);
+
+/*
+** The device went away, or stopped giving frames. Readers get the last
+** frame meanwhile, see keep_current_frame(). A stall first just restarts
+** streaming. If that brings nothing either, the buffers are let go and the
+** device set up again on the descriptor we have. Only a device that is
+** gone, see device_lost(), is opened again by name, which --chroot and
+** --uid may rule out, see check_reopen(). Either way it backs off while
+** it won't come back. Requests use c->fd under the mutex, so the new open
+** takes over the old descriptor's number.
+*/
+static void recover( struct camera *c)
+{
+    int delay = 1, held, fd, set, err;
+    unsigned int i;
+
+    if ( c->broken) {
+	__atomic_fetch_add( &captureErrors, 1, __ATOMIC_RELAXED);
+	log_f("%s: lost %s: %s, reopening\n", c->name, c->device, strerror( c->broken));
+    } else {
+	__atomic_fetch_add( &captureStalls, 1, __ATOMIC_RELAXED);
+	log_f("%s: no frame from %s for %d seconds, %s\n", c->name, c->device, stall_seconds,
+	      c->kicked ? "setting it up again" : "restarting it");
+    }
+    if ( !c->downSince) {
+	__atomic_store_n( &c->downSince, now_us(), __ATOMIC_RELAXED);
+	__atomic_fetch_add( &camerasDown, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    keep_current_frame();
+    if ( c->streaming) stream_off( c);
+    if ( !c->broken && !c->kicked++) {
+	stream_on( c);
+	pthread_mutex_unlock(&c->mutex);
+	return;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    // dma-buf clients hang up on a new generation, so they stop using the buffers
+    __atomic_add_fetch( &c->generation, 1, __ATOMIC_SEQ_CST);
+    wake_frame_waiters( c);
+
+    for (;;) {
+	pthread_mutex_lock(&c->mutex);
+	held = reclaim_frames();
+	if ( !held) release_buffers( c);
+	pthread_mutex_unlock(&c->mutex);
+	if ( !held) break;
+	usleep( 100000);
+    }
+
+    for (;;) {
+	if ( c->broken) {
+	    if ( !c->reopen) fatal_f("%s: lost %s, which cannot be opened again after --chroot or --uid\n", c->name, c->device);
+	    fd = open (c->device, O_RDWR | O_NONBLOCK, 0);
+	    if ( fd < 0 && (errno == EACCES || errno == EPERM)) {
+		fatal_f("%s: cannot open %s again: %s, check --uid\n", c->name, c->device, strerror(errno));
+	    }
+	    if ( fd >= 0) {
+		pthread_mutex_lock(&c->mutex);
+		dup2( fd, c->fd);
+		close( fd);
+		c->broken = 0;
+		pthread_mutex_unlock(&c->mutex);
+	    } else {
+		log_f("%s: cannot open %s: %s\n", c->name, c->device, strerror(errno));
+	    }
+	}
+	if ( !c->broken) {
+	    pthread_mutex_lock(&c->mutex);
+	    set = configure_device( c, 1);
+	    err = errno;
+	    if ( set != 0) release_buffers( c);   // whatever it got to
+	    pthread_mutex_unlock(&c->mutex);
+	    if ( set == 0) break;
+	    device_lost( c, err);
+	}
+	log_f("%s: trying again in %d seconds\n", c->name, delay);
+	sleep( delay);
+	if ( delay < 30) delay *= 2;
+    }
+    __atomic_add_fetch( &c->generation, 1, __ATOMIC_SEQ_CST);   // and any that came meanwhile
+
+    pthread_mutex_lock(&c->mutex);
+    for (i = 0; i < c->n_buffers; ++i) c->buffers[i].idle = 1;
+    stream_on( c);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+** One of these threads per camera.
+*/
+void *main_loop (void *camera)
 {
+    struct camera *c = (struct camera *)camera;
+
+    start_capturing( c);   // here, so userp buffers fault in on this thread
+    use_camera( c);
     for (;;) {
 	fd_set fds;
-	int r;
+	struct timeval tv = { .tv_usec = 10000 }, second = { .tv_sec = 1 };
+	int held, r;
+
+	//
+	// The device went away or fell silent, start it over.
+	//
+	if ( c->broken || ( stall_seconds && c->streaming &&
+			    now_us() - c->lastFrame > stall_seconds * 1000000LL)) {
+	    recover( c);
+	    continue;
+	}
+
+	//
+	// Nobody has looked at a frame for a while, so stop the camera until
+	// somebody does. Meanwhile retired frames still come back.
+	//
+	if ( idle_off && !frames_wanted( idle_off)) {
+	    pthread_mutex_lock(&c->mutex);
+	    stream_off( c);
+	    pthread_mutex_unlock(&c->mutex);
+	    __atomic_fetch_add( &captureStops, 1, __ATOMIC_RELAXED);
+	    if ( verbose) log_f("%s: no viewers, stopped\n", c->name);
+
+	    while ( !wait_for_demand( 1000)) {
+		pthread_mutex_lock(&c->mutex);
+		reclaim_frames();
+		pthread_mutex_unlock(&c->mutex);
+	    }
+
+	    pthread_mutex_lock(&c->mutex);
+	    stream_on( c);
+	    pthread_mutex_unlock(&c->mutex);
+	    __atomic_fetch_add( &captureStarts, 1, __ATOMIC_RELAXED);
+	    if ( verbose) log_f("%s: wanted, started\n", c->name);
+	    continue;
+	}
+
+	//
+	// Buffers readers were still sending when they were retired have to be
+	// returned even if no new frame comes along to trigger it. If the driver
+	// has none at all we can only wait for the readers.
+	//
+	pthread_mutex_lock(&c->mutex);
+	held = reclaim_frames();
+	pthread_mutex_unlock(&c->mutex);
+
+	if ( c->queued == 0) {
+	    c->lastFrame = now_us();   // not the camera's fault
+	    select (0, NULL, NULL, NULL, &tv);
+	    continue;
+	}
 
 	FD_ZERO (&fds);
-	FD_SET (videodev, &fds);
+	FD_SET (c->fd, &fds);
 
-	r = select (videodev + 1, &fds, NULL, NULL, 0);
+	r = select (c->fd + 1, &fds, NULL, NULL, held ? &tv : &second);
 
 	if (-1 == r) {
 	    if (EINTR == errno)	continue;
 	    errno_exit ("select");
 	}
+	if ( r == 0) continue;
 	
-	pthread_mutex_lock(&video_mutex);
-	read_frame();
-	pthread_mutex_unlock(&video_mutex);
+	pthread_mutex_lock(&c->mutex);
+	read_frame( c);
+	pthread_mutex_unlock(&c->mutex);
     }
     return NULL;
 }
 
-void start_capturing (void)
+void start_capturing (struct camera *c)
 {
     unsigned int i;
-    enum v4l2_buf_type type;
-    
-    pthread_mutex_lock(&video_mutex);
-    switch (io_method) {
-      case IO_METHOD_READ:
-	/* Nothing to do. */
-	break;
-	
-      case IO_METHOD_MMAP:
-	for (i = 0; i < n_buffers; ++i) {
-	    struct v4l2_buffer buf = {
-		.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory      = V4L2_MEMORY_MMAP,
-		.index       = i,
-	    };
-	    
-	    if (-1 == xioctl (videodev, VIDIOC_QBUF, &buf)) errno_exit ("VIDIOC_QBUF");
-	}
-	
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == xioctl (videodev, VIDIOC_STREAMON, &type)) errno_exit ("VIDIOC_STREAMON");
-	
-	break;
-	
-      case IO_METHOD_USERPTR:
-	for (i = 0; i < n_buffers; ++i) {
-	    struct v4l2_buffer buf = {
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = V4L2_MEMORY_USERPTR,
-		.index = i,
-		.m.userptr = (unsigned long) buffers[i].start,
-		.length = buffers[i].length,
-	    };
-	    
-	    if (-1 == xioctl (videodev, VIDIOC_QBUF, &buf)) errno_exit ("VIDIOC_QBUF");
+
+    use_camera( c);
+    pthread_mutex_lock(&c->mutex);
+    for (i = 0; i < c->n_buffers; ++i) c->buffers[i].idle = 1;
+    stream_on( c);
+    pthread_mutex_unlock(&c->mutex);
+    want_frames();   // so an idle camera streams a while after starting up
+    use_camera( 0);
+}
+
+void stop_capturing (struct camera *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    if ( c->streaming) stream_off( c);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+** Change a camera's frame rate while it runs, for the governor. Drivers
+** mostly refuse VIDIOC_S_PARM while streaming, so then the stream stops
+** around it. Returns 0 if the driver can't change its rate at all.
+*/
+int set_frame_rate( struct camera *c, int fps)
+{
+    struct v4l2_streamparm strm = { .type = capture_type( c) };
+    struct camera *was = this_camera();
+    int ok = 0, err;
+
+    use_camera( c);
+    pthread_mutex_lock(&c->mutex);
+    if ( 0 == xioctl( c->fd, VIDIOC_G_PARM, &strm) && (strm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+	strm.parm.capture.timeperframe.numerator = 1;
+	strm.parm.capture.timeperframe.denominator = fps;
+	ok = (0 == xioctl( c->fd, VIDIOC_S_PARM, &strm));
+	err = errno;
+	if ( !ok && err == EBUSY && c->streaming) {
+	    stream_off( c);
+	    ok = (0 == xioctl( c->fd, VIDIOC_S_PARM, &strm));
+	    err = errno;
+	    stream_on( c);
 	}
-	
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == xioctl (videodev, VIDIOC_STREAMON, &type)) errno_exit ("VIDIOC_STREAMON");
-	
-	break;
+	if ( !ok) log_f("%s: failed to set fps %d: %s\n", c->name, fps, strerror(err));
     }
-    pthread_mutex_unlock(&video_mutex);
+    pthread_mutex_unlock(&c->mutex);
+    use_camera( was);
+    return ok;
 }
 
-void stop_capturing (void)
+/*
+** How long this thread's camera has been failing, in ms, zero while it
+** works. Its last frame is as old as that, at least.
+*/
+long long camera_down_ms(void)
 {
-    enum v4l2_buf_type type;
-    
-    pthread_mutex_lock(&video_mutex);
-    switch (io_method) {
-      case IO_METHOD_READ:
-	/* Nothing to do. */
-	break;
-      case IO_METHOD_MMAP:
-      case IO_METHOD_USERPTR:
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	if (-1 == xioctl (videodev, VIDIOC_STREAMOFF, &type)) errno_exit ("VIDIOC_STREAMOFF");
-	break;
-    }
-    pthread_mutex_unlock(&video_mutex);
+    long long since = __atomic_load_n( &this_camera()->downSince, __ATOMIC_RELAXED);
+
+    return since ? (now_us() - since) / 1000 : 0;
+}
+
+/*
+** The dma-buf of capture buffer i, -1 if it wasn't exported, with its
+** length and where it is mapped here.
+*/
+int buffer_dmabuf( struct camera *c, unsigned int i, unsigned int *length, const void **start)
+{
+    if ( i >= c->n_buffers || c->buffers[i].dmafd < 0) return -1;
+    *length = c->buffers[i].length;
+    *start = c->buffers[i].start;
+    return c->buffers[i].dmafd;
+}
+
+void add_device_metrics(void)
+{
+    add_metric( "capture_stops_total", "Times a camera was stopped for want of viewers.", &captureStops);
+    add_metric( "capture_starts_total", "Times a stopped camera was started for a viewer.", &captureStarts);
+    add_metric( "capture_warm_start_ms", "From the last start to the first frame, the slowest camera's.", &warmStartMs);
+    add_metric( "cameras_streaming", "Cameras streaming now.", &streaming);
+    add_metric( "frame_age_ms", "How old the last frame was when it was published, the oldest camera's.", &frameAgeMs);
+    add_metric( "frames_drained_total", "Stale frames skipped for a newer one, with --latest.", &framesDrained);
+    add_metric( "frame_drain_saved_ms", "How much newer the last draining made the frame published, the most of any camera.", &drainSavedMs);
+    add_metric( "capture_stalls_total", "Times a camera gave no frame for --stall seconds.", &captureStalls);
+    add_metric( "capture_errors_total", "Times a camera's device failed or went away.", &captureErrors);
+    add_metric( "capture_recoveries_total", "Times a camera came back after being reopened.", &captureRecoveries);
+    add_metric( "capture_recovery_ms", "From the last failure to the next frame, the slowest camera's.", &recoveryMs);
+    add_metric( "cameras_down", "Cameras being reopened now.", &camerasDown);
 }
 
 
-void init_read (unsigned int buffer_size)
+/*
+** Read() has no driver buffers, so we keep our own pool of at least three:
+** one for the current frame, one a slow reader may still hold, and one to
+** read into.
+*/
+static void init_read (struct camera *c, unsigned int buffer_size)
 {
-    buffers = calloc (1, sizeof (*buffers));
+    unsigned int n = c->want_buffers < 3 ? 3 : c->want_buffers;
+    struct buffer *buffers = calloc (n, sizeof (*buffers));
+    unsigned int i;
     
     if (!buffers) fatal_f("Out of memory\n");
     
-    buffers[0].length = buffer_size;
-    buffers[0].start = malloc (buffer_size);
-    
-    if (!buffers[0].start) fatal_f("Out of memory\n");
+    for (i = 0; i < n; ++i) {
+	buffers[i].length = buffer_size;
+	buffers[i].start = malloc (buffer_size);
+	if (!buffers[i].start) fatal_f("Out of memory\n");
+	buffers[i].idle = 1;
+	buffers[i].dmafd = -1;
+    }
+    c->buffers = buffers;
+    c->n_buffers = n;
+    c->queued = n;
 }
 
-void init_mmap (void)
+static int init_mmap (struct camera *c, int again)
 {
+    struct buffer *buffers;
+    unsigned int n_buffers;
     struct v4l2_requestbuffers req = { 
-	.count = 4,
-	.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	.count = c->want_buffers,
+	.type = capture_type( c),
 	.memory = V4L2_MEMORY_MMAP,
     };
 
-    if (-1 == xioctl (videodev, VIDIOC_REQBUFS, &req)) {
+    if (-1 == xioctl (c->fd, VIDIOC_REQBUFS, &req)) {
 	if (EINVAL == errno) {
-	  fatal_f( "%s does not support memory mapping\n",videodev_name);
+	  return setup_failed( again, "%s does not support memory mapping\n",c->device);
 	} else {
-	    errno_exit ("VIDIOC_REQBUFS");
+	    return setup_error( again, "VIDIOC_REQBUFS");
 	}
     }
     
     if (req.count < 2) {
-      fatal_f("Insufficient buffer memory on %s\n",videodev_name);
+      return setup_failed( again, "Insufficient buffer memory on %s\n",c->device);
     }
+    if (req.count != c->want_buffers) log_f("%s: asked for %d buffers, got %u\n", c->name, c->want_buffers, req.count);
     
     buffers = calloc (req.count, sizeof (*buffers));
     
     if (!buffers) {
       fatal_f("Out of memory\n");
     }
+    c->buffers = buffers;   // counted as they are mapped, for release_buffers()
     
     for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-	struct v4l2_buffer buf = {
-	    .type        = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-	    .memory      = V4L2_MEMORY_MMAP,
-	    .index       = n_buffers,
-	};
+	struct v4l2_buffer buf;
+	struct v4l2_plane plane;
 
-	if (-1 == xioctl (videodev, VIDIOC_QUERYBUF, &buf)) errno_exit ("VIDIOC_QUERYBUF");
+	describe_buffer( c, n_buffers, &buf, &plane);
+	if (-1 == xioctl (c->fd, VIDIOC_QUERYBUF, &buf)) return setup_error( again, "VIDIOC_QUERYBUF");
 	
-	buffers[n_buffers].length = buf.length;
+	buffers[n_buffers].length = c->mplane ? plane.length : buf.length;
 	buffers[n_buffers].start =
 	    mmap (NULL /* start anywhere */,
-		  buf.length,
+		  buffers[n_buffers].length,
 		  PROT_READ | PROT_WRITE /* required */,
 		  MAP_SHARED /* recommended */,
-		  videodev, buf.m.offset);
+		  c->fd, c->mplane ? plane.m.mem_offset : buf.m.offset);
 	
-	if (MAP_FAILED == buffers[n_buffers].start) errno_exit ("mmap");
+	if (MAP_FAILED == buffers[n_buffers].start) return setup_error( again, "mmap");
+	buffers[n_buffers].mapped = buffers[n_buffers].length;
+
+	/*
+	** For --dmabuf-socket, each buffer as a dma-buf other processes can
+	** map without us copying, see dmabuf.c
+	*/
+	buffers[n_buffers].dmafd = -1;
+	if ( dmabuf_socket) {
+	    struct v4l2_exportbuffer exp = {
+		.type = capture_type( c),
+		.index = n_buffers,
+		.flags = O_RDONLY | O_CLOEXEC,
+	    };
+
+	    if (-1 == xioctl (c->fd, VIDIOC_EXPBUF, &exp)) {
+		if ( n_buffers == 0) log_f("%s: cannot export buffers: %s\n", c->name, strerror(errno));
+	    } else {
+		buffers[n_buffers].dmafd = exp.fd;
+	    }
+	}
+	c->n_buffers = n_buffers + 1;
+    }
+    return 0;
+}
+
+/*
+** The system's huge page size, from /proc/meminfo, or 2MB.
+*/
+static size_t huge_page_size(void)
+{
+    FILE *f = fopen( "/proc/meminfo", "r");
+    char line[128];
+    unsigned long kb = 2048;
+
+    if ( !f) return kb * 1024;
+    while ( fgets( line, sizeof(line), f)) {
+	if ( sscanf( line, "Hugepagesize: %lu kB", &kb) == 1) break;
+    }
+    fclose( f);
+    return kb * 1024;
+}
+
+/*
+** Memory for the userp buffers, as one mapping so each buffer starts on a
+** page and the driver can DMA straight into it rather than bounce. With
+** --hugepages it comes from the reserved huge pages if there are enough,
+** or else transparent huge pages are asked for, to spare the TLB at large
+** frame sizes. Nothing is touched here: queueing the buffers, on the
+** capture thread, faults the pages in, so a NUMA machine puts them on
+** that thread's node. --mlock then keeps them there.
+*/
+static char *alloc_pool( struct camera *c, size_t *mapped)
+{
+    size_t size = *mapped;
+    void *pool = MAP_FAILED;
+
+    if ( hugepages) {
+	size_t huge = huge_page_size();
+	size_t hugeSize = (size + huge - 1) / huge * huge;
+
+	pool = mmap( 0, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if ( pool != MAP_FAILED) {
+	    size = hugeSize;
+	    if ( verbose) log_f("%s: buffers in %zu huge pages\n", c->name, hugeSize / huge);
+	} else if ( verbose) {
+	    log_f("%s: no huge pages reserved (%s), asking for transparent ones\n", c->name, strerror(errno));
+	}
+    }
+    if ( pool == MAP_FAILED) {
+	pool = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( pool == MAP_FAILED) fatal_f("Out of memory\n");
+	if ( hugepages && madvise( pool, size, MADV_HUGEPAGE) != 0 && verbose) {
+	    log_f("%s: no transparent huge pages: %s\n", c->name, strerror(errno));
+	}
+    }
+    if ( lock_buffers && mlock2( pool, size, MLOCK_ONFAULT) != 0) {
+	log_f("%s: cannot lock buffers in memory: %s\n", c->name, strerror(errno));
     }
+    *mapped = size;
+    return pool;
 }
 
-void init_userp	(unsigned int buffer_size)
+static int init_userp (struct camera *c, unsigned int buffer_size, int again)
 {
     struct v4l2_requestbuffers req = {0};
+    struct buffer *buffers;
+    unsigned int n_buffers;
+    size_t page = sysconf( _SC_PAGESIZE);
+    size_t stride = (buffer_size + page - 1) / page * page;
+    size_t mapped;
+    char *pool;
     
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.count = c->want_buffers;
+    req.type = capture_type( c);
     req.memory = V4L2_MEMORY_USERPTR;
     
-    if (-1 == xioctl (videodev, VIDIOC_REQBUFS, &req)) {
+    if (-1 == xioctl (c->fd, VIDIOC_REQBUFS, &req)) {
 	if (EINVAL == errno) {
-	  fatal_f("%s does not support user pointer i/o\n",videodev_name);
+	  return setup_failed( again, "%s does not support user pointer i/o\n",c->device);
 	} else {
-	    errno_exit ("VIDIOC_REQBUFS");
+	    return setup_error( again, "VIDIOC_REQBUFS");
 	}
     }
     
-    buffers = calloc (4, sizeof (*buffers));
+    if (req.count < 2) {
+      return setup_failed( again, "Insufficient buffer memory on %s\n",c->device);
+    }
+    if (req.count != c->want_buffers) log_f("%s: asked for %d buffers, got %u\n", c->name, c->want_buffers, req.count);
+
+    buffers = calloc (req.count, sizeof (*buffers));
     
     if (!buffers) {
       fatal_f("Out of memory\n");
     }
     
-    for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
+    mapped = stride * req.count;
+    pool = alloc_pool( c, &mapped);
+    buffers[0].mapped = mapped;
+    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
 	buffers[n_buffers].length = buffer_size;
-	buffers[n_buffers].start = malloc (buffer_size);
-	
-	if (!buffers[n_buffers].start) {
-	  fatal_f( "Out of memory\n");
-	}
+	buffers[n_buffers].start = pool + n_buffers * stride;
+	buffers[n_buffers].dmafd = -1;
     }
+    c->buffers = buffers;
+    c->n_buffers = n_buffers;
+    return 0;
 }
 
+/*
+** Our formats all have one plane, so the multi-planar format says the same
+** as the single-planar one and init_device() can stick to fmt.pix.
+*/
+static void to_mplane( struct v4l2_format *fmt)
+{
+    struct v4l2_pix_format pix = fmt->fmt.pix;
+
+    memset( &fmt->fmt, 0, sizeof(fmt->fmt));
+    fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    fmt->fmt.pix_mp.width = pix.width;
+    fmt->fmt.pix_mp.height = pix.height;
+    fmt->fmt.pix_mp.pixelformat = pix.pixelformat;
+    fmt->fmt.pix_mp.field = pix.field;
+    fmt->fmt.pix_mp.num_planes = 1;
+}
 
-void init_device (void)
+static void from_mplane( struct v4l2_format *fmt)
+{
+    struct v4l2_pix_format_mplane mp = fmt->fmt.pix_mp;
+
+    memset( &fmt->fmt, 0, sizeof(fmt->fmt));
+    fmt->fmt.pix.width = mp.width;
+    fmt->fmt.pix.height = mp.height;
+    fmt->fmt.pix.pixelformat = mp.pixelformat;
+    fmt->fmt.pix.field = mp.field;
+    fmt->fmt.pix.bytesperline = mp.plane_fmt[0].bytesperline;
+    fmt->fmt.pix.sizeimage = mp.plane_fmt[0].sizeimage;
+}
+
+/*
+** Set the device up for capture, fatally at startup or, again, for
+** recover(). The caller holds the mutex.
+*/
+static int configure_device (struct camera *c, int again)
 {
     unsigned int min;
 
     unsigned int pixelformat;
 
-    switch(camera_method) {
+    switch(c->method) {
     case CAMERA_METHOD_MJPEG:
       pixelformat = V4L2_PIX_FMT_MJPEG;
       break;
@@ -324,43 +935,51 @@ void init_device (void)
       fatal_f("Unsupported camera method.\n");
     }
 
-
-    pthread_mutex_lock(&video_mutex);
     /*
     ** Is it a video device?
     */
     {
 	struct v4l2_capability cap;
 
-	if (-1 == xioctl (videodev, VIDIOC_QUERYCAP, &cap)) {
+	if (-1 == xioctl (c->fd, VIDIOC_QUERYCAP, &cap)) {
 	    if (EINVAL == errno) {
-	      fatal_f("%s is no V4L2 device\n", videodev_name);
+	      return setup_failed( again, "%s is no V4L2 device\n", c->device);
 	    } else {
-		errno_exit ("VIDIOC_QUERYCAP");
+		return setup_error( again, "VIDIOC_QUERYCAP");
 	    }
 	}
 
 	/*
-	** Can it capture?
+	** Can it capture? Ask about this node, not the whole driver, when
+	** it says. Drivers for SoC capture units often only speak the
+	** multi-planar API, even for single plane formats.
 	*/
+	if ( cap.capabilities & V4L2_CAP_DEVICE_CAPS) cap.capabilities = cap.device_caps;
 	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-	  fatal_f("%s is no video capture device\n", videodev_name);
+	  if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+	    return setup_failed( again, "%s is no video capture device\n", c->device);
+	  }
+	  if ( c->io == IO_METHOD_READ) {
+	    return setup_failed( again, "%s is multi-planar, that needs --mmap or --userp\n", c->device);
+	  }
+	  c->mplane = 1;
+	  if ( verbose) log_f("%s: using the multi-planar API\n", c->device);
 	}
 
 
 	/*
 	** Like we want it to?
 	*/
-	switch (io_method) {
+	switch (c->io) {
 	  case IO_METHOD_READ:
 	    if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-	      fatal_f( "%s does not support read i/o\n", videodev_name);
+	      return setup_failed( again, "%s does not support read i/o\n", c->device);
 	    }
 	    break;
 	  case IO_METHOD_MMAP:
 	  case IO_METHOD_USERPTR:
 	    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-	      fatal_f("%s does not support streaming i/o\n", videodev_name);
+	      return setup_failed( again, "%s does not support streaming i/o\n", c->device);
 	    }
 	    break;
 	}
@@ -368,7 +987,7 @@ void init_device (void)
 
         /* Select video input, video standard and tune here. */
 
-    add_logitech_controls(videodev);
+    add_logitech_controls(c->fd);
 
     /*
     ** Clear the crop
@@ -378,13 +997,13 @@ void init_device (void)
 	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE, 
 	};
 
-	if (0 == xioctl (videodev, VIDIOC_CROPCAP, &cropcap)) {
+	if (0 == xioctl (c->fd, VIDIOC_CROPCAP, &cropcap)) {
 	    struct v4l2_crop crop = {
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 		.c = cropcap.defrect, /* reset to default */
 	    };
 	    
-	    if (-1 == xioctl (videodev, VIDIOC_S_CROP, &crop)) {
+	    if (-1 == xioctl (c->fd, VIDIOC_S_CROP, &crop)) {
 		switch (errno) {
 		  case EINVAL:
 		    /* Cropping not supported. */
@@ -406,17 +1025,17 @@ void init_device (void)
     {
 	struct v4l2_format fmt = {
 	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-	    .fmt.pix.width = video_width,
-	    .fmt.pix.height = video_height,
+	    .fmt.pix.width = c->width,
+	    .fmt.pix.height = c->height,
 	    // .fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV,
 	    .fmt.pix.pixelformat = pixelformat,
 	    .fmt.pix.field = V4L2_FIELD_INTERLACED,
 	};
 	struct v4l2_jpegcompression comp = {
-	    .quality = quality,
+	    .quality = c->quality,
 	};
 	struct v4l2_streamparm strm = {
-	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	    .type = capture_type( c),
 	};
 
 	if ( verbose) {
@@ -426,8 +1045,10 @@ void init_device (void)
 		    (fmt.fmt.pix.pixelformat >> 16) & 0xff,
 		    (fmt.fmt.pix.pixelformat >> 24) & 0xff);
 	}
-	if (-1 == xioctl (videodev, VIDIOC_S_FMT, &fmt)) errno_exit ("VIDIOC_S_FMT");
-	if (-1 == xioctl (videodev, VIDIOC_G_FMT, &fmt)) errno_exit("VIDIOC_G_FMT");
+	if ( c->mplane) to_mplane( &fmt);
+	if (-1 == xioctl (c->fd, VIDIOC_S_FMT, &fmt)) return setup_error( again, "VIDIOC_S_FMT");
+	if (-1 == xioctl (c->fd, VIDIOC_G_FMT, &fmt)) return setup_error( again, "VIDIOC_G_FMT");
+	if ( c->mplane) from_mplane( &fmt);
 	if ( verbose) {
 	    fprintf(stderr,"got format %dx%d pf=%c%c%c%c\n", fmt.fmt.pix.width, fmt.fmt.pix.height, 
 		    fmt.fmt.pix.pixelformat & 0xff,
@@ -436,26 +1057,26 @@ void init_device (void)
 		    (fmt.fmt.pix.pixelformat >> 24) & 0xff);
 	}
 	if ( fmt.fmt.pix.pixelformat != pixelformat) {
-	  fatal_f("Unable to set requested pixelformat.\n");
+	  return setup_failed( again, "Unable to set requested pixelformat.\n");
 	}
 
-	if (-1 == xioctl( videodev, VIDIOC_G_JPEGCOMP, &comp)) {
-	    if ( errno != EINVAL) errno_exit("VIDIOC_G_JPEGCOMP");
+	if (-1 == xioctl( c->fd, VIDIOC_G_JPEGCOMP, &comp)) {
+	    if ( errno != EINVAL) return setup_error( again, "VIDIOC_G_JPEGCOMP");
 	    log_f("driver does not support VIDIOC_G_JPEGCOMP\n");
-	    comp.quality = quality;
+	    comp.quality = c->quality;
 	} else {
-	    comp.quality = quality;
-	    if (-1 == xioctl( videodev, VIDIOC_S_JPEGCOMP, &comp)) errno_exit("VIDIOC_S_JPEGCOMP");
-	    if (-1 == xioctl( videodev, VIDIOC_G_JPEGCOMP, &comp)) errno_exit("VIDIOC_G_JPEGCOMP");
+	    comp.quality = c->quality;
+	    if (-1 == xioctl( c->fd, VIDIOC_S_JPEGCOMP, &comp)) return setup_error( again, "VIDIOC_S_JPEGCOMP");
+	    if (-1 == xioctl( c->fd, VIDIOC_G_JPEGCOMP, &comp)) return setup_error( again, "VIDIOC_G_JPEGCOMP");
 	    log_f("jpegcomp quality came out at %d\n", comp.quality);
 	}
 
-	if (-1 == xioctl( videodev, VIDIOC_G_PARM, &strm)) errno_exit("VIDIOC_G_PARM");
+	if (-1 == xioctl( c->fd, VIDIOC_G_PARM, &strm)) return setup_error( again, "VIDIOC_G_PARM");
 	strm.parm.capture.timeperframe.numerator = 1;
 	if ( strm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
-	    log_f("fps=%d\n", fps);
-	    strm.parm.capture.timeperframe.denominator = fps;
-	    if (-1 == xioctl( videodev, VIDIOC_S_PARM, &strm)) {
+	    log_f("fps=%d\n", c->fps);
+	    strm.parm.capture.timeperframe.denominator = c->fps;
+	    if (-1 == xioctl( c->fd, VIDIOC_S_PARM, &strm)) {
 		log_f("failed to set fps: %s\n", strerror(errno));
 	    } else {
 		log_f("fps came out %d/%d\n", 
@@ -464,6 +1085,8 @@ void init_device (void)
 	    }
 	}
 	/* Note VIDIOC_S_FMT may change width and height. */
+	c->width = fmt.fmt.pix.width;
+	c->height = fmt.fmt.pix.height;
 	
 	/* Buggy driver paranoia. */
 	min = fmt.fmt.pix.width * 2;
@@ -473,64 +1096,83 @@ void init_device (void)
 	if (fmt.fmt.pix.sizeimage < min)
 	    fmt.fmt.pix.sizeimage = min;
 	
-	switch (io_method) {
+	switch (c->io) {
 	  case IO_METHOD_READ:
-	    init_read (fmt.fmt.pix.sizeimage);
+	    init_read (c, fmt.fmt.pix.sizeimage);
 	    break;
 	  case IO_METHOD_MMAP:
-	    init_mmap ();
-	    break;
+	    return init_mmap (c, again);
 	  case IO_METHOD_USERPTR:
-	    init_userp (fmt.fmt.pix.sizeimage);
-	    break;
+	    return init_userp (c, fmt.fmt.pix.sizeimage, again);
 	}
     }
-    pthread_mutex_unlock(&video_mutex);
+    return 0;
 }
 
-void close_device (void)
+void init_device (struct camera *c)
 {
-    pthread_mutex_lock(&video_mutex);
-    if (-1 == close (videodev)) errno_exit("close");
-    videodev = -1;
-    pthread_mutex_unlock(&video_mutex);
+    pthread_mutex_lock(&c->mutex);
+    configure_device( c, 0);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void close_device (struct camera *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    if (-1 == close (c->fd)) errno_exit("close");
+    c->fd = -1;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/*
+** Once --chroot and --uid have taken effect, whether the device can still
+** be opened by name, for recover() to do when it goes away.
+*/
+void check_reopen (struct camera *c)
+{
+    struct stat st;
+
+    c->reopen = stat (c->device, &st) == 0 && S_ISCHR (st.st_mode) && access (c->device, R_OK | W_OK) == 0;
+    if ( !c->reopen) log_f("%s: %s cannot be opened from here, losing it will be fatal\n", c->name, c->device);
 }
 
-void probe_device(void)
+void probe_device(struct camera *c)
 {
-    do_probe(videodev);
+    do_probe(c);
 }
 
-void open_device ( void)
+void open_device (struct camera *c)
 {
     struct stat st; 
     
-    if (-1 == stat (videodev_name, &st)) {
+    if (-1 == stat (c->device, &st)) {
       fatal_f( "Cannot identify '%s': %d, %s\n",
-	      videodev_name, errno, strerror (errno));
+	      c->device, errno, strerror (errno));
     }
     
     if (!S_ISCHR (st.st_mode)) {
-      fatal_f( "%s is no device\n", videodev_name);
+      fatal_f( "%s is no device\n", c->device);
     }
     
-    pthread_mutex_lock(&video_mutex);
-    videodev = open (videodev_name, O_RDWR /* required */, 0);
-    pthread_mutex_unlock(&video_mutex);
+    pthread_mutex_lock(&c->mutex);
+    c->fd = open (c->device, O_RDWR /* required */ | O_NONBLOCK, 0);
+    pthread_mutex_unlock(&c->mutex);
     
-    if (-1 == videodev) {
+    if (-1 == c->fd) {
       fatal_f( "Cannot open '%s': %d, %s\n",
-		 videodev_name, errno, strerror (errno));
+		 c->device, errno, strerror (errno));
     }
+    c->reopen = 1;   // until check_reopen() knows better
 }
 
 
 int with_device( video_action func, char *buf, int size, int cid, int val)
 {
+    struct camera *c = this_camera();
     int r;
 
-    pthread_mutex_lock(&video_mutex);
-    r = (*func)(videodev, buf, size, cid, val);
-    pthread_mutex_unlock(&video_mutex);
+    pthread_mutex_lock(&c->mutex);
+    r = (*func)(c->fd, buf, size, cid, val);
+    pthread_mutex_unlock(&c->mutex);
     return r;
 }
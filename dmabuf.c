@@ -0,0 +1,201 @@
+/*
+** Hand frames to local processes without copying them: the capture buffers
+** are exported as dma-bufs (VIDIOC_EXPBUF, see init_mmap()) and their fds
+** passed over a unix socket, then each new frame is announced by buffer
+** number. See tcdmabuf.h for the protocol.
+**
+** Each client has a thread, which holds the frame like any other reader
+** until the client says it is done, so the driver can't refill the buffer
+** under it. Only cameras using mmap have buffers to export. If the device
+** is reopened, see recover(), the buffers are new and clients are dropped
+** to connect again.
+*/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/videodev2.h>
+#include "tinycamd.h"
+#include "tcdmabuf.h"
+
+#define MAX_CLIENTS 8    // each holds a frame hazard slot
+
+static int dmabufSocket = -1;
+
+static long dmabufClients = 0;
+static long dmabufFrames = 0;
+
+struct client {
+    int fd;
+    int serial;              // of the last frame announced
+    int generation;          // of the device's buffers it was sent
+    int dead;
+};
+
+static int send_hello( struct camera *c, struct client *k)
+{
+    struct tcdmabuf_hello h = {
+	.magic = TCDMABUF_MAGIC,
+	.version = TCDMABUF_VERSION,
+	.width = c->width,
+	.height = c->height,
+    };
+    int fds[TCDMABUF_MAX_BUFFERS];
+    char control[CMSG_SPACE( sizeof(fds))];
+    struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control };
+    struct cmsghdr *cm;
+    const void *start;
+    unsigned int n;
+
+    switch ( c->method) {
+      case CAMERA_METHOD_MJPEG: h.pixelformat = V4L2_PIX_FMT_MJPEG; break;
+      case CAMERA_METHOD_JPEG:  h.pixelformat = V4L2_PIX_FMT_JPEG; break;
+      case CAMERA_METHOD_YUYV:  h.pixelformat = V4L2_PIX_FMT_YUYV; break;
+    }
+
+    pthread_mutex_lock( &c->mutex);
+    k->generation = c->generation;
+    for ( n = 0; n < TCDMABUF_MAX_BUFFERS; n++) {
+	fds[n] = buffer_dmabuf( c, n, &h.length[n], &start);
+	if ( fds[n] < 0) break;
+    }
+    pthread_mutex_unlock( &c->mutex);
+    if ( n == 0) return -1;
+    h.buffers = n;
+
+    memset( control, 0, sizeof(control));
+    msg.msg_controllen = CMSG_SPACE( n * sizeof(int));
+    cm = CMSG_FIRSTHDR( &msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN( n * sizeof(int));
+    memcpy( CMSG_DATA( cm), fds, n * sizeof(int));
+
+    return sendmsg( k->fd, &msg, MSG_NOSIGNAL) == sizeof(h) ? 0 : -1;
+}
+
+/*
+** Announce the current frame and hold it until the client is done.
+*/
+static void send_frame( const struct chunk *ch, void *arg)
+{
+    struct client *k = (struct client *)arg;
+    struct tcdmabuf_frame m = { 0 };
+    const void *data, *start;
+    unsigned int length, size;
+    char done;
+    int i;
+
+    k->serial = current_frame_serial();
+    if ( k->generation != __atomic_load_n( &this_camera()->generation, __ATOMIC_SEQ_CST)) {
+	k->dead = 1;
+	return;
+    }
+    i = current_frame_buffer( &data, &length);
+    if ( i < 0 || buffer_dmabuf( this_camera(), i, &size, &start) < 0) return;
+
+    m.buffer = i;
+    m.offset = (const char *)data - (const char *)start;
+    m.length = length;
+    m.serial = k->serial;
+    m.ms = current_frame_time();
+    if ( send( k->fd, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m) || recv( k->fd, &done, 1, 0) != 1) {
+	k->dead = 1;
+	return;
+    }
+    __atomic_fetch_add( &dmabufFrames, 1, __ATOMIC_RELAXED);
+}
+
+static void *dmabuf_client( void *arg)
+{
+    struct client k = { .fd = (int)(intptr_t)arg };
+    struct timeval tv = { .tv_sec = 1 };
+    struct camera *c;
+    char name[64];
+    int n;
+
+    setsockopt( k.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt( k.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if ( __atomic_add_fetch( &dmabufClients, 1, __ATOMIC_RELAXED) > MAX_CLIENTS) {
+	log_f("Too many dma-buf clients, refusing one.\n");
+	k.dead = 1;
+    } else {
+	n = recv( k.fd, name, sizeof(name), 0);
+	c = n > 0 ? find_camera( name, n) : cameras;
+	if ( n < 0 || !c || send_hello( c, &k) < 0) k.dead = 1;
+	else use_camera( c);
+    }
+    while ( !k.dead) {
+	// the device being set up again wakes us, to hang up at once
+	if ( !wait_for_frame_timeout( k.serial, 1000)) {
+	    if ( k.generation != __atomic_load_n( &this_camera()->generation, __ATOMIC_SEQ_CST)) k.dead = 1;
+	    continue;
+	}
+	with_current_frame( send_frame, &k);
+    }
+    __atomic_fetch_sub( &dmabufClients, 1, __ATOMIC_RELAXED);
+    close( k.fd);
+    return 0;
+}
+
+static void *dmabuf_listener( void *arg)
+{
+    for (;;) {
+	int fd = accept4( dmabufSocket, 0, 0, SOCK_CLOEXEC);
+	pthread_t thread;
+
+	if ( fd < 0) continue;
+	if ( pthread_create( &thread, 0, dmabuf_client, (void *)(intptr_t)fd)) {
+	    log_f("Failed to start dma-buf thread.\n");
+	    close( fd);
+	    continue;
+	}
+	pthread_detach( thread);
+    }
+    return 0;
+}
+
+/*
+** The socket is made now, before any chroot.
+*/
+void start_dmabuf(void)
+{
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    struct camera *c;
+    pthread_t thread;
+    const void *start;
+    unsigned int length;
+    int any = 0;
+
+    if ( !dmabuf_socket) return;
+
+    for ( c = cameras; c; c = c->next) {
+	if ( buffer_dmabuf( c, 0, &length, &start) >= 0) any = 1;
+	else log_f("%s: no dma-bufs to share, it needs --mmap and a driver with VIDIOC_EXPBUF\n", c->name);
+    }
+    if ( !any) return;
+
+    if ( strlen( dmabuf_socket) >= sizeof(a.sun_path)) fatal_f("Socket path too long: %s\n", dmabuf_socket);
+    strcpy( a.sun_path, dmabuf_socket);
+    unlink( dmabuf_socket);
+    dmabufSocket = socket( AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if ( dmabufSocket < 0) fatal_f("Failed to create dma-buf socket: %s\n", strerror(errno));
+    if ( bind( dmabufSocket, (struct sockaddr *)&a, sizeof(a)) != 0) fatal_f("Failed to bind %s: %s\n", dmabuf_socket, strerror(errno));
+    if ( listen( dmabufSocket, 8) != 0) fatal_f("Failed to listen on %s: %s\n", dmabuf_socket, strerror(errno));
+
+    add_metric( "dmabuf_clients", "Processes sharing capture buffers now.", &dmabufClients);
+    add_metric( "dmabuf_frames_total", "Frames handed over as dma-bufs.", &dmabufFrames);
+
+    if ( pthread_create( &thread, 0, dmabuf_listener, 0)) fatal_f("Failed to start dma-buf thread.\n");
+    pthread_detach( thread);
+}
@@ -0,0 +1,189 @@
+/*
+** Record only when something moves. The motion detector's score starts an
+** event when it reaches --motion-trigger, and the event runs until nothing
+** has scored half that for --event-post seconds, so a dip or two doesn't
+** chop one visit into several files.
+**
+** The event writer reads from the history ring rather than from capture,
+** starting --event-pre seconds before the onset, so the frames that were
+** already gone by the time motion was noticed still make it in. Between
+** events nothing is written at all.
+**
+** Events are recordings like recorder.c makes, named for their onset.
+*/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tinycamd.h"
+
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static int eventActive = 0;       // these guarded by event_mutex
+static int eventCount = 0;
+static long long eventStart = 0;
+static long long eventEnd = 0;    // ms of the last frame that belongs in it
+
+static struct recording event = { .fd = -1, .indexFd = -1 };
+static long events = 0;
+static long eventFrames = 0;
+
+/*
+** Motion hook, on the motion thread. Only moves state around.
+*/
+static void watch_motion( const struct motion *m, void *arg)
+{
+    int changed = 0;
+
+    pthread_mutex_lock( &event_mutex);
+    if ( !eventActive && m->score >= motion_trigger) {
+	eventActive = 1;
+	eventCount++;
+	eventStart = m->ms;
+	eventEnd = m->ms + event_post_seconds * 1000LL;
+	changed = 1;
+    } else if ( eventActive) {
+	if ( m->score >= motion_trigger / 2) eventEnd = m->ms + event_post_seconds * 1000LL;
+	else if ( m->ms > eventEnd) {
+	    eventActive = 0;
+	    changed = 1;
+	}
+    }
+    if ( changed) pthread_cond_broadcast( &event_cond);
+    pthread_mutex_unlock( &event_mutex);
+}
+
+/*
+** Copy frames from history into the event file until the event is over.
+** Cursor is the time of the last frame written, it carries across events
+** so one that starts inside the last one's tail doesn't repeat frames.
+*/
+static long long write_event( long long start, long long cursor)
+{
+    if ( !open_recording( &event, start)) return cursor;
+    events++;
+    log_f("Event %s started\n", event.name);
+
+    if ( cursor < start - event_pre_seconds * 1000LL) cursor = start - event_pre_seconds * 1000LL - 1;
+
+    for (;;) {
+	int serial = frame_serial();
+	struct image *im;
+	long long ms;
+	int done;
+
+	while ( (im = history_after( cursor, &ms))) {
+	    struct chunk c[2] = { { .data = im->data, .length = im->length }, { 0 } };
+	    int ok = append_recording( &event, c, ms);
+
+	    release_image( im);
+	    cursor = ms;
+	    if ( !ok) return cursor;
+	    eventFrames++;
+	}
+
+	pthread_mutex_lock( &event_mutex);
+	done = !eventActive && cursor >= eventEnd;
+	pthread_mutex_unlock( &event_mutex);
+	if ( done) break;
+
+	// history is a step behind capture, so this may come back once early
+	wait_for_frame( serial);
+    }
+
+    close_recording( &event);
+    log_f("Event %s ended\n", event.name);
+    return cursor;
+}
+
+static void *event_loop( void *arg)
+{
+    int handled = 0;
+    long long cursor = 0, start;
+
+    for (;;) {
+	pthread_mutex_lock( &event_mutex);
+	while ( handled == eventCount) pthread_cond_wait( &event_cond, &event_mutex);
+	handled = eventCount;
+	start = eventStart;
+	pthread_mutex_unlock( &event_mutex);
+
+	cursor = write_event( start, cursor);
+	prune_recordings( event.dir, event_megabytes, 0);
+    }
+    return 0;
+}
+
+void start_events(void)
+{
+    pthread_t thread;
+
+    if ( !event_dir) return;
+
+    event.dir = open_recording_dir( event_dir);
+    add_motion_hook( watch_motion, 0);
+
+    add_metric( "events_total", "Motion events recorded.", &events);
+    add_metric( "event_frames_total", "Frames written to motion events.", &eventFrames);
+    add_metric( "event_errors_total", "Failed writes and file creations while recording events.", &event.errors);
+
+    if ( pthread_create( &thread, 0, event_loop, 0)) fatal_f("Failed to start event thread.\n");
+    pthread_detach( thread);
+}
+
+/*
+** Describe the events on disk as JSON, oldest first, with the times of
+** their first and last frames from the index. One still being written
+** may not have all its index yet.
+*/
+int events_json( char *buf, int size)
+{
+    char **names;
+    int n = list_recordings( event.dir, &names), i, used;
+
+    used = snprintf( buf, size, "[");
+    for ( i = 0; i < n; i++) {
+	struct record_index first = { 0 }, last = { 0 };
+	struct stat st;
+	char idx[32];
+	int fd;
+
+	snprintf( idx, sizeof(idx), "%.15s.idx", names[i]);
+	fd = openat( event.dir, idx, O_RDONLY|O_CLOEXEC);
+	if ( fd >= 0) {
+	    if ( fstat( fd, &st) == 0 && st.st_size >= sizeof(first)) {
+		if ( pread( fd, &first, sizeof(first), 0) != sizeof(first) ||
+		     pread( fd, &last, sizeof(last), st.st_size - sizeof(last)) != sizeof(last)) {
+		    first.ms = last.ms = 0;
+		}
+	    }
+	    close( fd);
+	}
+	if ( fstatat( event.dir, names[i], &st, 0) != 0) st.st_size = 0;
+
+	if ( used < size) {
+	    used += snprintf( buf+used, size-used, "%s\n{\"name\":\"%s\",\"start\":%lld,\"end\":%lld,\"bytes\":%lld}",
+			      i ? "," : "", names[i], first.ms, last.ms, (long long)st.st_size);
+	}
+	free( names[i]);
+    }
+    free( names);
+    if ( used < size) used += snprintf( buf+used, size-used, "]\n");
+    return used < size ? used : size-1;
+}
+
+/*
+** Open an event's .mjpeg for reading, or -1 if there is no such event.
+*/
+int open_event( const char *name)
+{
+    if ( !event_dir || !is_recording_name( name)) return -1;
+    return openat( event.dir, name, O_RDONLY|O_CLOEXEC);
+}
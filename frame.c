@@ -1,39 +1,60 @@
 /*
-** we need this for the read/write pthread locks
+** we need this for syscall()
 */
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 
 #include <pthread.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 
+#include <time.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <linux/videodev2.h>
 
 #include "tinycamd.h"
 
+/*
+** A published frame never changes. The capture thread swaps a new one into
+** its camera's current frame and the old one is retired until no reader
+** holds it, then its buffer goes back to the driver and the descriptor is
+** reused. Everything here is about the camera this thread is using.
+*/
 struct frame {
-    pthread_rwlock_t lock; // following 4 fields guarded by lock
-    void *data;
+    const void *data;
     unsigned int length;
     unsigned int hufftabInsert;
     struct v4l2_buffer buffer;
-
-    pthread_cond_t cond;
-    pthread_mutex_t mutex;
-    int serial;            // this is guarded by mutex, not lock.
-
+    struct jpeg_index index;
+    long long ms;          // capture time, ms since the epoch
+    int serial;
+    void *copy;            // data we own rather than the driver, see keep_current_frame()
+    struct frame *next;    // retired and free lists, capture thread only
 };
 
-static struct frame currentFrame = {
-    .lock = PTHREAD_RWLOCK_INITIALIZER,
+/*
+** Readers announce the frame they are using in their own hazard slot, on
+** its own cache line, so readers never write anywhere another reader does.
+** The slots are shared by all the cameras.
+*/
+#define MAX_HAZARDS 64
 
-    // this cond and associated mutex is used to wait for the next frame
-    .cond = PTHREAD_COND_INITIALIZER,
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
-};
+struct hazard {
+    struct frame *frame;
+    int inUse;
+} __attribute__((aligned(64)));
+
+static struct hazard hazards[MAX_HAZARDS];
+static int hazardsFreed = 0;     // futex word, bumped when a slot is given back
+static pthread_key_t hazardKey;
+static pthread_once_t hazardOnce = PTHREAD_ONCE_INIT;
+static __thread struct hazard *myHazard = 0;
+static __thread int myDepth = 0;
 
 /*
 ** MPJEG files are typically, though not always, missing their DHT. If they are
@@ -78,126 +99,543 @@ static const unsigned char fixed_dht[] = {
   0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
 };
 
-static unsigned int find_hufftab_location(const unsigned char *p, unsigned int len)
+/*
+** The IJG luminance table, in zigzag order as it appears in a DQT, for
+** guessing what quality the camera chose.
+*/
+static const unsigned char std_luminance_zigzag[64] = {
+    16,  11,  12,  14,  12,  10,  16,  14,  13,  14,  18,  17,  16,  19,  24,  40,
+    26,  24,  22,  22,  24,  49,  35,  37,  29,  40,  58,  51,  61,  60,  57,  51,
+    56,  55,  64,  72,  92,  78,  64,  68,  87,  69,  55,  56,  80, 109,  81,  87,
+    95,  98, 103, 104, 103,  62,  77, 113, 121, 112, 100, 120,  92, 101, 103,  99
+};
+
+static int estimate_quality( const unsigned char *p, unsigned int len)
 {
+    unsigned long sum = 0, std = 0;
     unsigned int i;
 
-    for ( i = 0; i < len-1; i++) {
-	// Has its own DHT table
-	if ( p[i] == 0xff && p[i+1]== 0xc4) return 0;
+    // p points at the Pq/Tq byte of table 0, 8 bit precision only
+    if ( len < 65 || (p[0] & 0xf0) != 0) return 0;
+    for ( i = 0; i < 64; i++) {
+	sum += p[1+i];
+	std += std_luminance_zigzag[i];
+    }
+    sum = (sum * 100 + std/2) / std;  // the scale jpeg_quality_scaling() would have used
+    if ( sum == 0) return 100;
+    if ( sum <= 100) return (200 - sum + 1) / 2;
+    return (5000 + sum/2) / sum;
+}
+
+/*
+** Walk the markers of a JPEG from segment to segment using their lengths,
+** so nothing in the entropy coded data can fool us, and note where
+** everything is. The EOI is looked for backward from the end since some
+** cameras pad their frames. Returns 1 if it looks like a whole JPEG.
+*/
+int index_jpeg( const unsigned char *p, unsigned int len, struct jpeg_index *ix)
+{
+    unsigned int i = 2;
+
+    memset( ix, 0, sizeof(*ix));
+    if ( len < 4 || p[0] != 0xff || p[1] != 0xd8) return 0;
+
+    for (;;) {
+	unsigned int seg, m;
+
+	if ( i + 4 > len || p[i] != 0xff) return 0;
+	while ( i + 4 <= len && p[i+1] == 0xff) i++;  // fill bytes
+	m = p[i+1];
+	if ( m == 0x01 || ( m >= 0xd0 && m <= 0xd8)) {  // TEM, RSTn, SOI have no length
+	    i += 2;
+	    continue;
+	}
+	seg = (p[i+2] << 8) | p[i+3];
+	if ( seg < 2 || i + 2 + seg > len) return 0;
 
-	// Needs a DHT here
-	if ( p[i] == 0xff && p[i+1] == 0xda) return i;
+	switch( m) {
+	  case 0xc0:   // baseline, extended, and progressive huffman SOFs
+	  case 0xc1:
+	  case 0xc2:
+	    if ( seg < 8) return 0;
+	    ix->sof = i;
+	    ix->height = (p[i+5] << 8) | p[i+6];
+	    ix->width = (p[i+7] << 8) | p[i+8];
+	    break;
+	  case 0xc4:
+	    if ( ix->n_dht < MAX_JPEG_TABLES) ix->dht[ix->n_dht] = i;
+	    ix->n_dht++;
+	    break;
+	  case 0xdb:
+	    if ( ix->n_dqt == 0) ix->quality = estimate_quality( p+i+4, seg-2);
+	    if ( ix->n_dqt < MAX_JPEG_TABLES) ix->dqt[ix->n_dqt] = i;
+	    ix->n_dqt++;
+	    break;
+	  case 0xdd:
+	    if ( seg >= 4) ix->dri = (p[i+4] << 8) | p[i+5];
+	    break;
+	  case 0xd9:
+	    return 0;
+	  case 0xda:
+	    ix->sos = i;
+	    ix->scan = i + 2 + seg;
+	    break;
+	}
+	i += 2 + seg;
+	if ( ix->sos) break;
     }
-    return 0;  /* reall oughtn't get here */
+
+    if ( !ix->sof || !ix->n_dqt) return 0;
+
+    for ( i = len - 1; i > ix->scan && len - i < 4096; i--) {
+	if ( p[i-1] == 0xff && p[i] == 0xd9) {
+	    ix->eoi = i-1;
+	    return 1;
+	}
+	if ( p[i] != 0 && p[i] != 0xff) break;  // only padding may follow the EOI
+    }
+    return 0;
 }
 
+static int futex( int *uaddr, int op, int val, const struct timespec *timeout)
+{
+    return syscall( SYS_futex, uaddr, op, val, timeout, 0, 0);
+}
+
+static void release_hazard( void *arg)
+{
+    struct hazard *h = (struct hazard *)arg;
+
+    __atomic_store_n( &h->frame, 0, __ATOMIC_RELEASE);
+    __atomic_store_n( &h->inUse, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch( &hazardsFreed, 1, __ATOMIC_SEQ_CST);
+    futex( &hazardsFreed, FUTEX_WAKE_PRIVATE, 1, 0);
+}
+
+static void make_hazard_key(void)
+{
+    if ( pthread_key_create( &hazardKey, release_hazard)) fatal_f("Failed to create hazard key\n");
+}
 
 /*
-** Buf is the new buffer on the way in, but is set to the old buffer on the way out.
-** If there is no old buffer then the .type field will be zero.
+** Each thread claims a hazard slot the first time it reads a frame and gives
+** it back when it exits. The RTSP and dma-buf listeners turn clients away
+** well before the slots run out, but if they do, wait for a thread to exit.
 */
-void new_frame( void *data, unsigned int length, struct v4l2_buffer *buf)
+static struct hazard *my_hazard(void)
 {
-    struct v4l2_buffer obuf;
-    int rc;
+    static int warned = 0;
+    struct timespec ts = { .tv_sec = 1 };
+    int i;
+
+    if ( myHazard) return myHazard;
+
+    pthread_once( &hazardOnce, make_hazard_key);
+    for (;;) {
+	int freed = __atomic_load_n( &hazardsFreed, __ATOMIC_SEQ_CST);
+
+	for ( i = 0; i < MAX_HAZARDS; i++) {
+	    int free = 0;
 
-    if ( pthread_rwlock_wrlock( &currentFrame.lock)) {
-      fatal_f("Failed to acquire current frame write lock: %s\n", strerror(errno));
+	    if ( __atomic_compare_exchange_n( &hazards[i].inUse, &free, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		myHazard = &hazards[i];
+		pthread_setspecific( hazardKey, myHazard);
+		return myHazard;
+	    }
+	}
+	if ( !__atomic_exchange_n( &warned, 1, __ATOMIC_RELAXED)) log_f("out of frame hazard slots, waiting\n");
+	futex( &hazardsFreed, FUTEX_WAIT_PRIVATE, freed, &ts);
+	pthread_testcancel();
     }
-    // log_f("write locked frame\n");
+}
 
-    obuf = currentFrame.buffer;
-    currentFrame.data = data;
-    currentFrame.length = length;
-    currentFrame.hufftabInsert = (camera_method == CAMERA_METHOD_MJPEG) ? find_hufftab_location( currentFrame.data, currentFrame.length) : 0;
+/*
+** Readers want frames just by looking for them, which keeps an idle camera
+** streaming, or wakes a stopped one, see --idle-off. The clock is coarse,
+** a second is all the precision this needs.
+*/
+void want_frames(void)
+{
+    struct camera *c = this_camera();
+    struct timespec now;
 
-    if ( buf) {
-	currentFrame.buffer = *buf;
-    } else currentFrame.buffer.type = 0;
-    
-    if ( buf) *buf = obuf;
-    // log_f("new_frame %08x %d\n", (unsigned int)data, length);
+    if ( !idle_off && !governor) return;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &now);
+    if ( __atomic_load_n( &c->wanted, __ATOMIC_RELAXED) != now.tv_sec) {
+	__atomic_store_n( &c->wanted, now.tv_sec, __ATOMIC_SEQ_CST);
+    }
+    if ( !__atomic_load_n( &c->streaming, __ATOMIC_SEQ_CST)) {
+	__atomic_add_fetch( &c->wakeups, 1, __ATOMIC_SEQ_CST);
+	futex( &c->wakeups, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+    }
+}
+
+/*
+** Wake everyone waiting for c's next frame, though there is none, so they
+** look around. See recover().
+*/
+void wake_frame_waiters( struct camera *c)
+{
+    futex( &c->serial, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+}
+
+/*
+** Has anyone wanted this camera's frames in the last few seconds?
+*/
+int frames_wanted( int seconds)
+{
+    struct timespec now;
 
-    if ( pthread_rwlock_unlock( &currentFrame.lock)) {
-      fatal_f("Failed to release current frame write lock: %s\n", strerror(errno));
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec - __atomic_load_n( &this_camera()->wanted, __ATOMIC_SEQ_CST) < seconds;
+}
+
+/*
+** For the capture thread of a stopped camera, sleep until someone wants
+** frames or about ms milliseconds pass. Returns 0 if nobody did.
+*/
+int wait_for_demand( int ms)
+{
+    struct camera *c = this_camera();
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    int w = __atomic_load_n( &c->wakeups, __ATOMIC_SEQ_CST);
+
+    if ( frames_wanted( idle_off)) return 1;
+    futex( &c->wakeups, FUTEX_WAIT_PRIVATE, w, &ts);
+    return frames_wanted( idle_off);
+}
+
+/*
+** Take hold of the current frame. It stays valid until release_frame(). A
+** nested acquire gets the same frame as the outer one.
+*/
+static struct frame *acquire_frame(void)
+{
+    struct camera *c = this_camera();
+    struct hazard *h = my_hazard();
+    struct frame *f;
+
+    if ( myDepth++ > 0) return h->frame;
+
+    want_frames();
+    do {
+	f = __atomic_load_n( &c->current, __ATOMIC_ACQUIRE);
+	__atomic_store_n( &h->frame, f, __ATOMIC_SEQ_CST);
+    } while ( f != __atomic_load_n( &c->current, __ATOMIC_SEQ_CST));
+
+    return f;
+}
+
+static void release_frame( void *arg)
+{
+    if ( --myDepth == 0) __atomic_store_n( &myHazard->frame, 0, __ATOMIC_RELEASE);
+}
+
+/*
+** Give back every retired frame no reader is holding. Capture thread only.
+** Returns the number still held.
+*/
+int reclaim_frames(void)
+{
+    struct camera *c = this_camera();
+    struct frame *held[MAX_HAZARDS];
+    struct frame **p = &c->retired;
+    int n = 0, left = 0, i;
+
+    if ( !c->retired) return 0;
+
+    __atomic_thread_fence( __ATOMIC_SEQ_CST);
+    for ( i = 0; i < MAX_HAZARDS; i++) {
+	struct frame *f = __atomic_load_n( &hazards[i].frame, __ATOMIC_ACQUIRE);
+	if ( f) held[n++] = f;
     }
-    // log_f("write unlocked frame\n");
 
-    // Notify folk that the frame has changed
-    rc = pthread_mutex_lock(&currentFrame.mutex);
-    currentFrame.serial++;
-    rc = pthread_cond_broadcast(&currentFrame.cond);
-    rc = pthread_mutex_unlock(&currentFrame.mutex);
+    while ( *p) {
+	struct frame *f = *p;
+
+	for ( i = 0; i < n && held[i] != f; i++) ;
+	if ( i < n) {
+	    p = &f->next;
+	    left++;
+	    continue;
+	}
+	*p = f->next;
+	if ( f->buffer.type) requeue_buffer( &f->buffer);
+	free( f->copy);
+	f->copy = 0;
+	f->next = c->unused;
+	c->unused = f;
+    }
+    return left;
+}
+
+/*
+** When the frame was captured, as wall clock milliseconds. The driver's
+** timestamp is usually on the monotonic clock, so it is moved over.
+*/
+static long long capture_time( const struct v4l2_buffer *buf)
+{
+    struct timespec now, mono;
+    long long ms;
+
+    clock_gettime( CLOCK_REALTIME, &now);
+    ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 
-    return;
+    if ( buf && buf->timestamp.tv_sec &&
+	 (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+	clock_gettime( CLOCK_MONOTONIC, &mono);
+	ms -= mono.tv_sec * 1000LL + mono.tv_nsec / 1000000;
+	ms += buf->timestamp.tv_sec * 1000LL + buf->timestamp.tv_usec / 1000;
+    }
+    return ms;
 }
 
-static void with_current_frame_cleanup( void *arg) 
+/*
+** The driver's timestamp in microseconds on the monotonic clock, which all
+** the cameras share, or now if it has none.
+*/
+static long long capture_us( const struct v4l2_buffer *buf)
 {
-    if ( pthread_rwlock_unlock( &currentFrame.lock)) {
-	fatal_f("Failed to release current frame read lock: %s\n", strerror(errno));
+    struct timespec now;
+
+    if ( buf && buf->timestamp.tv_sec &&
+	 (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+	return buf->timestamp.tv_sec * 1000000LL + buf->timestamp.tv_usec;
     }
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
 }
 
-void with_current_frame( frame_sender func, void *arg)
+/*
+** A frame as a chunk list, with the DHT put in if it needs one. C needs
+** room for four.
+*/
+static void frame_chunks( const struct frame *f, struct chunk *c)
 {
-    struct chunk c[4];
-    int oldState;
-
-    //
-    // Well, Ick! It is undefined to unlock a rwlock that you didn't lock. That
-    // makes deciding if an unlock is needed in the face of a pthread_cancel() very
-    // ugly indeed.
-    //
-    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &oldState);
-    pthread_cleanup_push( with_current_frame_cleanup, 0);
-    if ( pthread_rwlock_rdlock( &currentFrame.lock)) {
-      fatal_f("Failed to acquire current frame read lock: %s\n", strerror(errno));
-    }
-    pthread_setcancelstate( oldState,0);
-    log_f("read locked frame\n");
-
-    if ( currentFrame.hufftabInsert == 0) {
-	c[0].data = currentFrame.data;
-	c[0].length = currentFrame.length;
+    if ( !f) {
+	c[0].data = 0;   // nothing captured yet, an empty list
+    } else if ( f->hufftabInsert == 0) {
+	c[0].data = f->data;
+	c[0].length = f->length;
 	c[1].data = 0;
     } else {
-	c[0].data = currentFrame.data;
-	c[0].length = currentFrame.hufftabInsert;
+	c[0].data = f->data;
+	c[0].length = f->hufftabInsert;
 	c[1].data = fixed_dht;
 	c[1].length = sizeof(fixed_dht);
-	c[2].data = currentFrame.data + currentFrame.hufftabInsert;
-	c[2].length = currentFrame.length - currentFrame.hufftabInsert;
+	c[2].data = f->data + f->hufftabInsert;
+	c[2].length = f->length - f->hufftabInsert;
 	c[3].data = 0;
     }
+}
+
+/*
+** Publish a new frame. Buf, if given, is the driver's buffer holding it.
+** It is handed back through requeue_buffer() once no reader can see it.
+**
+** Frames the driver flagged as broken, or JPEGs that are cut short, are not
+** published but requeued at once, so viewers keep the last good frame
+** instead of a grey smear.
+*/
+void new_frame( void *data, unsigned int length, struct v4l2_buffer *buf)
+{
+    struct camera *c = this_camera();
+    struct jpeg_index index = { 0 };
+    struct frame *f, *old;
+    long long ms;
+    int gap;
+
+    if ( buf && (buf->flags & V4L2_BUF_FLAG_ERROR)) {
+	log_f("dropping frame the driver flagged as bad (%d so far)\n", ++c->rejected);
+	requeue_buffer( buf);
+	return;
+    }
+    switch( c->method) {
+      case CAMERA_METHOD_MJPEG:
+      case CAMERA_METHOD_JPEG:
+	if ( !index_jpeg( data, length, &index)) {
+	    log_f("dropping truncated or corrupt JPEG frame (%d so far)\n", ++c->rejected);
+	    if ( buf) requeue_buffer( buf);
+	    return;
+	}
+	break;
+      case CAMERA_METHOD_YUYV:
+	if ( length < c->width * c->height * 2) {
+	    log_f("dropping short YUYV frame (%d so far)\n", ++c->rejected);
+	    if ( buf) requeue_buffer( buf);
+	    return;
+	}
+	break;
+    }
+
+    // the governor may want fewer frames than the driver can be made to give
+    ms = capture_time( buf);
+    gap = __atomic_load_n( &c->frameGap, __ATOMIC_RELAXED);
+    if ( gap && c->current && ms - c->current->ms < gap - gap/8) {
+	if ( buf) requeue_buffer( buf);
+	return;
+    }
+
+    if ( c->unused) {
+	f = c->unused;
+	c->unused = f->next;
+    } else {
+	f = malloc( sizeof(*f));
+	if ( !f) fatal_f("Out of memory\n");
+    }
+    f->data = data;
+    f->length = length;
+    f->index = index;
+    f->hufftabInsert = (c->method == CAMERA_METHOD_MJPEG && index.n_dht == 0) ? index.sos : 0;
+    f->ms = ms;
+    f->serial = c->serial + 1;
+    f->copy = 0;
+    if ( buf) f->buffer = *buf;
+    else f->buffer.type = 0;
+
+    old = __atomic_exchange_n( &c->current, f, __ATOMIC_SEQ_CST);
+    if ( old) {
+	old->next = c->retired;
+	c->retired = old;
+    }
+    reclaim_frames();
+
+    // Notify folk that the frame has changed
+    __atomic_store_n( &c->serial, f->serial, __ATOMIC_RELEASE);
+    futex( &c->serial, FUTEX_WAKE_PRIVATE, INT_MAX, 0);
+
+    if ( c->sync) {
+	struct chunk ch[4];
+
+	frame_chunks( f, ch);
+	sync_frame( ch, f->serial, f->ms, capture_us( buf));
+    }
+}
+
+/*
+** Before the capture buffers go away, put a copy of the current frame in
+** its place, so readers can still have the last good one. It is the same
+** frame, with the same serial, so nobody waiting for the next one wakes.
+** Capture thread only.
+*/
+void keep_current_frame(void)
+{
+    struct camera *c = this_camera();
+    struct frame *old = c->current, *f;
+
+    if ( !old || !old->buffer.type) return;
+
+    if ( c->unused) {
+	f = c->unused;
+	c->unused = f->next;
+    } else {
+	f = malloc( sizeof(*f));
+	if ( !f) fatal_f("Out of memory\n");
+    }
+    *f = *old;
+    f->copy = malloc( old->length);
+    if ( !f->copy) fatal_f("Out of memory\n");
+    memcpy( f->copy, old->data, old->length);
+    f->data = f->copy;
+    f->buffer.type = 0;
+
+    __atomic_store_n( &c->current, f, __ATOMIC_SEQ_CST);
+    old->next = c->retired;
+    c->retired = old;
+}
+
+void with_current_frame( frame_sender func, void *arg)
+{
+    struct chunk c[4] = { { 0, 0 } };
+    const struct frame *f;
+
+    f = acquire_frame();
+    pthread_cleanup_push( release_frame, 0);
+
+    frame_chunks( f, c);
     (*func)(c,arg);
 
     pthread_cleanup_pop( 1);
-    log_f("read unlocked frame\n");
 }
 
-static void with_next_frame_cleanup( void *arg)
+/*
+** The serial of the frame being handed out. Only meaningful from inside a
+** frame_sender called by with_current_frame().
+*/
+int current_frame_serial(void)
 {
-    pthread_mutex_unlock( &currentFrame.mutex);
+    return myHazard && myHazard->frame ? myHazard->frame->serial : 0;
 }
 
-void with_next_frame( frame_sender func, void *arg)
+/*
+** Likewise, when the frame being handed out was captured.
+*/
+long long current_frame_time(void)
 {
-    int s;
-    int oldState;
+    return myHazard && myHazard->frame ? myHazard->frame->ms : 0;
+}
 
-    log_f("with_next_frame\n");
-    pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &oldState);
-    pthread_cleanup_push( with_next_frame_cleanup, 0);
-    pthread_mutex_lock( &currentFrame.mutex);
-    pthread_setcancelstate( oldState,0);
+/*
+** Likewise, where the markers are in the frame being handed out. Offsets
+** are in the frame as captured, before any DHT is inserted.
+*/
+const struct jpeg_index *current_frame_index(void)
+{
+    static const struct jpeg_index none;
+
+    return myHazard && myHazard->frame ? &myHazard->frame->index : &none;
+}
 
-    s = currentFrame.serial;
-    while( currentFrame.serial == s) {
-	pthread_cond_wait( &currentFrame.cond, &currentFrame.mutex);
+/*
+** Likewise, which capture buffer the frame being handed out is in, -1 if
+** none, and the frame as captured, before any DHT is inserted.
+*/
+int current_frame_buffer( const void **data, unsigned int *length)
+{
+    const struct frame *f = myHazard ? myHazard->frame : 0;
+
+    if ( !f || !f->buffer.type) return -1;
+    *data = f->data;
+    *length = f->length;
+    return f->buffer.index;
+}
+
+/*
+** Sleep on the serial word until it moves past s. The futex wait is not a
+** cancellation point, so wake now and then to let the watchdog in.
+*/
+void wait_for_frame( int s)
+{
+    struct timespec ts = { .tv_sec = 1 };
+    int *serial = &this_camera()->serial;
+
+    want_frames();
+    while ( __atomic_load_n( serial, __ATOMIC_ACQUIRE) == s) {
+	futex( serial, FUTEX_WAIT_PRIVATE, s, &ts);
+	pthread_testcancel();
     }
-    pthread_cleanup_pop( 1);
-    with_current_frame( func, arg);
 }
 
+/*
+** The same, but give up after about ms milliseconds. Returns 0 if it did.
+*/
+int wait_for_frame_timeout( int s, int ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    int *serial = &this_camera()->serial;
+
+    want_frames();
+    if ( __atomic_load_n( serial, __ATOMIC_ACQUIRE) == s) futex( serial, FUTEX_WAIT_PRIVATE, s, &ts);
+    return __atomic_load_n( serial, __ATOMIC_ACQUIRE) != s;
+}
+
+int frame_serial(void)
+{
+    return __atomic_load_n( &this_camera()->serial, __ATOMIC_ACQUIRE);
+}
+
+void with_next_frame( frame_sender func, void *arg)
+{
+    wait_for_frame( frame_serial());
+    with_current_frame( func, arg);
+}
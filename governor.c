@@ -0,0 +1,202 @@
+/*
+** Turn the cameras down while the box is too busy, and back up when it is
+** quiet, so that a router with a few viewers of a YUYV camera still answers
+** its other jobs. Busy is the whole machine's CPU use, or more images
+** waiting to be encoded than there are CPUs to encode them.
+**
+** Going down, a camera first loses frames a second, to --min-fps, then
+** quality, to --min-quality. Going up undoes it in the opposite order, to
+** what the options asked for. Only cameras somebody is watching are turned
+** down, the others cost next to nothing. Down is quick and up is slow, so
+** that it doesn't hunt.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tinycamd.h"
+
+#define HOT_SECONDS   2     // this long too busy before turning down
+#define COOL_SECONDS  5     // this long quiet before turning up
+#define QUALITY_STEP  10
+
+struct gear {
+    struct camera *camera;
+    int maxFps, maxQuality;
+    int fps, quality;
+    int soft;               // the driver can't change its rate, we drop frames
+};
+
+static struct gear *gears;
+static int n_gears;
+static int statFd = -1;     // kept open, /proc is gone after a chroot
+static int cpus = 1;
+static unsigned long long lastBusy, lastTotal;
+
+static long cpuPercent = 0;
+static long backlog = 0;
+static long governedFps = 0;
+static long governedQuality = 0;
+static long stepsDown = 0;
+static long stepsUp = 0;
+
+/*
+** Percent of the machine's CPU time that was busy since the last call.
+*/
+static int cpu_busy(void)
+{
+    unsigned long long v[8] = { 0 }, busy, total = 0;
+    char buf[256];
+    int n, i, pct = 0;
+
+    n = pread( statFd, buf, sizeof(buf) - 1, 0);
+    if ( n <= 0) return 0;
+    buf[n] = 0;
+    if ( sscanf( buf, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		 &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4) return 0;
+
+    for ( i = 0; i < 8; i++) total += v[i];
+    busy = total - v[3] - v[4];          // idle and iowait
+    if ( lastTotal && total > lastTotal) pct = 100 * (busy - lastBusy) / (total - lastTotal);
+    lastBusy = busy;
+    lastTotal = total;
+    return pct;
+}
+
+static void set_fps( struct gear *g, int fps)
+{
+    struct camera *c = g->camera;
+
+    g->fps = fps;
+    if ( !g->soft && set_frame_rate( c, fps)) {
+	__atomic_store_n( &c->frameGap, 0, __ATOMIC_RELAXED);
+	return;
+    }
+    g->soft = 1;
+    __atomic_store_n( &c->frameGap, fps < g->maxFps ? 1000 / fps : 0, __ATOMIC_RELAXED);
+}
+
+static int step_down( struct gear *g)
+{
+    if ( g->fps > min_fps) {
+	int fps = g->fps * 2 / 3;
+
+	if ( fps >= g->fps) fps = g->fps - 1;
+	set_fps( g, fps < min_fps ? min_fps : fps);
+	return 1;
+    }
+    if ( g->camera->method == CAMERA_METHOD_YUYV && g->quality > min_quality) {
+	g->quality -= QUALITY_STEP;
+	if ( g->quality < min_quality) g->quality = min_quality;
+	__atomic_store_n( &g->camera->quality, g->quality, __ATOMIC_RELAXED);
+	return 1;
+    }
+    return 0;
+}
+
+static int step_up( struct gear *g)
+{
+    if ( g->quality < g->maxQuality) {
+	g->quality += QUALITY_STEP;
+	if ( g->quality > g->maxQuality) g->quality = g->maxQuality;
+	__atomic_store_n( &g->camera->quality, g->quality, __ATOMIC_RELAXED);
+	return 1;
+    }
+    if ( g->fps < g->maxFps) {
+	int fps = g->fps * 3 / 2;
+
+	if ( fps <= g->fps) fps = g->fps + 1;
+	set_fps( g, fps > g->maxFps ? g->maxFps : fps);
+	return 1;
+    }
+    return 0;
+}
+
+static void *governor_loop( void *arg)
+{
+    int hot = 0, cool = 0, i;
+
+    for (;;) {
+	int busy, waiting;
+
+	sleep( 1);
+	busy = cpu_busy();
+	waiting = derived_backlog();
+	cpuPercent = busy;
+	backlog = waiting;
+
+	if ( busy >= cpu_high || waiting > cpus) {
+	    hot++;
+	    cool = 0;
+	} else if ( busy < cpu_low && waiting == 0) {
+	    cool++;
+	    hot = 0;
+	} else {
+	    hot = cool = 0;
+	}
+	if ( hot < HOT_SECONDS && cool < COOL_SECONDS) continue;
+
+	for ( i = 0; i < n_gears; i++) {
+	    struct gear *g = &gears[i];
+
+	    if ( hot) {
+		use_camera( g->camera);
+		if ( frames_wanted( HOT_SECONDS + 1) && step_down( g)) {
+		    stepsDown++;
+		    log_f("%s: busy, down to %d fps, quality %d\n", g->camera->name, g->fps, g->quality);
+		}
+	    } else if ( step_up( g)) {
+		stepsUp++;
+		if ( verbose) log_f("%s: quiet, up to %d fps, quality %d\n", g->camera->name, g->fps, g->quality);
+	    }
+	}
+	use_camera( 0);
+	governedFps = gears[0].fps;
+	governedQuality = gears[0].quality;
+	hot = cool = 0;
+    }
+    return 0;
+}
+
+/*
+** Before the chroot, it needs /proc/stat.
+*/
+void start_governor(void)
+{
+    struct camera *c;
+    pthread_t thread;
+    int i;
+
+    if ( !governor) return;
+
+    statFd = open( "/proc/stat", O_RDONLY | O_CLOEXEC);
+    if ( statFd < 0) fatal_f("Failed to open /proc/stat for the governor: %s\n", strerror(errno));
+    cpus = sysconf( _SC_NPROCESSORS_ONLN);
+    if ( cpus < 1) cpus = 1;
+    cpu_busy();
+
+    for ( c = cameras; c; c = c->next) n_gears++;
+    gears = calloc( n_gears, sizeof(*gears));
+    if ( !gears) fatal_f("Out of memory\n");
+    for ( c = cameras, i = 0; c; c = c->next, i++) {
+	gears[i].camera = c;
+	gears[i].fps = gears[i].maxFps = c->fps;
+	gears[i].quality = gears[i].maxQuality = c->quality;
+    }
+    governedFps = gears[0].fps;
+    governedQuality = gears[0].quality;
+
+    add_metric( "governor_cpu_percent", "Machine CPU use the governor last saw.", &cpuPercent);
+    add_metric( "governor_backlog", "Requests making or waiting for an encoded image.", &backlog);
+    add_metric( "governor_fps", "Frames a second the governor allows the first camera.", &governedFps);
+    add_metric( "governor_quality", "Quality the governor allows the first camera.", &governedQuality);
+    add_metric( "governor_steps_down_total", "Times a camera was turned down for load.", &stepsDown);
+    add_metric( "governor_steps_up_total", "Times a camera was turned back up.", &stepsUp);
+
+    if ( pthread_create( &thread, 0, governor_loop, 0)) fatal_f("Failed to start governor thread.\n");
+    pthread_detach( thread);
+}
@@ -0,0 +1,260 @@
+/*
+** A ring of the last few seconds of frames, so you can look at what happened
+** just before you noticed something. Frames are copied, as JPEG, into one
+** big arena and an index of them is kept in capture order.
+**
+** There is one writer, the history thread. Readers take no locks: every index
+** entry has a sequence number which is odd while it is being changed, and a
+** reader copies the frame out and then checks the number didn't move.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tinycamd.h"
+
+struct history_entry {
+    unsigned int seq;
+    int serial;
+    long long ms;
+    unsigned int offset;
+    unsigned int length;
+};
+
+static unsigned char *arena = 0;
+static unsigned int arenaSize = 0;
+static unsigned int writePos = 0;       // writer only
+
+static struct history_entry *entries = 0;
+static unsigned int capacity = 0;
+static unsigned int head = 0;           // next entry to write, entries[pos % capacity]
+static unsigned int tail = 0;           // oldest live entry
+
+static void evict_oldest(void)
+{
+    struct history_entry *e = &entries[tail % capacity];
+
+    __atomic_store_n( &e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_RELEASE);
+    __atomic_store_n( &tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+** Make room for len bytes at writePos, throwing out the oldest frames until
+** it fits. Live frames always run from the tail entry around to writePos.
+*/
+static void make_room( unsigned int len)
+{
+    for (;;) {
+	unsigned int t;
+
+	if ( tail == head) {
+	    writePos = 0;
+	    return;
+	}
+	if ( head - tail >= capacity) {
+	    evict_oldest();
+	    continue;
+	}
+	t = entries[tail % capacity].offset;
+	if ( t >= writePos) {
+	    if ( t - writePos >= len) return;
+	} else {
+	    if ( arenaSize - writePos >= len) return;
+	    if ( t >= len) {
+		writePos = 0;
+		return;
+	    }
+	}
+	evict_oldest();
+    }
+}
+
+struct arrival {
+    int serial;
+    long long ms;
+};
+
+static void store_history( const struct chunk *c, void *arg)
+{
+    struct arrival *a = (struct arrival *)arg;
+    struct history_entry *e;
+    unsigned int len = 0, off;
+    int i;
+
+    for ( i = 0; c[i].data; i++) len += c[i].length;
+    if ( len == 0 || len > arenaSize) return;
+
+    // too old to keep
+    while ( tail != head && entries[tail % capacity].ms < a->ms - history_seconds*1000LL) evict_oldest();
+    make_room( len);
+
+    e = &entries[head % capacity];
+    __atomic_store_n( &e->seq, e->seq | 1, __ATOMIC_RELAXED);   // already odd if evicted
+    __atomic_thread_fence( __ATOMIC_RELEASE);
+
+    for ( i = 0, off = writePos; c[i].data; i++) {
+	memcpy( arena + off, c[i].data, c[i].length);
+	off += c[i].length;
+    }
+    e->serial = a->serial;
+    e->ms = a->ms;
+    e->offset = writePos;
+    e->length = len;
+    writePos += len;
+
+    __atomic_store_n( &e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n( &head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void capture_history( const struct chunk *c, void *arg)
+{
+    struct arrival a = { .serial = current_frame_serial(), .ms = current_frame_time() };
+
+    if ( !c[0].data) return;
+    with_jpeg_frame( store_history, &a);
+}
+
+static void *history_loop( void *arg)
+{
+    int last = 0;
+
+    for (;;) {
+	wait_for_frame( last);
+	last = frame_serial();
+	with_current_frame( capture_history, 0);
+    }
+    return 0;
+}
+
+void start_history(void)
+{
+    pthread_t thread;
+    int fps = this_camera()->fps;
+    int rate = fps > 30 ? fps : 30;
+
+    if ( history_seconds <= 0) return;
+
+    arenaSize = history_megabytes * 1024 * 1024;
+    capacity = history_seconds * rate + 16;
+    arena = malloc( arenaSize);
+    entries = calloc( capacity, sizeof(*entries));
+    if ( !arena || !entries) fatal_f("Failed to allocate %d MB for history\n", history_megabytes);
+
+    if ( pthread_create( &thread, 0, history_loop, 0)) fatal_f("Failed to start history thread.\n");
+    pthread_detach( thread);
+}
+
+/*
+** Copy out entry pos, if it is still there.
+*/
+static struct image *copy_entry( unsigned int pos, int *serial, long long *ms)
+{
+    struct history_entry *e = &entries[pos % capacity];
+    struct image *im;
+    unsigned int seq, offset, length;
+
+    seq = __atomic_load_n( &e->seq, __ATOMIC_ACQUIRE);
+    if ( seq & 1) return 0;
+    offset = e->offset;
+    length = e->length;
+    if ( serial) *serial = e->serial;
+    if ( ms) *ms = e->ms;
+    if ( offset + length > arenaSize) return 0;
+
+    im = new_image( length);
+    memcpy( im->data, arena + offset, length);
+    im->length = length;
+
+    __atomic_thread_fence( __ATOMIC_ACQUIRE);
+    if ( __atomic_load_n( &e->seq, __ATOMIC_RELAXED) != seq ||
+	 pos - __atomic_load_n( &tail, __ATOMIC_ACQUIRE) >= capacity) {
+	release_image( im);
+	return 0;
+    }
+    return im;
+}
+
+/*
+** Binary search for the first live entry whose key is at least want. The
+** entries may be evicted under us, that just makes copy_entry() fail later.
+*/
+static unsigned int search( long long want, int by_serial)
+{
+    unsigned int lo = __atomic_load_n( &tail, __ATOMIC_ACQUIRE);
+    unsigned int hi = __atomic_load_n( &head, __ATOMIC_ACQUIRE);
+
+    while ( lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	struct history_entry *e = &entries[mid % capacity];
+	long long key = by_serial ? e->serial : e->ms;
+
+	if ( key < want) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo;
+}
+
+struct image *history_by_serial( int serial)
+{
+    unsigned int pos;
+    struct image *im;
+    int got;
+
+    if ( !entries) return 0;
+    pos = search( serial, 1);
+    if ( pos == __atomic_load_n( &head, __ATOMIC_ACQUIRE)) return 0;
+    im = copy_entry( pos, &got, 0);
+    if ( im && got != serial) {
+	release_image( im);
+	return 0;
+    }
+    return im;
+}
+
+/*
+** The frame captured nearest to ms.
+*/
+struct image *history_at( long long ms, long long *when)
+{
+    unsigned int pos, first, last;
+    long long before, after;
+    struct image *a, *b;
+
+    if ( !entries) return 0;
+    first = __atomic_load_n( &tail, __ATOMIC_ACQUIRE);
+    last = __atomic_load_n( &head, __ATOMIC_ACQUIRE);
+    if ( first == last) return 0;
+
+    pos = search( ms, 0);
+    if ( pos == first) return copy_entry( pos, 0, when);
+    if ( pos == last) return copy_entry( pos-1, 0, when);
+
+    a = copy_entry( pos-1, 0, &before);
+    b = copy_entry( pos, 0, &after);
+    if ( a && b) {
+	if ( ms - before <= after - ms) {
+	    release_image( b);
+	    b = 0;
+	} else {
+	    release_image( a);
+	    a = 0;
+	}
+    }
+    if ( when) *when = a ? before : after;
+    return a ? a : b;
+}
+
+/*
+** The first frame captured after ms, for walking through a stretch.
+*/
+struct image *history_after( long long ms, long long *when)
+{
+    unsigned int pos;
+
+    if ( !entries) return 0;
+    pos = search( ms + 1, 0);
+    if ( pos == __atomic_load_n( &head, __ATOMIC_ACQUIRE)) return 0;
+    return copy_entry( pos, 0, when);
+}
@@ -46,6 +46,7 @@ struct http_request {
     int protocol;    // 0x10 = 1.0, 0x11 = 1.1
     int socket;
     int sentStatus;
+    int sentHeaders; // for bodies sent in chunks, no Content-length
     void (*func)(HTTPD_Request req, const char *method, const char *url);
     char authorization[1024];
 };
@@ -160,7 +161,7 @@ static char *sgets(char *sbuf, int size, int sock)
 }
 
 
-static int base64decode( char *out, int outLen, char *in)
+int HTTPD_Base64_Decode( char *out, int outLen, const char *in)
 {
     int i24 = 0;
     int n = 0;
@@ -225,6 +226,7 @@ static void *request_loop( HTTPD_Request req)
 	// Reset in case we are on a keep alive connection
 	//
 	req->sentStatus = 0;
+	req->sentHeaders = 0;
 
 	//
 	// Clear our authorization string
@@ -258,7 +260,7 @@ static void *request_loop( HTTPD_Request req)
 	    if ( line[0] == '\n' || line[0] == '\r') break;
 
 	    if ( sscanf( line, "Authorization: Basic %1023s", buf) == 1) {
-		base64decode( req->authorization, sizeof( req->authorization), buf);
+		HTTPD_Base64_Decode( req->authorization, sizeof( req->authorization), buf);
 		log_f("Authenticate: Basic %s\n", req->authorization);
 	    }
 	    //log_f("Header: %s", line);
@@ -497,3 +499,35 @@ const char *HTTPD_Get_Authorization( HTTPD_Request req)
     else return req->authorization;
 }
 
+
+//
+// For bodies of unknown length, e.g. a multipart stream. The headers are ended
+// by the first chunk, and since there is no Content-length the connection
+// can't be kept alive afterward. Returns 0 once the client has gone away.
+//
+int HTTPD_Send_Body_Chunk(HTTPD_Request req, const void *data, int length)
+{
+    if ( !req->sentStatus) HTTPD_Send_Status(req,200,"OK");
+
+    if ( !req->sentHeaders) {
+	Send_Buffer( req, "\r\n", 2);
+	req->sentHeaders = 1;
+	req->protocol = 0x10;
+    }
+    return Send_Buffer( req, data, length);
+}
+
+//
+// Flush what we have out to the client and give the request more time. Long
+// running streams call this after every part.
+//
+void HTTPD_Push( HTTPD_Request req)
+{
+    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero))) {
+	log_f("Failed to un-TCP_CORK for HTTPD: %s\n", strerror(errno));
+    }
+    if ( setsockopt(req->socket, IPPROTO_TCP, TCP_CORK, &one, sizeof(one))) {
+	log_f("Failed to TCP_CORK for HTTPD: %s\n", strerror(errno));
+    }
+    set_deadline( req, MAX_HTTPD_TIMEOUT);
+}
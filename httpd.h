@@ -10,9 +10,10 @@ pthread_t HTTPD_Start(const char *bindName, void (*func)(HTTPD_Request req, cons
 void HTTPD_Send_Status( HTTPD_Request req, int status, const char *text);      // optional, will be sent as 200 if you try to skip it
 void HTTPD_Add_Header( HTTPD_Request req, const char *h);  // optional
 void HTTPD_Send_Body( HTTPD_Request req, const void *data, int length);
-void HTTPD_Send_Body_Chunk(HTTPD_Request req, const void *data, int length);
+int HTTPD_Send_Body_Chunk(HTTPD_Request req, const void *data, int length);  // 0 if the client is gone
 void HTTPD_Push( HTTPD_Request req);
 
 const char *HTTPD_Get_Authorization( HTTPD_Request req);  // NULL if none given
+int HTTPD_Base64_Decode( char *out, int outLen, const char *in);  // nonzero if out is too small
 
 #endif
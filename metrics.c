@@ -0,0 +1,40 @@
+/*
+** Counters that other modules register, served as text from /metrics in the
+** one-per-line "name value" form Prometheus and friends can scrape.
+*/
+#include <stdio.h>
+
+#include "tinycamd.h"
+
+#define MAX_METRICS 64
+
+static struct {
+    const char *name;
+    const char *help;
+    const long *value;
+} metrics[MAX_METRICS];
+static int n_metrics = 0;
+
+/*
+** Only call this while starting up, before the HTTP side is running.
+*/
+void add_metric( const char *name, const char *help, const long *value)
+{
+    if ( n_metrics == MAX_METRICS) fatal_f("Too many metrics, increase MAX_METRICS\n");
+    metrics[n_metrics].name = name;
+    metrics[n_metrics].help = help;
+    metrics[n_metrics].value = value;
+    n_metrics++;
+}
+
+int format_metrics( char *buf, int size)
+{
+    int i, used = 0;
+
+    for ( i = 0; i < n_metrics && used < size; i++) {
+	used += snprintf( buf+used, size-used, "# HELP tinycamd_%s %s\ntinycamd_%s %ld\n",
+			  metrics[i].name, metrics[i].help,
+			  metrics[i].name, __atomic_load_n( metrics[i].value, __ATOMIC_RELAXED));
+    }
+    return used < size ? used : size-1;
+}
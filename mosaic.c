@@ -0,0 +1,117 @@
+/*
+** All the cameras tiled into one picture, for a wall display that would
+** rather make one request than one per camera. The mosaic is made at most
+** once a tick, 1/mosaic_fps seconds, and shared by everyone watching it.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinycamd.h"
+
+static pthread_mutex_t mosaic_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct image *mosaic = 0;     // these guarded by mosaic_mutex
+static int mosaicSerial = 0;
+static long long mosaicMs = 0;
+
+static long mosaicFrames = 0;
+static long mosaicDecoded = 0;
+
+static long long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/*
+** Each camera's frame as /cam/NAME/image.jpg would serve it, tiled.
+*/
+static struct image *make_mosaic(void)
+{
+    struct camera *was = this_camera(), *c;
+    struct image **frames;
+    const struct chunk **tiles;
+    struct chunk *chunks;
+    struct image *im;
+    int n = 0, cols = mosaic_columns, decoded = 0, i;
+
+    for ( c = cameras; c; c = c->next) n++;
+    frames = calloc( n, sizeof(*frames));
+    tiles = calloc( n, sizeof(*tiles));
+    chunks = calloc( 2*n, sizeof(*chunks));
+    if ( !frames || !tiles || !chunks) fatal_f("Out of memory\n");
+
+    for ( c = cameras, i = 0; c; c = c->next, i++) {
+	use_camera( c);
+	with_jpeg_frame( copy_frame, &frames[i]);
+	if ( !frames[i]) continue;
+	chunks[2*i].data = frames[i]->data;
+	chunks[2*i].length = frames[i]->length;
+	tiles[i] = &chunks[2*i];
+    }
+    use_camera( was);
+
+    if ( cols <= 0) for ( cols = 1; cols*cols < n; cols++) ;
+    if ( cols > n) cols = n;
+    im = mosaic_jpeg( tiles, n, cols, 0, &decoded);
+    mosaicDecoded += decoded;
+
+    for ( i = 0; i < n; i++) if ( frames[i]) release_image( frames[i]);
+    free( chunks);
+    free( tiles);
+    free( frames);
+    return im;
+}
+
+/*
+** The latest mosaic, made afresh if it is a tick old. A caller that already
+** has the latest, after is its serial, waits for the next tick. Returns 0,
+** though *serial still moves on, if no camera had a frame.
+*/
+struct image *mosaic_image( int after, int *serial)
+{
+    long long tick = 1000 / mosaic_fps;
+    struct image *im;
+    int oldState;
+
+    pthread_mutex_lock( &mosaic_mutex);
+    for (;;) {
+	long long now = now_ms();
+
+	if ( mosaicSerial && now - mosaicMs < tick) {
+	    long long wait = mosaicMs + tick - now;
+
+	    if ( mosaicSerial != after) break;
+	    pthread_mutex_unlock( &mosaic_mutex);
+	    usleep( wait * 1000);
+	    pthread_mutex_lock( &mosaic_mutex);
+	    continue;
+	}
+
+	pthread_setcancelstate( PTHREAD_CANCEL_DISABLE, &oldState);
+	if ( mosaic) release_image( mosaic);
+	mosaic = make_mosaic();
+	if ( mosaic) mosaicFrames++;
+	mosaicSerial++;
+	mosaicMs = now;
+	pthread_setcancelstate( oldState, 0);
+	break;
+    }
+    im = mosaic;
+    if ( im) retain_image( im);
+    *serial = mosaicSerial;
+    pthread_mutex_unlock( &mosaic_mutex);
+
+    return im;
+}
+
+void start_mosaic(void)
+{
+    add_metric( "mosaic_frames_total", "Mosaics made for /mosaic.jpg and /mosaic.mjpeg.", &mosaicFrames);
+    add_metric( "mosaic_decoded_tiles_total", "Mosaic tiles which had to be decoded, not copied.", &mosaicDecoded);
+}
@@ -0,0 +1,607 @@
+/*
+** Motion detection that a router can afford. Each 8x8 block of the picture
+** is boiled down to its average brightness and compared with a slowly moving
+** background. For MJPEG that is just the DC coefficient of each luma block:
+** the entropy coded data is Huffman decoded, AC coefficients are skipped
+** over, and nothing is ever inverse transformed. For YUYV a row of luma
+** samples from each block stands in for the block.
+**
+** Results go to whoever registered with add_motion_hook() and to /motion.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tinycamd.h"
+
+/*
+** A Huffman table, with a 9 bit lookahead for the short codes.
+*/
+#define LOOK_BITS 9
+
+struct huff {
+    unsigned short look[1 << LOOK_BITS];   // length << 8 | symbol, 0 if longer
+    int maxcode[18];                        // -1 if no codes this long
+    int valptr[17];
+    int mincode[17];
+    unsigned char vals[256];
+};
+
+struct bits {
+    const unsigned char *p, *end;
+    unsigned long long acc;                 // left aligned
+    int n;
+    int marker;                             // ran into a marker, feeding zeros
+};
+
+static void fill( struct bits *b)
+{
+    while ( b->n <= 56) {
+	unsigned int c = 0;
+
+	if ( !b->marker && b->p < b->end) {
+	    c = *b->p++;
+	    if ( c == 0xff) {
+		if ( b->p < b->end && *b->p == 0) b->p++;
+		else {
+		    b->marker = 1;
+		    b->p--;
+		    c = 0;
+		}
+	    }
+	}
+	b->acc |= (unsigned long long)c << (56 - b->n);
+	b->n += 8;
+    }
+}
+
+static inline unsigned int get_bits( struct bits *b, int k)
+{
+    unsigned int v;
+
+    if ( k == 0) return 0;
+    v = b->acc >> (64 - k);
+    b->acc <<= k;
+    b->n -= k;
+    return v;
+}
+
+static inline int decode( struct bits *b, const struct huff *h)
+{
+    unsigned int e, l;
+    int code;
+
+    if ( b->n < 32) fill( b);
+    e = h->look[ b->acc >> (64 - LOOK_BITS)];
+    if ( e) {
+	get_bits( b, e >> 8);
+	return e & 0xff;
+    }
+    for ( l = LOOK_BITS + 1; l <= 16; l++) {
+	code = b->acc >> (64 - l);
+	if ( code <= h->maxcode[l]) {
+	    get_bits( b, l);
+	    return h->vals[ h->valptr[l] + code - h->mincode[l]];
+	}
+    }
+    return -1;
+}
+
+/*
+** Build a table from a DHT's counts and symbols, as in Annex C.
+*/
+static int build_huff( struct huff *h, const unsigned char *counts, const unsigned char *vals)
+{
+    int l, i, k = 0, code = 0;
+
+    memset( h, 0, sizeof(*h));
+    for ( l = 1; l <= 16; l++) {
+	h->valptr[l] = k;
+	h->mincode[l] = code;
+	for ( i = 0; i < counts[l-1]; i++, k++, code++) {
+	    if ( k >= 256) return 0;
+	    h->vals[k] = vals[k];
+	    if ( l <= LOOK_BITS) {
+		int shift = LOOK_BITS - l, j;
+
+		for ( j = 0; j < (1 << shift); j++) h->look[ (code << shift) | j] = (l << 8) | vals[k];
+	    }
+	}
+	h->maxcode[l] = counts[l-1] ? code - 1 : -1;
+	code <<= 1;
+    }
+    h->maxcode[17] = 0x7fffffff;
+    return 1;
+}
+
+static struct huff dcTables[4], acTables[4];
+static unsigned char dhtSeen[1024];
+static unsigned int dhtSeenLength = 0;
+
+/*
+** Load every table in the DHT segments. Cameras send the same ones every
+** frame, so they are only rebuilt when they change.
+*/
+static int load_tables( const unsigned char **segs, int n)
+{
+    unsigned char all[1024];
+    unsigned int used = 0;
+    int i;
+
+    for ( i = 0; i < n; i++) {
+	unsigned int len = (segs[i][2] << 8) | segs[i][3];
+
+	if ( used + len > sizeof(all)) return 0;
+	memcpy( all + used, segs[i] + 2, len);
+	used += len;
+    }
+    if ( used == dhtSeenLength && memcmp( all, dhtSeen, used) == 0) return 1;
+    dhtSeenLength = 0;
+
+    for ( i = 0; i < n; i++) {
+	const unsigned char *p = segs[i] + 4;
+	const unsigned char *end = segs[i] + 2 + ((segs[i][2] << 8) | segs[i][3]);
+
+	while ( p + 17 <= end) {
+	    int tc = p[0] >> 4, th = p[0] & 15, total = 0, k;
+
+	    for ( k = 0; k < 16; k++) total += p[1+k];
+	    if ( th > 3 || tc > 1 || p + 17 + total > end) return 0;
+	    if ( !build_huff( tc ? &acTables[th] : &dcTables[th], p+1, p+17)) return 0;
+	    p += 17 + total;
+	}
+    }
+    memcpy( dhtSeen, all, used);
+    dhtSeenLength = used;
+    return 1;
+}
+
+/*
+** What we keep per 8x8 block, in the camera's own orientation.
+*/
+static int cols = 0, rows = 0;
+static unsigned short *level = 0;     // this frame, 0-255
+static unsigned int *background = 0;  // running average, 8.8 fixed point
+static int haveBackground = 0;
+
+static void size_grid( int c, int r)
+{
+    if ( c == cols && r == rows) return;
+    cols = c;
+    rows = r;
+    level = realloc( level, cols * rows * sizeof(*level));
+    background = realloc( background, cols * rows * sizeof(*background));
+    if ( !level || !background) fatal_f("Out of memory\n");
+    haveBackground = 0;
+}
+
+/*
+** Walk the scan of a baseline JPEG and note the DC of every luma block.
+** Returns 0 for anything we can't follow, e.g. a progressive frame.
+*/
+static int jpeg_levels( const unsigned char *p, const struct jpeg_index *ix, const unsigned char *dht)
+{
+    const unsigned char *segs[MAX_JPEG_TABLES];
+    const unsigned char *sof = p + ix->sof, *sos = p + ix->sos;
+    int nf = sof[9], ns = sos[4];
+    int hs[4], vs[4], order[4], hmax = 1, vmax = 1;
+    const struct huff *dc[4], *ac[4];
+    int pred[4] = { 0 };
+    int q0 = 0, i, j, n_seg;
+    int mcusX, mcusY, mx, my, togo;
+    struct bits b;
+
+    if ( p[ix->sof+1] == 0xc2 || nf < 1 || nf > 3 || ns != nf) return 0;
+
+    for ( i = 0; i < nf; i++) {
+	hs[i] = sof[11 + i*3] >> 4;
+	vs[i] = sof[11 + i*3] & 15;
+	if ( hs[i] < 1 || hs[i] > 2 || vs[i] < 1 || vs[i] > 2) return 0;
+	if ( hs[i] > hmax) hmax = hs[i];
+	if ( vs[i] > vmax) vmax = vs[i];
+    }
+    if ( nf == 1) hs[0] = vs[0] = hmax = vmax = 1;   // a lone component is not interleaved
+
+    // the luma DC quantizer, to get back to brightness
+    for ( i = 0; i < ix->n_dqt && i < MAX_JPEG_TABLES && !q0; i++) {
+	const unsigned char *d = p + ix->dqt[i] + 4;
+	const unsigned char *end = p + ix->dqt[i] + 2 + ((p[ix->dqt[i]+2] << 8) | p[ix->dqt[i]+3]);
+
+	while ( d < end) {
+	    int size = (d[0] >> 4) ? 129 : 65;
+	    if ( (d[0] & 15) == sof[12]) {
+		q0 = (d[0] >> 4) ? (d[1] << 8) | d[2] : d[1];
+		break;
+	    }
+	    d += size;
+	}
+    }
+    if ( !q0) return 0;
+
+    if ( dht) {
+	segs[0] = dht;
+	n_seg = 1;
+    } else {
+	for ( n_seg = 0; n_seg < ix->n_dht && n_seg < MAX_JPEG_TABLES; n_seg++) segs[n_seg] = p + ix->dht[n_seg];
+    }
+    if ( n_seg == 0 || !load_tables( segs, n_seg)) return 0;
+
+    // scan components in scan order, matched to the frame's
+    for ( i = 0; i < ns; i++) {
+	int id = sos[5 + i*2], t = sos[6 + i*2];
+
+	for ( j = 0; j < nf && sof[10 + j*3] != id; j++) ;
+	if ( j == nf) return 0;
+	order[i] = j;
+	dc[i] = &dcTables[t >> 4 & 3];
+	ac[i] = &acTables[t & 3];
+    }
+
+    mcusX = (ix->width + 8*hmax - 1) / (8*hmax);
+    mcusY = (ix->height + 8*vmax - 1) / (8*vmax);
+    size_grid( mcusX * hs[0], mcusY * vs[0]);
+
+    b.p = p + ix->scan;
+    b.end = p + ix->eoi;
+    b.acc = 0;
+    b.n = 0;
+    b.marker = 0;
+    togo = ix->dri;
+
+    for ( my = 0; my < mcusY; my++) {
+	for ( mx = 0; mx < mcusX; mx++) {
+	    if ( ix->dri && togo-- == 0) {
+		// byte align, step over the RSTn and start the predictions over
+		while ( b.p + 1 < b.end && !( b.p[0] == 0xff && b.p[1] >= 0xd0 && b.p[1] <= 0xd7)) b.p++;
+		b.p += 2;
+		b.acc = 0;
+		b.n = 0;
+		b.marker = 0;
+		memset( pred, 0, sizeof(pred));
+		togo = ix->dri - 1;
+	    }
+	    for ( i = 0; i < ns; i++) {
+		int c = order[i], v, h;
+
+		for ( v = 0; v < vs[c]; v++) {
+		    for ( h = 0; h < hs[c]; h++) {
+			int s = decode( &b, dc[i]), k;
+
+			if ( s < 0 || s > 11) return 0;
+			if ( s) {
+			    int d = get_bits( &b, s);
+			    if ( d < (1 << (s-1))) d -= (1 << s) - 1;
+			    pred[i] += d;
+			}
+			if ( c == 0) {
+			    int l = 128 + pred[i] * q0 / 8;
+			    level[ (my*vs[0] + v) * cols + mx*hs[0] + h] = l < 0 ? 0 : l > 255 ? 255 : l;
+			}
+			for ( k = 1; k < 64; k++) {
+			    int rs = decode( &b, ac[i]);
+
+			    if ( rs < 0) return 0;
+			    if ( rs & 15) {
+				k += rs >> 4;
+				get_bits( &b, rs & 15);
+			    } else if ( rs == 0xf0) {
+				k += 15;
+			    } else break;
+			}
+		    }
+		}
+	    }
+	}
+    }
+    return 1;
+}
+
+static void yuyv_levels( const unsigned char *yuyv, int width, int height)
+{
+    int x, y, k;
+
+    size_grid( width / 8, height / 8);
+    for ( y = 0; y < rows; y++) {
+	const unsigned char *row = yuyv + (y*8 + 4) * width * 2;
+
+	for ( x = 0; x < cols; x++) {
+	    const unsigned char *s = row + x*16;
+	    unsigned int sum = 0;
+
+	    for ( k = 0; k < 16; k += 2) sum += s[k];
+	    level[ y*cols + x] = sum / 8;
+	}
+    }
+}
+
+/*
+** The latest result, and who wants to hear about new ones.
+*/
+#define MAX_MOTION_HOOKS 8
+
+static pthread_mutex_t motion_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t motion_cond = PTHREAD_COND_INITIALIZER;
+static struct motion latest;
+static unsigned char *latestMask = 0;
+static unsigned char *mask = 0;
+static unsigned char latestSignature[SIGNATURE_SIZE];
+static unsigned char signature[SIGNATURE_SIZE];
+
+static struct {
+    motion_hook func;
+    void *arg;
+} hooks[MAX_MOTION_HOOKS];
+static int n_hooks = 0;
+
+static long motionFrames = 0;
+static long motionSkipped = 0;
+static long motionMicros = 0;
+
+/*
+** Only call this while starting up.
+*/
+void add_motion_hook( motion_hook func, void *arg)
+{
+    if ( n_hooks == MAX_MOTION_HOOKS) fatal_f("Too many motion hooks\n");
+    hooks[n_hooks].func = func;
+    hooks[n_hooks].arg = arg;
+    n_hooks++;
+}
+
+/*
+** Compare with the background, allowing for the whole picture getting
+** brighter or darker as the camera's exposure moves, then fold this frame
+** into the background. The mask comes out the way the frames are served.
+*/
+static void score_motion( struct motion *m)
+{
+    int transform = this_camera()->transform;
+    int n = cols * rows, i, moving = 0, shift = 0;
+    int oc = (transform & TRANSFORM_TRANSPOSE) ? rows : cols;
+    int orows = (transform & TRANSFORM_TRANSPOSE) ? cols : rows;
+    int x0 = oc, y0 = orows, x1 = -1, y1 = -1;
+    long long total = 0;
+
+    mask = realloc( mask, n);
+    if ( !mask) fatal_f("Out of memory\n");
+
+    if ( !haveBackground) {
+	for ( i = 0; i < n; i++) background[i] = level[i] << 8;
+	haveBackground = 1;
+    }
+
+    for ( i = 0; i < n; i++) total += (level[i] << 8) - (int)background[i];
+    shift = total / n;
+
+    for ( i = 0; i < n; i++) {
+	int d = (level[i] << 8) - (int)background[i] - shift;
+	int x = i % cols, y = i / cols, t;
+
+	if ( transform & TRANSFORM_TRANSPOSE) {
+	    t = x;
+	    x = y;
+	    y = t;
+	}
+	if ( transform & TRANSFORM_FLIP_H) x = oc - 1 - x;
+	if ( transform & TRANSFORM_FLIP_V) y = orows - 1 - y;
+
+	if ( d < 0) d = -d;
+	if ( d > motion_threshold << 8) {
+	    mask[ y*oc + x] = 1;
+	    moving++;
+	    if ( x < x0) x0 = x;
+	    if ( x > x1) x1 = x;
+	    if ( y < y0) y0 = y;
+	    if ( y > y1) y1 = y;
+	} else {
+	    mask[ y*oc + x] = 0;
+	}
+	background[i] += ((int)(level[i] << 8) - (int)background[i]) / 16;
+    }
+
+    m->score = moving * 1000 / n;
+    m->cols = oc;
+    m->rows = orows;
+    m->mask = mask;
+    if ( moving) {
+	m->x = x0 * 8;
+	m->y = y0 * 8;
+	m->width = (x1 - x0 + 1) * 8;
+	m->height = (y1 - y0 + 1) * 8;
+    } else {
+	m->x = m->y = m->width = m->height = 0;
+    }
+}
+
+/*
+** Boil the levels down to a coarse grid for telling whether a frame looks
+** any different from another, see wait_for_signature(). Each cell averages
+** a few blocks, which takes most of the sensor noise out.
+*/
+static void sign_levels( unsigned char *sig)
+{
+    int cx, cy, x, y;
+
+    for ( cy = 0; cy < SIGNATURE_ROWS; cy++) {
+	int y0 = cy * rows / SIGNATURE_ROWS, y1 = (cy+1) * rows / SIGNATURE_ROWS;
+
+	if ( y1 == y0) y1++;   // small frames repeat blocks
+
+	for ( cx = 0; cx < SIGNATURE_COLS; cx++) {
+	    int x0 = cx * cols / SIGNATURE_COLS, x1 = (cx+1) * cols / SIGNATURE_COLS;
+	    unsigned int sum = 0, n = 0;
+
+	    if ( x1 == x0) x1++;
+
+	    for ( y = y0; y < y1; y++) {
+		for ( x = x0; x < x1; x++) sum += level[ y*cols + x];
+	    }
+	    n = (y1 - y0) * (x1 - x0);
+	    *sig++ = sum / n;
+	}
+    }
+}
+
+static void publish_motion( const struct motion *m)
+{
+    int i;
+
+    pthread_mutex_lock( &motion_mutex);
+    latestMask = realloc( latestMask, m->cols * m->rows);
+    if ( !latestMask) fatal_f("Out of memory\n");
+    memcpy( latestMask, m->mask, m->cols * m->rows);
+    memcpy( latestSignature, m->signature, sizeof(latestSignature));
+    latest = *m;
+    latest.mask = latestMask;
+    latest.signature = latestSignature;
+    pthread_cond_broadcast( &motion_cond);
+    pthread_mutex_unlock( &motion_mutex);
+
+    for ( i = 0; i < n_hooks; i++) (*hooks[i].func)( m, hooks[i].arg);
+}
+
+static void analyze_frame( const struct chunk *c, void *arg)
+{
+    const struct jpeg_index *ix = current_frame_index();
+    struct motion m = { .serial = current_frame_serial(), .ms = current_frame_time() };
+    struct timespec t0, t1;
+    int ok;
+
+    if ( !c[0].data) return;
+
+    clock_gettime( CLOCK_MONOTONIC, &t0);
+    if ( this_camera()->method == CAMERA_METHOD_YUYV) {
+	yuyv_levels( c[0].data, this_camera()->width, this_camera()->height);
+	ok = 1;
+    } else {
+	// if the camera left out the DHT, frame.c put the standard one in as the second chunk
+	ok = ix->scan && jpeg_levels( c[0].data, ix, ( !ix->n_dht && c[1].data && c[2].data) ? c[1].data : 0);
+    }
+    if ( !ok) {
+	motionSkipped++;
+	return;
+    }
+    score_motion( &m);
+    sign_levels( signature);
+    m.signature = signature;
+    clock_gettime( CLOCK_MONOTONIC, &t1);
+
+    motionFrames++;
+    motionMicros = (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+    publish_motion( &m);
+}
+
+static void *motion_loop( void *arg)
+{
+    int last = 0;
+
+    for (;;) {
+	wait_for_frame( last);
+	last = frame_serial();
+	with_current_frame( analyze_frame, 0);
+    }
+    return 0;
+}
+
+static void launch_motion(void)
+{
+    pthread_t thread;
+
+    if ( pthread_create( &thread, 0, motion_loop, 0)) fatal_f("Failed to start motion thread.\n");
+    pthread_detach( thread);
+}
+
+static pthread_once_t motionOnce = PTHREAD_ONCE_INIT;
+
+/*
+** Streams that skip unchanged frames may start the thread later.
+*/
+void start_motion(void)
+{
+    add_metric( "motion_frames_total", "Frames checked for motion.", &motionFrames);
+    add_metric( "motion_skipped_frames_total", "Frames the motion detector could not decode.", &motionSkipped);
+    add_metric( "motion_frame_microseconds", "Time spent on the last frame checked for motion.", &motionMicros);
+
+    if ( motion_detect) pthread_once( &motionOnce, launch_motion);
+}
+
+static void unlock_motion( void *arg)
+{
+    pthread_mutex_unlock( &motion_mutex);
+}
+
+/*
+** Wait up to a few seconds for a result newer than serial after, and if
+** moving is set one that scores at least --motion-trigger, then describe the
+** latest result as JSON. The mask has a row of hex digits for each row of
+** blocks, the most significant bit of each digit being the leftmost block.
+*/
+int motion_json( char *buf, int size, int after, int moving, int seconds)
+{
+    struct timespec deadline;
+    int used, x, y;
+
+    clock_gettime( CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+
+    pthread_mutex_lock( &motion_mutex);
+    pthread_cleanup_push( unlock_motion, 0);
+    while ( latest.serial <= after || ( moving && latest.score < motion_trigger)) {
+	if ( pthread_cond_timedwait( &motion_cond, &motion_mutex, &deadline) == ETIMEDOUT) break;
+    }
+
+    used = snprintf( buf, size,
+		     "{\"serial\":%d,\"time\":%lld,\"score\":%d,\"moving\":%s,"
+		     "\"box\":[%d,%d,%d,%d],\"cols\":%d,\"rows\":%d,\"mask\":[",
+		     latest.serial, latest.ms, latest.score, latest.score >= motion_trigger ? "true" : "false",
+		     latest.x, latest.y, latest.width, latest.height, latest.cols, latest.rows);
+    for ( y = 0; y < latest.rows && used < size; y++) {
+	used += snprintf( buf+used, size-used, "%s\"", y ? "," : "");
+	for ( x = 0; x < latest.cols && used < size - 1; x += 4) {
+	    const unsigned char *r = latestMask + y*latest.cols + x;
+	    int d = r[0] << 3;
+
+	    if ( x+1 < latest.cols) d |= r[1] << 2;
+	    if ( x+2 < latest.cols) d |= r[2] << 1;
+	    if ( x+3 < latest.cols) d |= r[3];
+	    buf[used++] = "0123456789abcdef"[d];
+	}
+	if ( used < size) used += snprintf( buf+used, size-used, "\"");
+    }
+    if ( used < size) used += snprintf( buf+used, size-used, "]}\n");
+    pthread_cleanup_pop( 1);
+
+    return used < size ? used : size-1;
+}
+
+/*
+** Wait up to seconds for a frame after serial after to be looked at, and
+** copy out its signature. Returns its serial, or 0 if none came. Starts the
+** motion thread the first time, if --motion didn't.
+*/
+int wait_for_signature( int after, unsigned char *sig, int seconds)
+{
+    struct timespec deadline;
+    int serial = 0;
+
+    pthread_once( &motionOnce, launch_motion);
+
+    clock_gettime( CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+
+    pthread_mutex_lock( &motion_mutex);
+    pthread_cleanup_push( unlock_motion, 0);
+    while ( latest.serial <= after) {
+	if ( pthread_cond_timedwait( &motion_cond, &motion_mutex, &deadline) == ETIMEDOUT) break;
+    }
+    if ( latest.serial > after) {
+	serial = latest.serial;
+	memcpy( sig, latestSignature, SIGNATURE_SIZE);
+    }
+    pthread_cleanup_pop( 1);
+    return serial;
+}
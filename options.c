@@ -6,9 +6,6 @@
 
 #include "tinycamd.h"
 
-enum io_method io_method = IO_METHOD_MMAP;
-enum camera_method camera_method = CAMERA_METHOD_MJPEG;
-char *videodev_name = "/dev/video0";
 char *bind_name = "0.0.0.0:8080";
 char *url_prefix = "";
 char *pid_file = 0;
@@ -16,20 +13,50 @@ char *setuid_to = 0;
 char *chroot_to = 0;
 char *password = 0;
 char *setup_password = 0;
-int video_width = 640;
-int video_height = 480;
 int verbose = 0;
-int quality = 100;
-int fps = 5;
 int daemon_mode = 0;
 int probe_only = 0;
-int mono = 0;
+int history_seconds = 0;
+int history_megabytes = 16;
+char *record_dir = 0;
+int record_segment_seconds = 300;
+int record_megabytes = 1024;
+int motion_detect = 0;
+int motion_threshold = 12;
+int motion_trigger = 10;
+char *event_dir = 0;
+int event_pre_seconds = 5;
+int event_post_seconds = 10;
+int event_megabytes = 1024;
+char *shm_name = 0;
+int shm_slots = 4;
+int shm_yuyv = 0;
+char *snapshot_file = 0;
+int snapshot_every = 1;
+int snapshot_fsync = 0;
+char *rtsp_bind = 0;
+char *rtsp_multicast = 0;
+int rtsp_ttl = 1;
+int mosaic_fps = 5;
+int mosaic_columns = 0;
+int sync_frames = 0;
+int idle_off = 0;
+int stall_seconds = 0;
+char *dmabuf_socket = 0;
+int hugepages = 0;
+int lock_buffers = 0;
+int governor = 0;
+int min_fps = 1;
+int min_quality = 30;
+int cpu_high = 85;
+int cpu_low = 50;
 
 static const char short_options [] = "p:d:hmMruvq:s:f:DU:PF:I:i:C:";
 
 static const struct option
 long_options [] = {
         { "device",     required_argument,      NULL,           'd' },
+	{ "name",       required_argument,      NULL,           0 },
         { "port",       required_argument,      NULL,           'p' },
 	{ "daemon",     no_argument,            NULL,           'D' },
         { "help",       no_argument,            NULL,           'h' },
@@ -49,6 +76,45 @@ long_options [] = {
 	{ "chroot",     required_argument,      NULL,           'C' },
 	{ "password",   required_argument,      NULL,           0 },
 	{ "setup-password", required_argument,  NULL,           0 },
+	{ "rotate",     required_argument,      NULL,           0 },
+	{ "flip",       no_argument,            NULL,           0 },
+	{ "view",       required_argument,      NULL,           0 },
+	{ "history",    required_argument,      NULL,           0 },
+	{ "history-mb", required_argument,      NULL,           0 },
+	{ "record",     required_argument,      NULL,           0 },
+	{ "record-segment", required_argument,  NULL,           0 },
+	{ "record-mb",  required_argument,      NULL,           0 },
+	{ "motion",     no_argument,            NULL,           0 },
+	{ "motion-threshold", required_argument, NULL,          0 },
+	{ "motion-trigger", required_argument,  NULL,           0 },
+	{ "events",     required_argument,      NULL,           0 },
+	{ "event-pre",  required_argument,      NULL,           0 },
+	{ "event-post", required_argument,      NULL,           0 },
+	{ "event-mb",   required_argument,      NULL,           0 },
+	{ "shm",        required_argument,      NULL,           0 },
+	{ "shm-slots",  required_argument,      NULL,           0 },
+	{ "shm-yuyv",   no_argument,            NULL,           0 },
+	{ "snapshot",   required_argument,      NULL,           0 },
+	{ "snapshot-every", required_argument,  NULL,           0 },
+	{ "snapshot-fsync", no_argument,        NULL,           0 },
+	{ "rtsp",       required_argument,      NULL,           0 },
+	{ "rtsp-multicast", required_argument,  NULL,           0 },
+	{ "rtsp-ttl",   required_argument,      NULL,           0 },
+	{ "mosaic-fps", required_argument,      NULL,           0 },
+	{ "mosaic-columns", required_argument,  NULL,           0 },
+	{ "sync-frames", required_argument,     NULL,           0 },
+	{ "idle-off",   required_argument,      NULL,           0 },
+	{ "buffers",    required_argument,      NULL,           0 },
+	{ "latest",     no_argument,            NULL,           0 },
+	{ "stall",      required_argument,      NULL,           0 },
+	{ "hugepages",  no_argument,            NULL,           0 },
+	{ "mlock",      no_argument,            NULL,           0 },
+	{ "dmabuf-socket", required_argument,   NULL,           0 },
+	{ "governor",   no_argument,            NULL,           0 },
+	{ "min-fps",    required_argument,      NULL,           0 },
+	{ "min-quality", required_argument,     NULL,           0 },
+	{ "cpu-high",   required_argument,      NULL,           0 },
+	{ "cpu-low",    required_argument,      NULL,           0 },
         { 0, 0, 0, 0 }
 };
 
@@ -57,7 +123,8 @@ static void usage(FILE *fp, int argc, char **argv)
     fprintf (fp,
 	     "Usage: %s [options]\n\n"
 	     "Options:\n"
-	     "-d | --device name       Video device name [/dev/video]\n"
+	     "-d | --device name       Video device name [/dev/video0], may repeat\n"
+	     "--name NAME              Serve this camera under /cam/NAME/ [video0]\n"
 	     "-p | --port [addr:]port  HTTP daemon port to bind (default: 8080)\n"
 	     "-D | --daemon            Detach and run as a daemon\n"
 	     "-U | --url-prefix        Static prefix to URL, e.g. /camera\n"
@@ -77,12 +144,121 @@ static void usage(FILE *fp, int argc, char **argv)
 	     "-C | --chroot            Chroot to this path after initializing\n"
 	     "--password               Authorization to see images, e.g. user:password\n"
 	     "--setup-password         Authorization to control camera.\n"
+	     "--rotate DEG             Rotate images clockwise by 90, 180, or 270\n"
+	     "--flip                   Mirror images left to right, after rotating\n"
+	     "--view NAME=WxH+X+Y      Serve a region as /view/NAME.jpg, may repeat\n"
+	     "--history SECONDS        Keep this many seconds of frames to look back at\n"
+	     "--history-mb N           Memory for history, in megabytes (default: 16)\n"
+	     "--record DIR             Record all frames into segment files in DIR\n"
+	     "--record-segment SECONDS Length of each recording segment (default: 300)\n"
+	     "--record-mb N            Delete the oldest segments beyond this (default: 1024)\n"
+	     "--motion                 Watch for motion, see /motion\n"
+	     "--motion-threshold N     Brightness change of an 8x8 block that is motion (default: 12)\n"
+	     "--motion-trigger N       Moving blocks per thousand that is motion (default: 10)\n"
+	     "--events DIR             Record motion events into DIR, see /events\n"
+	     "--event-pre SECONDS      Include this much before motion starts (default: 5)\n"
+	     "--event-post SECONDS     Carry on this long after motion stops (default: 10)\n"
+	     "--event-mb N             Delete the oldest events beyond this (default: 1024)\n"
+	     "--shm NAME               Publish frames in shared memory, e.g. /tinycamd\n"
+	     "--shm-slots N            Frames the shared memory ring holds (default: 4)\n"
+	     "--shm-yuyv               Also publish raw YUYV frames to shared memory\n"
+	     "--snapshot FILE          Keep the latest frame in FILE, e.g. on a tmpfs\n"
+	     "--snapshot-every N       Only write every Nth frame to it (default: 1)\n"
+	     "--snapshot-fsync         Sync the snapshot to disk before replacing it\n"
+	     "--rtsp [addr:]port       Serve RTSP with RTP/JPEG, e.g. 554\n"
+	     "--rtsp-multicast GROUP[:PORT] Multicast group for RTSP clients that ask\n"
+	     "--rtsp-ttl N             Multicast time to live (default: 1)\n"
+	     "--mosaic-fps N           Mosaics made per second at most (default: 5)\n"
+	     "--mosaic-columns N       Cameras across the mosaic (default: square)\n"
+	     "--sync-frames N          Keep N frames a camera for /sync (default: off)\n"
+	     "--idle-off SECONDS       Stop a camera nobody has watched this long\n"
+	     "--stall SECONDS          Restart a camera silent this long (default: 0, never)\n"
+	     "--buffers N              Buffers to ask the driver for (default: 4)\n"
+	     "--latest                 Skip frames we fell behind on, show the newest\n"
+	     "--hugepages              Put --userp buffers in huge pages\n"
+	     "--mlock                  Lock --userp buffers in memory\n"
+	     "--dmabuf-socket PATH     Share capture buffers as dma-bufs over a unix socket\n"
+	     "--governor               Turn cameras down while the CPU is busy\n"
+	     "--min-fps N              Fewest frames a second it goes down to (default: 1)\n"
+	     "--min-quality N          Lowest YUYV quality it goes down to (default: 30)\n"
+	     "--cpu-high PCT           CPU use that is too busy (default: 85)\n"
+	     "--cpu-low PCT            CPU use that is quiet enough to turn up (default: 50)\n"
 	     "",
 	     argv[0]);
 }
 
+/*
+** A camera is described by the options after its --device, and the first
+** by any before the first --device too. Each new one starts out like the
+** one before it, apart from its name and views.
+*/
+static struct camera *add_camera( struct camera *like)
+{
+    struct camera *c = calloc( 1, sizeof(*c));
+    struct camera **p;
+
+    if ( !c) fatal_f("Out of memory\n");
+    if ( like) {
+	*c = *like;
+	c->next = 0;
+	c->views = 0;
+    } else {
+	c->device = "/dev/video0";
+	c->io = IO_METHOD_MMAP;
+	c->method = CAMERA_METHOD_MJPEG;
+	c->width = 640;
+	c->height = 480;
+	c->quality = 100;
+	c->fps = 5;
+	c->want_buffers = 4;
+    }
+    c->name = 0;
+    c->fd = -1;
+    pthread_mutex_init( &c->mutex, 0);
+
+    for ( p = &cameras; *p; p = &(*p)->next) ;
+    *p = c;
+    return c;
+}
+
+/*
+** Boil rotate and flip down to a transpose followed by flips, and name the
+** camera after its device if it has no name.
+*/
+static void finish_camera( struct camera *c, int rotate, int flip)
+{
+    const char *slash = strrchr( c->device, '/');
+
+    switch( rotate) {
+      case 90:
+	c->transform = TRANSFORM_TRANSPOSE | TRANSFORM_FLIP_H;
+	break;
+      case 180:
+	c->transform = TRANSFORM_FLIP_H | TRANSFORM_FLIP_V;
+	break;
+      case 270:
+	c->transform = TRANSFORM_TRANSPOSE | TRANSFORM_FLIP_V;
+	break;
+      default:
+	c->transform = 0;
+	break;
+    }
+    if ( flip) c->transform ^= TRANSFORM_FLIP_H;
+
+    if ( !c->name) c->name = strdup( slash ? slash+1 : c->device);
+    if ( find_camera( c->name, strlen(c->name)) != c) {
+	fprintf(stderr,"Two cameras named %s, give one a --name.\n", c->name);
+	exit(EXIT_FAILURE);
+    }
+}
+
 void do_options(int argc, char **argv)
 {
+    struct camera *camera = add_camera( 0);
+    int haveDevice = 0;
+    int rotate = 0;
+    int flip = 0;
+
     for (;;) {
 	int index;
 	int c;
@@ -93,7 +269,13 @@ void do_options(int argc, char **argv)
 
 	switch (c) {
 	  case 0: /* getopt_long() flag */
-	    if ( strcmp( long_options[index].name, "password")==0) {
+	    if ( strcmp( long_options[index].name, "name")==0) {
+		if ( !optarg[0] || strchr( optarg, '/')) {
+		    fprintf(stderr,"Illegal camera name: %s.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+		camera->name = optarg;
+	    } else if ( strcmp( long_options[index].name, "password")==0) {
 		int len = strlen(optarg);
 		password = strdup(optarg);
 		strncpy( optarg, "user:pw", len); // obscure for 'ps' (and we may depend on previous NUL)
@@ -101,10 +283,178 @@ void do_options(int argc, char **argv)
 		int len = strlen(optarg);
 		setup_password = strdup(optarg);
 		strncpy( optarg, "user:pw", len); // obscure for 'ps' (and we may depend on previous NUL)
+	    } else if ( strcmp( long_options[index].name, "rotate")==0) {
+		rotate = atoi(optarg);
+		if ( rotate != 0 && rotate != 90 && rotate != 180 && rotate != 270) {
+		    fprintf(stderr,"Illegal rotation: %s, consider 90, 180, or 270.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "flip")==0) {
+		flip = 1;
+	    } else if ( strcmp( long_options[index].name, "view")==0) {
+		struct view *v = calloc( 1, sizeof(*v));
+		char name[64];
+
+		if ( !v) fatal_f("Out of memory\n");
+		if ( sscanf( optarg, "%63[^=]=%dx%d+%d+%d", name, &v->width, &v->height, &v->x, &v->y) != 5 ||
+		     v->width <= 0 || v->height <= 0 || v->x < 0 || v->y < 0) {
+		    fprintf(stderr,"Illegal view: %s, consider door=320x240+0+120.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+		v->name = strdup(name);
+		v->next = camera->views;
+		camera->views = v;
+	    } else if ( strcmp( long_options[index].name, "history")==0) {
+		history_seconds = atoi(optarg);
+	    } else if ( strcmp( long_options[index].name, "history-mb")==0) {
+		history_megabytes = atoi(optarg);
+		if ( history_megabytes < 1 || history_megabytes > 2048) {
+		    fprintf(stderr,"Illegal history size: %s megabytes.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "record")==0) {
+		record_dir = optarg;
+	    } else if ( strcmp( long_options[index].name, "record-segment")==0) {
+		record_segment_seconds = atoi(optarg);
+		if ( record_segment_seconds < 1) {
+		    fprintf(stderr,"Illegal segment length: %s seconds.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "record-mb")==0) {
+		record_megabytes = atoi(optarg);
+		if ( record_megabytes < 1) {
+		    fprintf(stderr,"Illegal recording size: %s megabytes.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "motion")==0) {
+		motion_detect = 1;
+	    } else if ( strcmp( long_options[index].name, "motion-threshold")==0) {
+		motion_detect = 1;
+		motion_threshold = atoi(optarg);
+	    } else if ( strcmp( long_options[index].name, "motion-trigger")==0) {
+		motion_detect = 1;
+		motion_trigger = atoi(optarg);
+	    } else if ( strcmp( long_options[index].name, "events")==0) {
+		event_dir = optarg;
+	    } else if ( strcmp( long_options[index].name, "event-pre")==0) {
+		event_pre_seconds = atoi(optarg);
+	    } else if ( strcmp( long_options[index].name, "event-post")==0) {
+		event_post_seconds = atoi(optarg);
+	    } else if ( strcmp( long_options[index].name, "event-mb")==0) {
+		event_megabytes = atoi(optarg);
+		if ( event_megabytes < 1) {
+		    fprintf(stderr,"Illegal event size: %s megabytes.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "shm")==0) {
+		shm_name = optarg;
+	    } else if ( strcmp( long_options[index].name, "shm-slots")==0) {
+		shm_slots = atoi(optarg);
+		if ( shm_slots < 2 || shm_slots > 64) {
+		    fprintf(stderr,"Illegal shared memory slots: %s, consider 2 to 64.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "shm-yuyv")==0) {
+		shm_yuyv = 1;
+	    } else if ( strcmp( long_options[index].name, "snapshot")==0) {
+		snapshot_file = optarg;
+	    } else if ( strcmp( long_options[index].name, "snapshot-every")==0) {
+		snapshot_every = atoi(optarg);
+		if ( snapshot_every < 1) {
+		    fprintf(stderr,"Illegal snapshot interval: %s frames.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "snapshot-fsync")==0) {
+		snapshot_fsync = 1;
+	    } else if ( strcmp( long_options[index].name, "rtsp")==0) {
+		rtsp_bind = optarg;
+	    } else if ( strcmp( long_options[index].name, "rtsp-multicast")==0) {
+		rtsp_multicast = optarg;
+	    } else if ( strcmp( long_options[index].name, "rtsp-ttl")==0) {
+		rtsp_ttl = atoi(optarg);
+		if ( rtsp_ttl < 1 || rtsp_ttl > 255) {
+		    fprintf(stderr,"Illegal multicast ttl: %s.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "mosaic-fps")==0) {
+		mosaic_fps = atoi(optarg);
+		if ( mosaic_fps < 1 || mosaic_fps > 1000) {
+		    fprintf(stderr,"Illegal mosaic rate: %s per second.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "mosaic-columns")==0) {
+		mosaic_columns = atoi(optarg);
+		if ( mosaic_columns < 1) {
+		    fprintf(stderr,"Illegal mosaic columns: %s.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "sync-frames")==0) {
+		sync_frames = atoi(optarg);
+		if ( sync_frames < 2 || sync_frames > 64) {
+		    fprintf(stderr,"Illegal sync frames: %s, from 2 to 64.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "idle-off")==0) {
+		idle_off = atoi(optarg);
+		if ( idle_off < 1) {
+		    fprintf(stderr,"Illegal idle time: %s seconds.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "stall")==0) {
+		stall_seconds = atoi(optarg);
+		if ( stall_seconds < 0) {
+		    fprintf(stderr,"Illegal stall time: %s seconds.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "buffers")==0) {
+		camera->want_buffers = atoi(optarg);
+		if ( camera->want_buffers < 2 || camera->want_buffers > 32) {
+		    fprintf(stderr,"Illegal buffer count: %s, from 2 to 32.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "latest")==0) {
+		camera->latest = 1;
+	    } else if ( strcmp( long_options[index].name, "hugepages")==0) {
+		hugepages = 1;
+	    } else if ( strcmp( long_options[index].name, "mlock")==0) {
+		lock_buffers = 1;
+	    } else if ( strcmp( long_options[index].name, "dmabuf-socket")==0) {
+		dmabuf_socket = optarg;
+	    } else if ( strcmp( long_options[index].name, "governor")==0) {
+		governor = 1;
+	    } else if ( strcmp( long_options[index].name, "min-fps")==0) {
+		min_fps = atoi(optarg);
+		if ( min_fps < 1) {
+		    fprintf(stderr,"Illegal minimum fps: %s.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "min-quality")==0) {
+		min_quality = atoi(optarg);
+		if ( min_quality < 1 || min_quality > 100) {
+		    fprintf(stderr,"Illegal minimum quality: %s, from 1 to 100.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "cpu-high")==0) {
+		cpu_high = atoi(optarg);
+		if ( cpu_high < 1 || cpu_high > 100) {
+		    fprintf(stderr,"Illegal CPU percentage: %s.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    } else if ( strcmp( long_options[index].name, "cpu-low")==0) {
+		cpu_low = atoi(optarg);
+		if ( cpu_low < 0 || cpu_low > 100) {
+		    fprintf(stderr,"Illegal CPU percentage: %s.\n", optarg);
+		    exit(EXIT_FAILURE);
+		}
 	    }
 	    break;
 	  case 'd':
-	    videodev_name = optarg;
+	    if ( haveDevice) {
+		finish_camera( camera, rotate, flip);
+		camera = add_camera( camera);
+	    }
+	    camera->device = optarg;
+	    haveDevice = 1;
 	    break;
 	  case 'U':
 	    url_prefix = optarg;
@@ -113,23 +463,24 @@ void do_options(int argc, char **argv)
 	    bind_name = optarg;
 	    break;
 	  case 'M':
-	    mono = 1;
+	    camera->mono = 1;
 	    break;
 	  case 's':
-	    if ( sscanf( optarg, "%dx%d", &video_width, &video_height) != 2) {
+	    if ( sscanf( optarg, "%dx%d", &camera->width, &camera->height) != 2) {
 		usage(stderr, argc, argv);
 		exit(EXIT_FAILURE);
 	    }
+	    break;
 	  case 'q':
-	    sscanf( optarg,"%d", &quality);
+	    sscanf( optarg,"%d", &camera->quality);
 	    break;
 	  case 'f':
-	    sscanf( optarg,"%d", &fps);
+	    sscanf( optarg,"%d", &camera->fps);
 	    break;
     	  case 'F':
-	    if ( strcmp(optarg, "jpeg")==0) camera_method = CAMERA_METHOD_JPEG;
-	    else if ( strcmp(optarg, "yuyv")==0) camera_method = CAMERA_METHOD_YUYV;
-	    else if ( strcmp(optarg, "mjpeg")==0) camera_method = CAMERA_METHOD_MJPEG;
+	    if ( strcmp(optarg, "jpeg")==0) camera->method = CAMERA_METHOD_JPEG;
+	    else if ( strcmp(optarg, "yuyv")==0) camera->method = CAMERA_METHOD_YUYV;
+	    else if ( strcmp(optarg, "mjpeg")==0) camera->method = CAMERA_METHOD_MJPEG;
 	    else {
 	      fprintf(stderr,"Illegal camera format: %s, consider mjpeg, jpeg, or yuyv.\n", optarg);
 	      exit(EXIT_FAILURE);
@@ -157,18 +508,29 @@ void do_options(int argc, char **argv)
 	    daemon_mode = 1;
 	    break;
 	  case 'm':
-	    io_method = IO_METHOD_MMAP;
+	    camera->io = IO_METHOD_MMAP;
 	    break;
 	  case 'r':
-	    io_method = IO_METHOD_READ;
+	    camera->io = IO_METHOD_READ;
 	    break;
 	  case 'u':
-	    io_method = IO_METHOD_USERPTR;
+	    camera->io = IO_METHOD_USERPTR;
 	    break;
 	  default:
 	    usage (stderr, argc, argv);
 	    exit (EXIT_FAILURE);
 	}
     }
+
+    finish_camera( camera, rotate, flip);
+
+    /*
+    ** Events need motion, and the pre-roll comes out of history.
+    */
+    if ( event_dir) {
+	motion_detect = 1;
+	if ( event_pre_seconds < 0) event_pre_seconds = 0;
+	if ( history_seconds < event_pre_seconds + 2) history_seconds = event_pre_seconds + 2;
+    }
 }
     
@@ -39,8 +39,10 @@ static int xioctl(int fd, int request, void *arg)
 ** Probe the device and print a bunch of info.
 ** This does not lock the device!!!! Don't do it while anything else is running.
 */
-void do_probe (int videodev)
+void do_probe (struct camera *c)
 {
+    int videodev = c->fd;
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     unsigned int min;
 
     printf("Probing...\n");
@@ -69,6 +71,12 @@ void do_probe (int videodev)
 	printf("%-12s: %s\n", "read()?", (cap.capabilities & V4L2_CAP_READWRITE) ? "yes" : "no");
 	printf("%-12s: %s\n", "asyncio?", (cap.capabilities & V4L2_CAP_ASYNCIO) ? "yes" : "no");
 	printf("%-12s: %s\n", "streaming?", (cap.capabilities & V4L2_CAP_STREAMING) ? "yes" : "no");
+
+	if ( cap.capabilities & V4L2_CAP_DEVICE_CAPS) cap.capabilities = cap.device_caps;
+	printf("%-12s: %s\n", "multi-plane?", (cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) ? "yes" : "no");
+	if ( !(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) && (cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+	    type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	}
     }
 
     /*
@@ -77,7 +85,7 @@ void do_probe (int videodev)
     {
 	struct v4l2_fmtdesc fmtDesc = {
 	    .index = 0,
-	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	    .type = type,
 	};
 
 	for (;;fmtDesc.index++) {
@@ -165,19 +173,20 @@ void do_probe (int videodev)
 	}
     }
     /*
-    ** The the format
+    ** The the format. Only tried on single plane devices, tinycamd proper
+    ** sorts out the multi-planar one.
     */
-    {
+    if ( type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
 	struct v4l2_format fmt = {
 	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-	    .fmt.pix.width = video_width,
-	    .fmt.pix.height = video_height,
+	    .fmt.pix.width = c->width,
+	    .fmt.pix.height = c->height,
 	    // .fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV,
 	    .fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG,
 	    .fmt.pix.field = V4L2_FIELD_INTERLACED,
 	};
 	struct v4l2_jpegcompression comp = {
-	    .quality = quality,
+	    .quality = c->quality,
 	};
 	struct v4l2_streamparm strm = {
 	    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
@@ -188,9 +197,9 @@ void do_probe (int videodev)
 	if (-1 == xioctl( videodev, VIDIOC_G_JPEGCOMP, &comp)) {
 	    if ( errno != EINVAL) errno_exit("VIDIOC_G_JPEGCOMP");
 	    fprintf(stderr,"driver does not support VIDIOC_G_JPEGCOMP\n");
-	    comp.quality = quality;
+	    comp.quality = c->quality;
 	} else {
-	    comp.quality = quality;
+	    comp.quality = c->quality;
 	    if (-1 == xioctl( videodev, VIDIOC_S_JPEGCOMP, &comp)) errno_exit("VIDIOC_S_JPEGCOMP");
 	    if (-1 == xioctl( videodev, VIDIOC_G_JPEGCOMP, &comp)) errno_exit("VIDIOC_G_JPEGCOMP");
 	    fprintf(stderr,"jpegcomp quality came out at %d\n", comp.quality);
@@ -199,8 +208,8 @@ void do_probe (int videodev)
 	if (-1 == xioctl( videodev, VIDIOC_G_PARM, &strm)) errno_exit("VIDIOC_G_PARM");
 	strm.parm.capture.timeperframe.numerator = 1;
 	if ( strm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
-	    fprintf(stderr,"fps=%d\n", fps);
-	    strm.parm.capture.timeperframe.denominator = fps;
+	    fprintf(stderr,"fps=%d\n", c->fps);
+	    strm.parm.capture.timeperframe.denominator = c->fps;
 	    if (-1 == xioctl( videodev, VIDIOC_S_PARM, &strm)) errno_exit("VIDIOC_S_PARM");
 	    fprintf(stderr,"fps came out %d/%d\n", 
 		    strm.parm.capture.timeperframe.numerator,
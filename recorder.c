@@ -0,0 +1,334 @@
+/*
+** Record every frame to disk, in segments of --record-segment seconds, so
+** nobody needs a second process pulling /image.jpg just to keep a copy.
+**
+** A segment is NAME.mjpeg, the JPEGs back to back, which most players will
+** take as raw MJPEG, and NAME.idx, one struct record_index per frame for
+** seeking. NAME is the local time the segment began, YYYYMMDD-HHMMSS.
+** Event recordings, see events.c, are written the same way.
+**
+** The recorder writes straight out of the capture buffer while holding the
+** frame, so the driver is one buffer short while a write is in progress.
+** It never makes capture wait: if the disk stalls, the frames published in
+** the meantime are simply skipped and counted as dropped.
+*/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "tinycamd.h"
+
+#define WRITEBACK_BYTES (1024*1024)
+#define RECORDING_BYTES (2U << 30)      // the index offsets are 32 bits, stay well clear
+
+static void flush_index( struct recording *r)
+{
+    int len = r->n_pending * sizeof(r->pending[0]);
+
+    if ( r->n_pending == 0 || r->indexFd < 0) return;
+    if ( write( r->indexFd, r->pending, len) != len) {
+	log_f("Failed to write index for %s: %s\n", r->name, strerror(errno));
+	r->errors++;
+    }
+    r->n_pending = 0;
+}
+
+/*
+** Start writeback of each megabyte as it fills and drop the one before it
+** from the page cache, so a long recording doesn't push everything else
+** out of memory on a small box.
+*/
+static void write_behind( struct recording *r)
+{
+    if ( r->bytes - r->flushed < WRITEBACK_BYTES) return;
+    sync_file_range( r->fd, r->flushed, r->bytes - r->flushed, SYNC_FILE_RANGE_WRITE);
+    if ( r->flushed) posix_fadvise( r->fd, 0, r->flushed, POSIX_FADV_DONTNEED);
+    r->flushed = r->bytes;
+}
+
+void close_recording( struct recording *r)
+{
+    if ( r->fd < 0) return;
+    flush_index( r);
+    fdatasync( r->fd);
+    posix_fadvise( r->fd, 0, 0, POSIX_FADV_DONTNEED);
+    close( r->fd);
+    if ( r->indexFd >= 0) close( r->indexFd);
+    r->fd = r->indexFd = -1;
+}
+
+int is_recording_name( const char *name)
+{
+    int date, clock;
+    char end;
+
+    return strlen(name) == 21 && sscanf( name, "%8d-%6d.mjpe%c", &date, &clock, &end) == 3 && end == 'g';
+}
+
+static int compare_names( const void *a, const void *b)
+{
+    return strcmp( *(char * const *)a, *(char * const *)b);
+}
+
+/*
+** The recordings in dir, oldest first, as a malloc()ed array of malloc()ed
+** names. Returns how many.
+*/
+int list_recordings( int dir, char ***namesp)
+{
+    char **names = 0;
+    int n = 0;
+    struct dirent *d;
+    DIR *dp;
+    int fd = dup( dir);
+
+    *namesp = 0;
+    if ( fd < 0 || !(dp = fdopendir( fd))) {
+	if ( fd >= 0) close( fd);
+	return 0;
+    }
+    rewinddir( dp);
+    while ( (d = readdir( dp))) {
+	if ( !is_recording_name( d->d_name)) continue;
+	if ( !(names = realloc( names, (n+1) * sizeof(*names)))) fatal_f("Out of memory\n");
+	names[n++] = strdup( d->d_name);
+    }
+    closedir( dp);
+
+    qsort( names, n, sizeof(*names), compare_names);
+    *namesp = names;
+    return n;
+}
+
+/*
+** Delete the oldest recordings in dir until what is left fits in megabytes.
+** The names sort in time order. The one named keep is never deleted.
+*/
+void prune_recordings( int dir, int megabytes, const char *keep)
+{
+    long long budget = megabytes * 1024LL * 1024, total = 0;
+    char **names;
+    int n = list_recordings( dir, &names), i;
+    struct stat st;
+
+    for ( i = 0; i < n; i++) {
+	if ( fstatat( dir, names[i], &st, 0) == 0) total += st.st_size + st.st_size / 1000;   // about what the index costs
+    }
+    for ( i = 0; i < n; i++) {
+	char idx[32];
+
+	if ( total > budget && ( !keep || strcmp( names[i], keep) != 0) &&
+	     fstatat( dir, names[i], &st, 0) == 0) {
+	    snprintf( idx, sizeof(idx), "%.15s.idx", names[i]);
+	    unlinkat( dir, names[i], 0);
+	    unlinkat( dir, idx, 0);
+	    total -= st.st_size + st.st_size / 1000;
+	    log_f("Pruned recording %s\n", names[i]);
+	}
+	free( names[i]);
+    }
+    free( names);
+}
+
+/*
+** Start a recording in r->dir named for ms. Returns 0 if it can't.
+*/
+int open_recording( struct recording *r, long long ms)
+{
+    time_t t = ms / 1000;
+    struct tm tm;
+    char idx[32];
+
+    localtime_r( &t, &tm);
+    strftime( r->name, sizeof(r->name), "%Y%m%d-%H%M%S.mjpeg", &tm);
+    snprintf( idx, sizeof(idx), "%.15s.idx", r->name);
+
+    r->fd = openat( r->dir, r->name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if ( r->fd < 0) {
+	log_f("Failed to create recording %s: %s\n", r->name, strerror(errno));
+	r->errors++;
+	return 0;
+    }
+    r->indexFd = openat( r->dir, idx, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if ( r->indexFd < 0) {
+	log_f("Failed to create index %s: %s\n", idx, strerror(errno));
+	r->errors++;
+    }
+    r->start = ms;
+    r->bytes = r->flushed = 0;
+    r->n_pending = 0;
+    return 1;
+}
+
+/*
+** Write all of the chunks to fd with as few writev() calls as it takes.
+** Returns how many bytes that was, or -1 with errno set. More than eight
+** chunks is EINVAL, before anything is written.
+*/
+int write_chunks( int fd, const struct chunk *c)
+{
+    struct iovec iov[8];
+    unsigned int len = 0;
+    int n, done;
+
+    for ( n = 0; n < 8 && c[n].data; n++) {
+	iov[n].iov_base = (void *)c[n].data;
+	iov[n].iov_len = c[n].length;
+	len += c[n].length;
+    }
+    if ( n == 8 && c[8].data) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    for ( done = 0; done < len; ) {
+	int w = writev( fd, iov, n);
+
+	if ( w < 0 && errno == EINTR) continue;
+	if ( w < 0) return -1;
+	if ( w == 0) {
+	    errno = ENOSPC;
+	    return -1;
+	}
+	done += w;
+	// step over what a short write took
+	while ( w > 0 && n > 0) {
+	    if ( w < iov[0].iov_len) {
+		iov[0].iov_base = (char *)iov[0].iov_base + w;
+		iov[0].iov_len -= w;
+		break;
+	    }
+	    w -= iov[0].iov_len;
+	    memmove( iov, iov+1, --n * sizeof(iov[0]));
+	}
+    }
+    return len;
+}
+
+/*
+** Write a frame, straight from the chunks. A recording that would grow
+** past RECORDING_BYTES carries on in a new one named for this frame. On
+** failure the recording is closed, so the caller can open a fresh one next
+** time. Returns 0 then.
+*/
+int append_recording( struct recording *r, const struct chunk *c, long long ms)
+{
+    unsigned int size = 0;
+    int len, i;
+
+    for ( i = 0; c[i].data; i++) size += c[i].length;
+    // names are to the second, and the headroom left can't fill in one
+    if ( r->bytes + (unsigned long long)size > RECORDING_BYTES && ms / 1000 != r->start / 1000) {
+	close_recording( r);
+	if ( !open_recording( r, ms)) return 0;
+    }
+
+    len = write_chunks( r->fd, c);
+
+    if ( len < 0) {
+	log_f("Failed to write recording %s: %s\n", r->name, strerror(errno));
+	r->errors++;
+	close_recording( r);
+	return 0;
+    }
+
+    r->pending[r->n_pending].ms = ms;
+    r->pending[r->n_pending].offset = r->bytes;
+    r->pending[r->n_pending].length = len;
+    if ( ++r->n_pending == RECORD_INDEX_BATCH) flush_index( r);
+
+    r->bytes += len;
+    write_behind( r);
+    return 1;
+}
+
+/*
+** Continuous recording.
+*/
+static struct recording segment = { .fd = -1, .indexFd = -1 };
+static int lastSerial = 0;
+static long recordedFrames = 0;
+static long droppedFrames = 0;
+
+struct arrival {
+    int serial;
+    long long ms;
+};
+
+static void record_frame( const struct chunk *c, void *arg)
+{
+    struct arrival *a = (struct arrival *)arg;
+
+    if ( !c[0].data || !c[0].length) return;
+
+    if ( segment.fd >= 0 && a->ms - segment.start >= record_segment_seconds * 1000LL) close_recording( &segment);
+    if ( segment.fd < 0) {
+	if ( !open_recording( &segment, a->ms)) {
+	    droppedFrames++;
+	    return;
+	}
+	prune_recordings( segment.dir, record_megabytes, segment.name);
+    }
+
+    if ( append_recording( &segment, c, a->ms)) recordedFrames++;
+    else droppedFrames++;
+}
+
+static void capture_record( const struct chunk *c, void *arg)
+{
+    struct arrival a = { .serial = current_frame_serial(), .ms = current_frame_time() };
+
+    if ( !c[0].data) return;
+    if ( lastSerial && a.serial > lastSerial + 1) droppedFrames += a.serial - lastSerial - 1;
+    lastSerial = a.serial;
+    with_jpeg_frame( record_frame, &a);
+}
+
+static void *record_loop( void *arg)
+{
+    int last = 0;
+
+    for (;;) {
+	wait_for_frame( last);
+	last = frame_serial();
+	with_current_frame( capture_record, 0);
+    }
+    return 0;
+}
+
+/*
+** Directories are opened at startup, so recording carries on after a chroot.
+*/
+int open_recording_dir( const char *path)
+{
+    int dir = open( path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+    if ( dir < 0) fatal_f("Failed to open recording directory %s: %s\n", path, strerror(errno));
+    return dir;
+}
+
+void start_recorder(void)
+{
+    pthread_t thread;
+
+    if ( !record_dir) return;
+
+    segment.dir = open_recording_dir( record_dir);
+
+    add_metric( "record_frames_total", "Frames written to the recording.", &recordedFrames);
+    add_metric( "record_dropped_frames_total", "Frames not recorded because the disk fell behind or failed.", &droppedFrames);
+    add_metric( "record_errors_total", "Failed writes and file creations while recording.", &segment.errors);
+
+    if ( pthread_create( &thread, 0, record_loop, 0)) fatal_f("Failed to start recorder thread.\n");
+    pthread_detach( thread);
+}
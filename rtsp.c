@@ -0,0 +1,781 @@
+/*
+** RTSP (RFC 2326) with RTP/JPEG (RFC 2435), for recorders and players that
+** want a camera to speak RTSP rather than multipart HTTP. The frames are
+** /image.jpg's, cut into packets without decoding: the RTP/JPEG header
+** carries the size, sampling, restart interval and quantization tables, and
+** the rest of each packet is the entropy coded data as it is. RFC 2435 has
+** no room for Huffman tables, the receiver uses the standard ones, which is
+** what webcams and libjpeg without optimize= both use.
+**
+** Each client gets RTP over UDP to the ports it asks for, or interleaved on
+** its RTSP connection. With --rtsp-multicast the clients that ask for
+** multicast share one stream, sent once to the group whoever is watching.
+** RTP timestamps are the capture times at 90kHz.
+**
+** A session lives as long as its RTSP connection. With UDP it must send
+** something, a GET_PARAMETER say, at least once a minute or it is dropped.
+*/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tinycamd.h"
+#include "httpd.h"
+
+#define RTP_PAYLOAD 1400          // bytes of JPEG data and headers in a packet, fits an ethernet MTU
+#define RTSP_TIMEOUT 60           // seconds a UDP session may stay quiet
+#define REPORT_MS 5000            // between RTCP sender reports
+#define MAX_SESSIONS 16           // playing at once, each play thread holds a frame hazard slot
+
+struct rtp_out {
+    int rtp, rtcp;                // UDP sockets, or both the RTSP connection when interleaved
+    int channel;                  // first interleaved channel, -1 for UDP
+    pthread_mutex_t *lock;        // held while writing an interleaved connection
+    unsigned int ssrc;
+    unsigned short seq;
+    unsigned int packets, octets;
+    long long reported;           // ms of the frame the last sender report was for
+};
+
+enum { TRANSPORT_NONE, TRANSPORT_UDP, TRANSPORT_TCP, TRANSPORT_MULTICAST };
+
+struct session {
+    int conn;
+    pthread_mutex_t lock;         // serializes writes to conn
+    struct sockaddr_in peer;
+    char id[16];
+    int transport;
+    int playing;                  // the play thread runs while this is set
+    struct camera *camera;        // from a /cam/NAME/ url, 0 for the first
+    pthread_t thread;
+    struct rtp_out out;
+};
+
+static int rtspSocket = -1;
+static struct sockaddr_in groupAddr;
+
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_cond = PTHREAD_COND_INITIALIZER;
+static int groupViewers = 0;      // guarded by group_mutex
+static struct rtp_out group = { .rtp = -1, .rtcp = -1, .channel = -1 };
+
+static long rtspSessions = 0;
+static long rtpFrames = 0;
+static long rtpPackets = 0;
+static long rtpUnsentFrames = 0;
+
+/*
+** Send one RTP or RTCP packet. Returns 0 if the interleaved connection
+** has failed, a UDP packet that doesn't go is only lost.
+*/
+static int send_packet( struct rtp_out *o, struct iovec *iov, int n, int control)
+{
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+    unsigned char prefix[4];
+    int i, len = 0, sent;
+
+    for ( i = 0; i < n; i++) len += iov[i].iov_len;
+
+    if ( o->channel < 0) {
+	sendmsg( control ? o->rtcp : o->rtp, &msg, MSG_NOSIGNAL);
+	return 1;
+    }
+
+    // '$', the channel, and the length, in front of the packet
+    prefix[0] = '$';
+    prefix[1] = o->channel + control;
+    prefix[2] = len >> 8;
+    prefix[3] = len;
+    iov[-1].iov_base = prefix;
+    iov[-1].iov_len = 4;
+    msg.msg_iov = iov - 1;
+    msg.msg_iovlen = n + 1;
+
+    pthread_mutex_lock( o->lock);
+    sent = sendmsg( o->rtp, &msg, MSG_NOSIGNAL);
+    pthread_mutex_unlock( o->lock);
+    return sent == len + 4;
+}
+
+static void put32( unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+** An RTCP sender report, so receivers can line our timestamps up with the
+** wall clock.
+*/
+static int send_report( struct rtp_out *o, long long ms)
+{
+    unsigned char sr[28];
+    struct iovec iov[2];
+
+    sr[0] = 0x80;
+    sr[1] = 200;
+    sr[2] = 0;
+    sr[3] = 6;
+    put32( sr+4, o->ssrc);
+    put32( sr+8, ms / 1000 + 2208988800U);            // NTP counts from 1900
+    put32( sr+12, (unsigned int)((ms % 1000) * 4294967296LL / 1000));
+    put32( sr+16, (unsigned int)(ms * 90));
+    put32( sr+20, o->packets);
+    put32( sr+24, o->octets);
+
+    iov[1].iov_base = sr;
+    iov[1].iov_len = sizeof(sr);
+    o->reported = ms;
+    return send_packet( o, iov+1, 1, 1);
+}
+
+/*
+** Find quantization table tq in the DQT segments, 8 bit ones only.
+*/
+static const unsigned char *find_table( const unsigned char *p, const struct jpeg_index *ix, int tq)
+{
+    int i;
+
+    for ( i = 0; i < ix->n_dqt && i < MAX_JPEG_TABLES; i++) {
+	const unsigned char *t = p + ix->dqt[i] + 4;
+	const unsigned char *end = p + ix->dqt[i] + 2 + ((p[ix->dqt[i]+2] << 8) | p[ix->dqt[i]+3]);
+
+	while ( t < end) {
+	    int size = (t[0] >> 4) ? 129 : 65;
+
+	    if ( t + size > end) break;
+	    if ( (t[0] & 0x0f) == tq) return (t[0] >> 4) ? 0 : t+1;
+	    t += size;
+	}
+    }
+    return 0;
+}
+
+/*
+** Packetize a JPEG. Only what RFC 2435 can describe goes: baseline, three
+** components, luma at 2x1 or 2x2 and chroma at 1x1, at most 2040 pixels a
+** side. Returns 0 if it couldn't be sent at all.
+*/
+static int send_jpeg( struct rtp_out *o, const unsigned char *p, unsigned int len, long long ms)
+{
+    struct jpeg_index ix;
+    const unsigned char *sof, *q0, *q1, *scan;
+    unsigned int scanLength, offset, ts = (unsigned int)(ms * 90);
+    int type;
+
+    if ( !index_jpeg( p, len, &ix) || p[ix.sof+1] != 0xc0) return 0;
+
+    sof = p + ix.sof;
+    if ( ((sof[2] << 8) | sof[3]) < 17 || sof[4] != 8 || sof[9] != 3) return 0;
+    if ( sof[11] == 0x21) type = 0;
+    else if ( sof[11] == 0x22) type = 1;
+    else return 0;
+    if ( sof[14] != 0x11 || sof[17] != 0x11 || sof[15] != sof[18]) return 0;
+    if ( ix.width == 0 || ix.width > 2040 || ix.height == 0 || ix.height > 2040) return 0;
+
+    q0 = find_table( p, &ix, sof[12]);
+    q1 = find_table( p, &ix, sof[15]);
+    if ( !q0 || !q1) return 0;
+    if ( ix.dri) type |= 64;
+
+    scan = p + ix.scan;
+    scanLength = ix.eoi - ix.scan;
+
+    if ( ms - o->reported >= REPORT_MS && !send_report( o, ms)) return 0;
+
+    for ( offset = 0; offset < scanLength; ) {
+	unsigned char head[12 + 8 + 4 + 4 + 128], *h = head;
+	struct iovec iov[3];
+	unsigned int room, n;
+
+	// the RTP header, the marker is set below on the last packet
+	*h++ = 0x80;
+	*h++ = 26;
+	*h++ = o->seq >> 8;
+	*h++ = o->seq;
+	put32( h, ts);
+	put32( h+4, o->ssrc);
+	h += 8;
+
+	// the main JPEG header, quantization tables come with every frame (Q=255)
+	put32( h, offset);
+	h[4] = type;
+	h[5] = 255;
+	h[6] = (ix.width + 7) / 8;
+	h[7] = (ix.height + 7) / 8;
+	h += 8;
+
+	if ( ix.dri) {
+	    // restart intervals needn't line up with packets, so F=L=1 and count 0x3fff
+	    *h++ = ix.dri >> 8;
+	    *h++ = ix.dri;
+	    *h++ = 0xff;
+	    *h++ = 0xff;
+	}
+	if ( offset == 0) {
+	    *h++ = 0;
+	    *h++ = 0;
+	    *h++ = 0;
+	    *h++ = 128;
+	    memcpy( h, q0, 64);
+	    memcpy( h+64, q1, 64);
+	    h += 128;
+	}
+
+	room = RTP_PAYLOAD - (h - head);
+	n = scanLength - offset < room ? scanLength - offset : room;
+	if ( offset + n == scanLength) head[1] |= 0x80;
+
+	iov[1].iov_base = head;
+	iov[1].iov_len = h - head;
+	iov[2].iov_base = (void *)(scan + offset);
+	iov[2].iov_len = n;
+	if ( !send_packet( o, iov+1, 2, 0)) return 0;
+
+	o->seq++;
+	o->packets++;
+	o->octets += (h - head) - 12 + n;
+	rtpPackets++;
+	offset += n;
+    }
+    rtpFrames++;
+    return 1;
+}
+
+struct rtp_frame {
+    struct image *im;
+    long long ms;
+};
+
+static void capture_rtp( const struct chunk *c, void *arg)
+{
+    struct rtp_frame *f = (struct rtp_frame *)arg;
+
+    if ( !c[0].data) return;
+    f->ms = current_frame_time();
+    with_jpeg_frame( copy_frame, &f->im);
+}
+
+/*
+** Send the next frame after last. Returns -1 if there wasn't one in time,
+** 0 if it couldn't be sent, 1 if it went.
+*/
+static int send_next( struct rtp_out *o, int *last)
+{
+    struct rtp_frame f = { 0 };
+    int ok;
+
+    if ( !wait_for_frame_timeout( *last, 500)) return -1;
+    *last = frame_serial();
+    with_current_frame( capture_rtp, &f);
+    if ( !f.im) return -1;
+
+    ok = send_jpeg( o, f.im->data, f.im->length, f.ms);
+    if ( !ok) rtpUnsentFrames++;
+    release_image( f.im);
+    return ok || o->channel < 0;   // a frame RFC 2435 can't carry is no reason to hang up
+}
+
+static void *play_unicast( void *arg)
+{
+    struct session *s = (struct session *)arg;
+    int last = 0;
+
+    use_camera( s->camera);
+    while ( __atomic_load_n( &s->playing, __ATOMIC_ACQUIRE)) {
+	if ( send_next( &s->out, &last) == 0) {
+	    // the interleaved connection is stuck or gone, make the reader notice
+	    shutdown( s->conn, SHUT_RDWR);
+	    break;
+	}
+    }
+    return 0;
+}
+
+static void *play_multicast( void *arg)
+{
+    int last = 0;
+
+    for (;;) {
+	pthread_mutex_lock( &group_mutex);
+	while ( groupViewers == 0) pthread_cond_wait( &group_cond, &group_mutex);
+	pthread_mutex_unlock( &group_mutex);
+
+	send_next( &group, &last);
+    }
+    return 0;
+}
+
+static void stop_playing( struct session *s)
+{
+    if ( !s->playing) return;
+    if ( s->transport == TRANSPORT_MULTICAST) {
+	pthread_mutex_lock( &group_mutex);
+	groupViewers--;
+	pthread_mutex_unlock( &group_mutex);
+    } else {
+	__atomic_store_n( &s->playing, 0, __ATOMIC_RELEASE);
+	pthread_join( s->thread, 0);
+    }
+    s->playing = 0;
+    __atomic_fetch_sub( &rtspSessions, 1, __ATOMIC_RELAXED);
+}
+
+static void drop_transport( struct session *s)
+{
+    stop_playing( s);
+    if ( s->transport == TRANSPORT_UDP) {
+	close( s->out.rtp);
+	close( s->out.rtcp);
+    }
+    s->transport = TRANSPORT_NONE;
+}
+
+/*
+** A pair of UDP ports for a client, connected to its ports so nothing
+** else can use them. Returns our RTP port, or 0.
+*/
+static int open_udp( struct session *s, int rtpPort, int rtcpPort)
+{
+    struct sockaddr_in a;
+    socklen_t alen = sizeof(a);
+    int tries;
+
+    for ( tries = 0; tries < 16; tries++) {
+	int port;
+
+	s->out.rtp = socket( AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	s->out.rtcp = socket( AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if ( s->out.rtp < 0 || s->out.rtcp < 0) break;
+
+	memset( &a, 0, sizeof(a));
+	a.sin_family = AF_INET;
+	if ( bind( s->out.rtp, (struct sockaddr *)&a, sizeof(a)) != 0 ||
+	     getsockname( s->out.rtp, (struct sockaddr *)&a, &alen) != 0) break;
+	port = ntohs( a.sin_port);
+	a.sin_port = htons( port + 1);
+	if ( port < 65535 && bind( s->out.rtcp, (struct sockaddr *)&a, sizeof(a)) == 0) {
+	    a = s->peer;
+	    a.sin_port = htons( rtpPort);
+	    if ( connect( s->out.rtp, (struct sockaddr *)&a, sizeof(a)) != 0) break;
+	    a.sin_port = htons( rtcpPort);
+	    if ( connect( s->out.rtcp, (struct sockaddr *)&a, sizeof(a)) != 0) break;
+	    return port;
+	}
+	close( s->out.rtp);
+	close( s->out.rtcp);
+    }
+    log_f("Failed to open RTP ports: %s\n", strerror(errno));
+    if ( s->out.rtp >= 0) close( s->out.rtp);
+    if ( s->out.rtcp >= 0) close( s->out.rtcp);
+    return 0;
+}
+
+static void reply( struct session *s, int status, const char *text, int cseq, const char *headers,
+		   const char *body)
+{
+    char buf[4096];
+    int len = snprintf( buf, sizeof(buf), "RTSP/1.0 %d %s\r\nCSeq: %d\r\nServer: tinycamd\r\n", status, text, cseq);
+
+    if ( s->transport != TRANSPORT_NONE && len < sizeof(buf)) {
+	len += snprintf( buf+len, sizeof(buf)-len, "Session: %s;timeout=%d\r\n", s->id, RTSP_TIMEOUT);
+    }
+    if ( len < sizeof(buf)) len += snprintf( buf+len, sizeof(buf)-len, "%s", headers ? headers : "");
+    if ( body && len < sizeof(buf)) {
+	len += snprintf( buf+len, sizeof(buf)-len, "Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+    } else if ( len < sizeof(buf)) {
+	len += snprintf( buf+len, sizeof(buf)-len, "\r\n");
+    }
+    if ( len >= sizeof(buf)) len = sizeof(buf) - 1;
+
+    pthread_mutex_lock( &s->lock);
+    send( s->conn, buf, len, MSG_NOSIGNAL);
+    pthread_mutex_unlock( &s->lock);
+}
+
+/*
+** The value of a header, copied into buf, or 0 if there isn't one.
+*/
+static char *header( const char *msg, const char *name, char *buf, int size)
+{
+    int n = strlen( name);
+    const char *line;
+
+    for ( line = strstr( msg, "\r\n"); line && line[2] != '\r'; line = strstr( line+2, "\r\n")) {
+	const char *v = line + 2, *end;
+
+	if ( strncasecmp( v, name, n) != 0 || v[n] != ':') continue;
+	for ( v += n+1; *v == ' '; v++);
+	end = strstr( v, "\r\n");
+	if ( end - v >= size) return 0;
+	memcpy( buf, v, end - v);
+	buf[end - v] = 0;
+	return buf;
+    }
+    return 0;
+}
+
+/*
+** The same user:password rule as /image.jpg, Basic only.
+*/
+static int authorized( const char *msg)
+{
+    char auth[256], decoded[256];
+
+    if ( !password && !setup_password) return 1;
+    if ( !header( msg, "Authorization", auth, sizeof(auth)) || strncmp( auth, "Basic ", 6) != 0) return 0;
+    HTTPD_Base64_Decode( decoded, sizeof(decoded), auth+6);
+    return (password && strcmp( decoded, password) == 0) || (setup_password && strcmp( decoded, setup_password) == 0);
+}
+
+static void setup( struct session *s, const char *msg, int cseq)
+{
+    char transport[256], headers[512];
+    int a, b;
+
+    if ( s->playing) {
+	reply( s, 455, "Method Not Valid In This State", cseq, 0, 0);
+	return;
+    }
+    if ( !header( msg, "Transport", transport, sizeof(transport))) transport[0] = 0;
+    drop_transport( s);
+
+    s->out.ssrc = random();
+    s->out.seq = random();
+    s->out.packets = s->out.octets = 0;
+    s->out.reported = 0;
+    s->out.lock = &s->lock;
+
+    if ( strstr( transport, "RTP/AVP/TCP")) {
+	const char *i = strstr( transport, "interleaved=");
+
+	if ( !i || sscanf( i, "interleaved=%d", &a) != 1 || a < 0 || a > 254) a = 0;
+	s->out.rtp = s->out.rtcp = s->conn;
+	s->out.channel = a;
+	s->transport = TRANSPORT_TCP;
+	snprintf( headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+		  a, a+1, s->out.ssrc);
+    } else if ( strstr( transport, "multicast")) {
+	if ( !rtsp_multicast || (s->camera && s->camera != cameras)) {
+	    reply( s, 461, "Unsupported Transport", cseq, 0, 0);
+	    return;
+	}
+	s->transport = TRANSPORT_MULTICAST;
+	snprintf( headers, sizeof(headers), "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d;ssrc=%08X\r\n",
+		  inet_ntoa( groupAddr.sin_addr), ntohs( groupAddr.sin_port), ntohs( groupAddr.sin_port) + 1, rtsp_ttl, group.ssrc);
+    } else if ( strstr( transport, "RTP/AVP") && strstr( transport, "client_port=") &&
+		sscanf( strstr( transport, "client_port="), "client_port=%d-%d", &a, &b) >= 1) {
+	int port;
+
+	if ( sscanf( strstr( transport, "client_port="), "client_port=%d-%d", &a, &b) != 2) b = a + 1;
+	if ( a <= 0 || a > 65535 || b <= 0 || b > 65535 || !(port = open_udp( s, a, b))) {
+	    reply( s, 461, "Unsupported Transport", cseq, 0, 0);
+	    return;
+	}
+	s->out.channel = -1;
+	s->transport = TRANSPORT_UDP;
+	snprintf( headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\n",
+		  a, b, port, port+1, s->out.ssrc);
+    } else {
+	reply( s, 461, "Unsupported Transport", cseq, 0, 0);
+	return;
+    }
+    reply( s, 200, "OK", cseq, headers, 0);
+}
+
+static void play( struct session *s, const char *url, int cseq)
+{
+    char headers[512];
+    struct rtp_out *o = s->transport == TRANSPORT_MULTICAST ? &group : &s->out;
+
+    if ( s->transport == TRANSPORT_NONE) {
+	reply( s, 455, "Method Not Valid In This State", cseq, 0, 0);
+	return;
+    }
+    // take the place before saying yes, so two PLAYs can't both get the last
+    if ( !s->playing && __atomic_add_fetch( &rtspSessions, 1, __ATOMIC_RELAXED) > MAX_SESSIONS) {
+	__atomic_fetch_sub( &rtspSessions, 1, __ATOMIC_RELAXED);
+	reply( s, 453, "Not Enough Bandwidth", cseq, 0, 0);
+	return;
+    }
+    snprintf( headers, sizeof(headers), "Range: npt=0.000-\r\nRTP-Info: url=%s;seq=%u\r\n", url, (unsigned int)(o->seq + 1) & 0xffff);
+    // the reply has to be out before the first packet on an interleaved connection
+    reply( s, 200, "OK", cseq, headers, 0);
+    if ( s->playing) return;
+
+    s->playing = 1;
+    if ( s->transport == TRANSPORT_MULTICAST) {
+	pthread_mutex_lock( &group_mutex);
+	groupViewers++;
+	pthread_cond_signal( &group_cond);
+	pthread_mutex_unlock( &group_mutex);
+    } else if ( pthread_create( &s->thread, 0, play_unicast, s)) {
+	log_f("Failed to start RTP thread.\n");
+	s->playing = 0;
+	__atomic_fetch_sub( &rtspSessions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void describe( struct session *s, const char *url, int cseq)
+{
+    char sdp[512], headers[512];
+    struct sockaddr_in me;
+    socklen_t len = sizeof(me);
+
+    if ( getsockname( s->conn, (struct sockaddr *)&me, &len) != 0) me.sin_addr.s_addr = 0;
+    snprintf( sdp, sizeof(sdp),
+	      "v=0\r\n"
+	      "o=- %s 1 IN IP4 %s\r\n"
+	      "s=tinycamd\r\n"
+	      "c=IN IP4 0.0.0.0\r\n"
+	      "t=0 0\r\n"
+	      "a=control:*\r\n"
+	      "m=video 0 RTP/AVP 26\r\n"
+	      "a=control:track0\r\n",
+	      s->id, inet_ntoa( me.sin_addr));
+    snprintf( headers, sizeof(headers), "Content-Type: application/sdp\r\nContent-Base: %s%s\r\n",
+	      url, url[0] && url[strlen(url)-1] == '/' ? "" : "/");
+    reply( s, 200, "OK", cseq, headers, sdp);
+}
+
+/*
+** Act on one request, msg is the request line and headers.
+*/
+static void handle_rtsp( struct session *s, const char *msg)
+{
+    char method[16], url[256], buf[64];
+    int cseq = 0;
+
+    if ( sscanf( msg, "%15s %255s", method, url) != 2) return;
+    if ( header( msg, "CSeq", buf, sizeof(buf))) cseq = atoi( buf);
+    if ( verbose) log_f("RTSP %s %s\n", method, url);
+
+    if ( strstr( url, "/cam/")) {
+	const char *name = strstr( url, "/cam/") + 5;
+	struct camera *c = find_camera( name, strcspn( name, "/"));
+
+	if ( !c) {
+	    reply( s, 404, "Not Found", cseq, 0, 0);
+	    return;
+	}
+	if ( s->transport == TRANSPORT_NONE) s->camera = c;
+    }
+
+    if ( strcmp( method, "OPTIONS") == 0) {
+	reply( s, 200, "OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n", 0);
+	return;
+    }
+    if ( strcmp( method, "GET_PARAMETER") == 0 || strcmp( method, "SET_PARAMETER") == 0) {
+	reply( s, 200, "OK", cseq, 0, 0);
+	return;
+    }
+    if ( !authorized( msg)) {
+	reply( s, 401, "Unauthorized", cseq, "WWW-Authenticate: Basic realm=\"tinycamd\"\r\n", 0);
+	return;
+    }
+    if ( s->transport != TRANSPORT_NONE && header( msg, "Session", buf, sizeof(buf)) &&
+	 strncmp( buf, s->id, strlen(s->id)) != 0) {
+	reply( s, 454, "Session Not Found", cseq, 0, 0);
+	return;
+    }
+
+    if ( strcmp( method, "DESCRIBE") == 0) describe( s, url, cseq);
+    else if ( strcmp( method, "SETUP") == 0) setup( s, msg, cseq);
+    else if ( strcmp( method, "PLAY") == 0) play( s, url, cseq);
+    else if ( strcmp( method, "PAUSE") == 0) {
+	stop_playing( s);
+	reply( s, 200, "OK", cseq, 0, 0);
+    } else if ( strcmp( method, "TEARDOWN") == 0) {
+	reply( s, 200, "OK", cseq, 0, 0);
+	drop_transport( s);
+    } else reply( s, 501, "Not Implemented", cseq, 0, 0);
+}
+
+/*
+** One thread per connection, reading requests, and skipping over the RTCP
+** receiver reports a client may interleave with them.
+*/
+static void *rtsp_connection( void *arg)
+{
+    struct session *s = (struct session *)arg;
+    char buf[4096];
+    int used = 0;
+
+    for (;;) {
+	struct pollfd p = { .fd = s->conn, .events = POLLIN };
+	char *end;
+	int n;
+
+	// a client playing interleaved can be quiet, it's gone when a send fails
+	if ( poll( &p, 1, s->transport == TRANSPORT_TCP && s->playing ? -1 : RTSP_TIMEOUT * 1000) <= 0) break;
+	n = read( s->conn, buf + used, sizeof(buf) - 1 - used);
+	if ( n <= 0) break;
+	used += n;
+	buf[used] = 0;
+
+	for (;;) {
+	    if ( buf[0] == '$') {
+		if ( used < 4) break;
+		n = 4 + (((unsigned char)buf[2] << 8) | (unsigned char)buf[3]);
+		if ( n > used) {
+		    if ( n > sizeof(buf) - 1) goto done;
+		    break;
+		}
+	    } else if ( (end = strstr( buf, "\r\n\r\n"))) {
+		char len[16];
+
+		end[2] = 0;
+		n = end + 4 - buf;
+		if ( header( buf, "Content-Length", len, sizeof(len))) n += atoi( len);
+		if ( n > sizeof(buf) - 1) goto done;
+		if ( n > used) {
+		    end[2] = '\r';
+		    break;
+		}
+		handle_rtsp( s, buf);
+	    } else {
+		if ( used >= sizeof(buf) - 1) goto done;
+		break;
+	    }
+	    memmove( buf, buf + n, used - n);
+	    used -= n;
+	    buf[used] = 0;
+	}
+    }
+  done:
+    drop_transport( s);
+    close( s->conn);
+    pthread_mutex_destroy( &s->lock);
+    free( s);
+    return 0;
+}
+
+static void *rtsp_listener( void *arg)
+{
+    for (;;) {
+	struct session *s;
+	socklen_t len = sizeof(s->peer);
+	struct timeval tv = { .tv_sec = 10 };
+	int one = 1;
+
+	s = calloc( 1, sizeof(*s));
+	if ( !s) fatal_f("Failed to allocate RTSP session.\n");
+	s->conn = accept4( rtspSocket, (struct sockaddr *)&s->peer, &len, SOCK_CLOEXEC);
+	if ( s->conn < 0) {
+	    free( s);
+	    continue;
+	}
+	// a client that stops reading an interleaved stream makes a send fail rather than hang
+	setsockopt( s->conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt( s->conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	pthread_mutex_init( &s->lock, 0);
+	snprintf( s->id, sizeof(s->id), "%08lX", random());
+	s->out.rtp = s->out.rtcp = -1;
+
+	{
+	    pthread_t thread;
+
+	    if ( pthread_create( &thread, 0, rtsp_connection, s)) {
+		log_f("Failed to start RTSP thread.\n");
+		close( s->conn);
+		free( s);
+		continue;
+	    }
+	    pthread_detach( thread);
+	}
+    }
+    return 0;
+}
+
+/*
+** Parse [addr:]port into a, address defaulting to any.
+*/
+static void parse_address( const char *name, struct sockaddr_in *a, int port)
+{
+    char host[64];
+    const char *colon = strrchr( name, ':');
+
+    memset( a, 0, sizeof(*a));
+    a->sin_family = AF_INET;
+    a->sin_port = htons( port);
+    if ( colon) {
+	if ( colon - name >= sizeof(host)) fatal_f("Bad address: %s\n", name);
+	memcpy( host, name, colon - name);
+	host[colon - name] = 0;
+	if ( host[0] && inet_pton( AF_INET, host, &a->sin_addr) != 1) fatal_f("Bad address: %s\n", name);
+	a->sin_port = htons( atoi( colon+1));
+    } else if ( strchr( name, '.')) {
+	if ( inet_pton( AF_INET, name, &a->sin_addr) != 1) fatal_f("Bad address: %s\n", name);
+    } else {
+	a->sin_port = htons( atoi( name));
+    }
+    if ( a->sin_port == 0) fatal_f("Bad port: %s\n", name);
+}
+
+/*
+** The sockets are made now, so a port below 1024 works before we setuid.
+*/
+void start_rtsp(void)
+{
+    struct sockaddr_in a;
+    pthread_t thread;
+    int one = 1;
+
+    if ( !rtsp_bind) return;
+
+    srandom( time(0) ^ getpid());
+
+    parse_address( rtsp_bind, &a, 554);
+    rtspSocket = socket( AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if ( rtspSocket < 0) fatal_f("Failed to create RTSP socket: %s\n", strerror(errno));
+    setsockopt( rtspSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ( bind( rtspSocket, (struct sockaddr *)&a, sizeof(a)) != 0) fatal_f("Failed to bind RTSP to %s: %s\n", rtsp_bind, strerror(errno));
+    if ( listen( rtspSocket, 8) != 0) fatal_f("Failed to listen for RTSP: %s\n", strerror(errno));
+
+    if ( rtsp_multicast) {
+	unsigned char ttl = rtsp_ttl;
+
+	parse_address( rtsp_multicast, &groupAddr, 5004);
+	if ( !IN_MULTICAST( ntohl( groupAddr.sin_addr.s_addr))) fatal_f("Not a multicast address: %s\n", rtsp_multicast);
+	group.rtp = socket( AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	group.rtcp = socket( AF_INET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if ( group.rtp < 0 || group.rtcp < 0) fatal_f("Failed to create multicast socket: %s\n", strerror(errno));
+	setsockopt( group.rtp, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt( group.rtcp, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	if ( connect( group.rtp, (struct sockaddr *)&groupAddr, sizeof(groupAddr)) != 0) {
+	    fatal_f("Failed to address multicast group %s: %s\n", rtsp_multicast, strerror(errno));
+	}
+	a = groupAddr;
+	a.sin_port = htons( ntohs( groupAddr.sin_port) + 1);
+	if ( connect( group.rtcp, (struct sockaddr *)&a, sizeof(a)) != 0) {
+	    fatal_f("Failed to address multicast group %s: %s\n", rtsp_multicast, strerror(errno));
+	}
+	group.ssrc = random();
+	group.seq = random();
+	if ( pthread_create( &thread, 0, play_multicast, 0)) fatal_f("Failed to start multicast thread.\n");
+	pthread_detach( thread);
+    }
+
+    add_metric( "rtsp_sessions", "RTSP sessions playing now.", &rtspSessions);
+    add_metric( "rtp_frames_total", "Frames sent over RTP, counting a multicast frame once.", &rtpFrames);
+    add_metric( "rtp_packets_total", "RTP packets sent.", &rtpPackets);
+    add_metric( "rtp_unsent_frames_total", "Frames RTP/JPEG couldn't carry, or that failed to send.", &rtpUnsentFrames);
+
+    if ( pthread_create( &thread, 0, rtsp_listener, 0)) fatal_f("Failed to start RTSP thread.\n");
+    pthread_detach( thread);
+}
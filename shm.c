@@ -0,0 +1,150 @@
+/*
+** Publish frames into a POSIX shared memory ring for programs on the same
+** box, see tcshm.h for the layout and the client library. Each frame is
+** copied in once, straight from the capture buffer if nothing has to be
+** done to it.
+*/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "tinycamd.h"
+#include "tcshm.h"
+
+static struct tcshm_header *ring = 0;
+static unsigned int nextSlot = 0;
+
+static long shmFrames = 0;
+static long shmTooBig = 0;
+
+struct arrival {
+    int serial;
+    long long ms;
+    unsigned int format;
+    int width, height;
+};
+
+static void publish_shm( const struct chunk *c, void *arg)
+{
+    struct arrival *a = (struct arrival *)arg;
+    struct tcshm_slot *s = &ring->slot[nextSlot];
+    unsigned char *data = (unsigned char *)ring + ring->dataOffset + nextSlot * (size_t)ring->slotSize;
+    unsigned int len = 0;
+    int i;
+
+    for ( i = 0; c[i].data; i++) len += c[i].length;
+    if ( len == 0) return;
+    if ( len > ring->slotSize) {
+	shmTooBig++;
+	return;
+    }
+
+    __atomic_store_n( &s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_RELEASE);
+
+    for ( i = 0; c[i].data; i++) {
+	memcpy( data, c[i].data, c[i].length);
+	data += c[i].length;
+    }
+    s->format = a->format;
+    s->serial = a->serial;
+    s->ms = a->ms;
+    s->length = len;
+    s->width = a->width;
+    s->height = a->height;
+
+    __atomic_store_n( &s->seq, s->seq + 1, __ATOMIC_RELEASE);
+    nextSlot = (nextSlot + 1) % ring->slots;
+    shmFrames++;
+}
+
+static void capture_shm( const struct chunk *c, void *arg)
+{
+    struct arrival a = { .serial = current_frame_serial(), .ms = current_frame_time() };
+    struct camera *cam = this_camera();
+
+    if ( !c[0].data) return;
+
+    a.format = TCSHM_JPEG;
+    if ( cam->method == CAMERA_METHOD_YUYV || cam->transform) {
+	a.width = (cam->transform & TRANSFORM_TRANSPOSE) ? cam->height & ~1 : cam->width;
+	a.height = (cam->transform & TRANSFORM_TRANSPOSE) ? cam->width : cam->height;
+    } else {
+	a.width = current_frame_index()->width;
+	a.height = current_frame_index()->height;
+    }
+    with_jpeg_frame( publish_shm, &a);
+
+    if ( shm_yuyv && cam->method == CAMERA_METHOD_YUYV) {
+	a.format = TCSHM_YUYV;
+	a.width = cam->width;
+	a.height = cam->height;
+	publish_shm( c, &a);
+    }
+
+    __atomic_store_n( &ring->latest, a.serial, __ATOMIC_RELEASE);
+    __atomic_store_n( &ring->futex, a.serial, __ATOMIC_RELEASE);
+    syscall( SYS_futex, &ring->futex, FUTEX_WAKE, 0x7fffffff, 0, 0, 0);
+}
+
+static void *shm_loop( void *arg)
+{
+    int last = 0;
+
+    for (;;) {
+	wait_for_frame( last);
+	last = frame_serial();
+	with_current_frame( capture_shm, 0);
+    }
+    return 0;
+}
+
+/*
+** Make the ring now, before any chroot, and size every slot for the
+** largest frame the camera can give us, a raw one. It is the first
+** camera's.
+*/
+void start_shm(void)
+{
+    long page = sysconf( _SC_PAGESIZE);
+    size_t header, slotSize, total;
+    pthread_t thread;
+    int fd;
+
+    if ( !shm_name) return;
+
+    slotSize = ( (size_t)cameras->width * cameras->height * 2 + page - 1) / page * page;
+    header = ( sizeof(struct tcshm_header) + shm_slots * sizeof(struct tcshm_slot) + page - 1) / page * page;
+    total = header + shm_slots * slotSize;
+
+    fd = shm_open( shm_name, O_CREAT|O_RDWR|O_CLOEXEC, 0644);
+    if ( fd < 0) fatal_f("Failed to create shared memory %s: %s\n", shm_name, strerror(errno));
+    if ( ftruncate( fd, 0) != 0 || ftruncate( fd, total) != 0) {
+	fatal_f("Failed to size shared memory %s: %s\n", shm_name, strerror(errno));
+    }
+    ring = mmap( 0, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if ( ring == MAP_FAILED) fatal_f("Failed to map shared memory %s: %s\n", shm_name, strerror(errno));
+    close( fd);
+
+    ring->version = TCSHM_VERSION;
+    ring->slots = shm_slots;
+    ring->slotSize = slotSize;
+    ring->dataOffset = header;
+    __atomic_store_n( &ring->magic, TCSHM_MAGIC, __ATOMIC_RELEASE);   // last, so clients see it whole
+
+    add_metric( "shm_frames_total", "Frames published to shared memory.", &shmFrames);
+    add_metric( "shm_too_big_frames_total", "Frames too big for a shared memory slot.", &shmTooBig);
+
+    if ( pthread_create( &thread, 0, shm_loop, 0)) fatal_f("Failed to start shared memory thread.\n");
+    pthread_detach( thread);
+}
@@ -0,0 +1,98 @@
+/*
+** Keep the latest frame in a file, for a web server in front of us to
+** serve as a static file. Each frame goes to a temporary file beside the
+** real one, written straight from the capture buffer, then is renamed over
+** it, so readers only ever open a whole frame.
+*/
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include "tinycamd.h"
+
+static int snapshotDir = -1;
+static char name[256];
+static char temporary[sizeof(name) + 8];
+static int lastSerial = 0;
+
+static long snapshots = 0;
+static long snapshotErrors = 0;
+
+static void write_snapshot( const struct chunk *c, void *arg)
+{
+    int fd;
+
+    if ( !c[0].data || !c[0].length) return;
+
+    fd = openat( snapshotDir, temporary, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if ( fd < 0) {
+	if ( snapshotErrors++ == 0) log_f("Failed to create snapshot %s: %s\n", temporary, strerror(errno));
+	return;
+    }
+    if ( write_chunks( fd, c) < 0 || (snapshot_fsync && fdatasync( fd) != 0)) {
+	if ( snapshotErrors++ == 0) log_f("Failed to write snapshot %s: %s\n", temporary, strerror(errno));
+	close( fd);
+	unlinkat( snapshotDir, temporary, 0);
+	return;
+    }
+    close( fd);
+
+    if ( renameat( snapshotDir, temporary, snapshotDir, name) != 0) {
+	if ( snapshotErrors++ == 0) log_f("Failed to rename snapshot to %s: %s\n", name, strerror(errno));
+	unlinkat( snapshotDir, temporary, 0);
+	return;
+    }
+    snapshots++;
+}
+
+static void capture_snapshot( const struct chunk *c, void *arg)
+{
+    if ( !c[0].data) return;
+    // by count since the last one, so a slow disk doesn't make it sparser still
+    if ( lastSerial && current_frame_serial() - lastSerial < snapshot_every) return;
+    lastSerial = current_frame_serial();
+    with_jpeg_frame( write_snapshot, 0);
+}
+
+static void *snapshot_loop( void *arg)
+{
+    int last = 0;
+
+    for (;;) {
+	wait_for_frame( last);
+	last = frame_serial();
+	with_current_frame( capture_snapshot, 0);
+    }
+    return 0;
+}
+
+/*
+** The directory is opened now so snapshots carry on after a chroot.
+*/
+void start_snapshot(void)
+{
+    char path[256];
+    pthread_t thread;
+
+    if ( !snapshot_file) return;
+
+    if ( strlen( snapshot_file) >= sizeof(path) - 8) fatal_f("Snapshot file name too long: %s\n", snapshot_file);
+    strcpy( path, snapshot_file);
+    snapshotDir = open_recording_dir( dirname( path));
+    strcpy( path, snapshot_file);
+    snprintf( name, sizeof(name), "%s", basename( path));
+    snprintf( temporary, sizeof(temporary), ".%s.tmp", name);
+
+    add_metric( "snapshot_frames_total", "Frames written to the snapshot file.", &snapshots);
+    add_metric( "snapshot_errors_total", "Failed writes and renames of the snapshot file.", &snapshotErrors);
+
+    if ( pthread_create( &thread, 0, snapshot_loop, 0)) fatal_f("Failed to start snapshot thread.\n");
+    pthread_detach( thread);
+}
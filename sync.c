@@ -0,0 +1,242 @@
+/*
+** The last few frames of every camera with their driver timestamps, so that
+** /sync can hand out frames from several cameras taken at the same moment.
+** Fetching each camera's /image.jpg in turn would skew them by however long
+** the fetches took.
+**
+** Each capture thread copies its frames into its own ring as it publishes
+** them. Readers take no locks: every slot has a sequence number which is odd
+** while it is being written, and a reader checks the number didn't move
+** while it looked.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "tinycamd.h"
+
+struct sync_slot {
+    unsigned int seq;
+    int serial;
+    long long ms;
+    long long us;
+    unsigned int length;
+    unsigned char *data;
+};
+
+struct sync_ring {
+    unsigned int size;           // of each slot's data
+    unsigned int next;           // capture thread only
+    struct sync_slot slots[];    // sync_frames of them
+};
+
+static long syncRequests = 0;
+static long syncMisses = 0;
+static long syncTooBig = 0;
+
+/*
+** The frame being published by this thread's camera goes into its ring,
+** overwriting the oldest. Capture thread only.
+*/
+void sync_frame( const struct chunk *c, int serial, long long ms, long long us)
+{
+    struct sync_ring *r = this_camera()->sync;
+    struct sync_slot *s;
+    unsigned int len = 0, off;
+    int i;
+
+    for ( i = 0; c[i].data; i++) len += c[i].length;
+    if ( len == 0) return;
+    if ( len > r->size) {
+	__sync_add_and_fetch( &syncTooBig, 1);
+	return;
+    }
+
+    s = &r->slots[r->next++ % sync_frames];
+    __atomic_store_n( &s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_RELEASE);
+
+    for ( i = 0, off = 0; c[i].data; i++) {
+	memcpy( s->data + off, c[i].data, c[i].length);
+	off += c[i].length;
+    }
+    s->serial = serial;
+    s->ms = ms;
+    s->us = us;
+    s->length = len;
+
+    __atomic_store_n( &s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+** Must come before the capture threads start, they fill the rings. A slot
+** holds a raw YUYV frame, which no JPEG from the same camera outgrows, and
+** only the part of it a frame touches is ever paged in.
+*/
+void start_sync(void)
+{
+    struct camera *c;
+    int i;
+
+    if ( sync_frames <= 0) return;
+
+    for ( c = cameras; c; c = c->next) {
+	struct sync_ring *r = calloc( 1, sizeof(*r) + sync_frames * sizeof(struct sync_slot));
+
+	if ( !r) fatal_f("Out of memory\n");
+	r->size = c->width * c->height * 2 + 1024;   // and the DHT we may put in
+	for ( i = 0; i < sync_frames; i++) {
+	    r->slots[i].data = malloc( r->size);
+	    if ( !r->slots[i].data) fatal_f("Failed to allocate %u bytes for sync frames\n", r->size);
+	}
+	c->sync = r;
+    }
+
+    add_metric( "sync_requests_total", "Requests to /sync.", &syncRequests);
+    add_metric( "sync_misses_total", "Requests to /sync with no frames close enough together.", &syncMisses);
+    add_metric( "sync_oversize_frames_total", "Frames too big for a sync slot.", &syncTooBig);
+}
+
+/*
+** What a slot held when we looked, seq is zero if it was being written or
+** has never been.
+*/
+struct glance {
+    unsigned int seq;
+    int serial;
+    long long ms, us;
+    unsigned int length;
+};
+
+static void glance( struct sync_slot *s, struct glance *g)
+{
+    g->seq = __atomic_load_n( &s->seq, __ATOMIC_ACQUIRE);
+    g->serial = s->serial;
+    g->ms = s->ms;
+    g->us = s->us;
+    g->length = s->length;
+    __atomic_thread_fence( __ATOMIC_ACQUIRE);
+    if ( (g->seq & 1) || g->seq == 0 || __atomic_load_n( &s->seq, __ATOMIC_RELAXED) != g->seq) g->seq = 0;
+}
+
+/*
+** Each camera's frame closest to us, as an index into its row of glances,
+** -1 if a camera has none. Returns the spread from earliest to latest.
+*/
+static long long closest( struct glance *g, int n, long long us, int *pick)
+{
+    long long lo = LLONG_MAX, hi = LLONG_MIN;
+    int i, j;
+
+    for ( i = 0; i < n; i++) {
+	struct glance *row = g + i * sync_frames;
+
+	pick[i] = -1;
+	for ( j = 0; j < sync_frames; j++) {
+	    if ( !row[j].seq) continue;
+	    if ( pick[i] < 0 || llabs( row[j].us - us) < llabs( row[pick[i]].us - us)) pick[i] = j;
+	}
+	if ( pick[i] < 0) return LLONG_MAX;
+	if ( row[pick[i]].us < lo) lo = row[pick[i]].us;
+	if ( row[pick[i]].us > hi) hi = row[pick[i]].us;
+    }
+    return hi - lo;
+}
+
+/*
+** Turn a raw frame into what /image.jpg would serve for its camera, or 0
+** if it can't be.
+*/
+static struct image *serve_form( struct camera *c, struct image *raw)
+{
+    struct chunk ch[2] = { { .data = raw->data, .length = raw->length }, { 0 } };
+    struct camera *was = this_camera();
+    struct image *im = raw;
+
+    use_camera( c);
+    if ( c->method == CAMERA_METHOD_YUYV) {
+	unsigned char *yuyv = 0;
+	int w = c->width, h = c->height;
+
+	if ( c->transform) yuyv = transform_yuyv( raw->data, c->width, c->height, c->transform, &w, &h);
+	im = encode_yuyv( yuyv ? yuyv : raw->data, w, h, c->quality, 0);
+	free( yuyv);
+    } else if ( c->transform) {
+	im = transform_jpeg( ch, c->transform, 0);
+    }
+    use_camera( was);
+
+    if ( im != raw) release_image( raw);
+    return im;
+}
+
+/*
+** Pick one frame from each of the n cameras so that they were taken as
+** close together as can be, and no further apart than tolerance
+** microseconds. Of the moments that will do, the latest wins. Returns 1
+** with out[] filled in and *skew the spread, or 0 if there are none. An
+** image in out[] may be 0 if the frame was broken.
+*/
+int find_synced( struct camera **cams, int n, long long tolerance, struct synced *out, long long *skew)
+{
+    struct glance *g = malloc( n * sync_frames * sizeof(*g));
+    int *pick = malloc( n * sizeof(*pick));
+    int *best = malloc( n * sizeof(*best));
+    int attempt, found = 0, i, j;
+
+    if ( !g || !pick || !best) fatal_f("Out of memory\n");
+    __sync_add_and_fetch( &syncRequests, 1);
+
+    for ( attempt = 0; attempt < 4 && !found; attempt++) {
+	long long when = LLONG_MIN;
+
+	for ( i = 0; i < n; i++) {
+	    for ( j = 0; j < sync_frames; j++) glance( &cams[i]->sync->slots[j], &g[i * sync_frames + j]);
+	}
+
+	// every frame we have is a candidate moment
+	for ( i = 0; i < n * sync_frames; i++) {
+	    long long spread;
+
+	    if ( !g[i].seq || g[i].us <= when) continue;
+	    spread = closest( g, n, g[i].us, pick);
+	    if ( spread > tolerance) continue;
+	    when = g[i].us;
+	    *skew = spread;
+	    memcpy( best, pick, n * sizeof(*best));
+	}
+	if ( when == LLONG_MIN) break;
+
+	// copy them out, and start over if any were overwritten meanwhile
+	for ( i = 0; i < n; i++) {
+	    struct glance *k = &g[i * sync_frames + best[i]];
+	    struct sync_slot *s = &cams[i]->sync->slots[best[i]];
+
+	    out[i].camera = cams[i];
+	    out[i].serial = k->serial;
+	    out[i].ms = k->ms;
+	    out[i].us = k->us;
+	    out[i].im = new_image( k->length);
+	    memcpy( out[i].im->data, s->data, k->length);
+	    out[i].im->length = k->length;
+	}
+	__atomic_thread_fence( __ATOMIC_ACQUIRE);
+	for ( found = 1, i = 0; i < n; i++) {
+	    if ( __atomic_load_n( &cams[i]->sync->slots[best[i]].seq, __ATOMIC_RELAXED) != g[i * sync_frames + best[i]].seq) found = 0;
+	}
+	if ( !found) for ( i = 0; i < n; i++) release_image( out[i].im);
+    }
+
+    free( best);
+    free( pick);
+    free( g);
+
+    if ( !found) {
+	__sync_add_and_fetch( &syncMisses, 1);
+	return 0;
+    }
+    for ( i = 0; i < n; i++) out[i].im = serve_form( out[i].camera, out[i].im);
+    return 1;
+}
@@ -0,0 +1,43 @@
+/*
+** The unix socket protocol tinycamd serves with --dmabuf-socket PATH, for a
+** local process to see frames in the capture buffers themselves, as dma-bufs,
+** without tinycamd copying them. This header is all a consumer needs.
+**
+** Connect a SOCK_SEQPACKET socket and send the name of the camera you want,
+** or an empty message for the first. Back comes a struct tcdmabuf_hello
+** with one dma-buf fd per capture buffer attached (SCM_RIGHTS). mmap() them
+** read only. Then for each new frame a struct tcdmabuf_frame arrives, saying
+** which buffer it is in. The buffer is yours until you send back a one byte
+** message, after which the driver may fill it again, so answer quickly: a
+** client that takes longer than a second is dropped. At most eight clients
+** are served at once, more are hung up on. Frames are as the
+** camera made them, an MJPEG frame may have no Huffman tables.
+*/
+#ifndef TCDMABUF_IS_IN
+#define TCDMABUF_IS_IN
+
+#include <stdint.h>
+
+#define TCDMABUF_MAGIC   0x42444354   // "TCDB"
+#define TCDMABUF_VERSION 1
+#define TCDMABUF_MAX_BUFFERS 32
+
+struct tcdmabuf_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t buffers;              // fds attached, in buffer order
+    uint32_t width, height;
+    uint32_t pixelformat;          // V4L2 fourcc, MJPG, JPEG or YUYV
+    uint32_t length[TCDMABUF_MAX_BUFFERS];   // of each buffer
+};
+
+struct tcdmabuf_frame {
+    uint32_t buffer;               // index into the hello's fds
+    uint32_t offset;               // where the frame starts in the buffer
+    uint32_t length;
+    uint32_t pad;
+    uint64_t serial;               // tinycamd's frame serial
+    int64_t ms;                    // capture time, ms since the epoch
+};
+
+#endif
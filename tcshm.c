@@ -0,0 +1,148 @@
+/*
+** The client side of the shared memory frame ring, see tcshm.h. This is
+** built into libtcshm.a for consumers and is not part of tinycamd itself.
+*/
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "tcshm.h"
+
+struct tcshm {
+    const struct tcshm_header *h;
+    size_t size;
+};
+
+struct tcshm *tcshm_open( const char *name)
+{
+    struct tcshm *s;
+    struct stat st;
+    void *map;
+    int fd = shm_open( name, O_RDONLY, 0);
+
+    if ( fd < 0) return 0;
+    if ( fstat( fd, &st) != 0 || st.st_size < sizeof(struct tcshm_header)) {
+	close( fd);
+	errno = EINVAL;
+	return 0;
+    }
+    map = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close( fd);
+    if ( map == MAP_FAILED) return 0;
+
+    s = calloc( 1, sizeof(*s));
+    if ( !s) {
+	munmap( map, st.st_size);
+	return 0;
+    }
+    s->h = map;
+    s->size = st.st_size;
+
+    if ( s->h->magic != TCSHM_MAGIC || s->h->version != TCSHM_VERSION ||
+	 s->h->dataOffset + (uint64_t)s->h->slots * s->h->slotSize > s->size) {
+	tcshm_close( s);
+	errno = EINVAL;
+	return 0;
+    }
+    return s;
+}
+
+void tcshm_close( struct tcshm *s)
+{
+    if ( !s) return;
+    munmap( (void *)s->h, s->size);
+    free( s);
+}
+
+uint64_t tcshm_wait( struct tcshm *s, uint64_t after, int timeout_ms)
+{
+    struct timespec end, now, left;
+    uint64_t latest;
+
+    clock_gettime( CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if ( end.tv_nsec >= 1000000000L) {
+	end.tv_sec++;
+	end.tv_nsec -= 1000000000L;
+    }
+
+    for (;;) {
+	uint32_t word = __atomic_load_n( &s->h->futex, __ATOMIC_ACQUIRE);
+
+	latest = __atomic_load_n( &s->h->latest, __ATOMIC_ACQUIRE);
+	if ( latest > after) return latest;
+
+	clock_gettime( CLOCK_MONOTONIC, &now);
+	left.tv_sec = end.tv_sec - now.tv_sec;
+	left.tv_nsec = end.tv_nsec - now.tv_nsec;
+	if ( left.tv_nsec < 0) {
+	    left.tv_sec--;
+	    left.tv_nsec += 1000000000L;
+	}
+	if ( left.tv_sec < 0) return latest;
+
+	// the ring is mapped read only, but FUTEX_WAIT only reads
+	syscall( SYS_futex, &s->h->futex, FUTEX_WAIT, word, &left, 0, 0);
+    }
+}
+
+static const struct tcshm_slot *find_slot( struct tcshm *s, uint64_t serial, uint32_t format, uint32_t *seq)
+{
+    uint32_t i;
+
+    for ( i = 0; i < s->h->slots; i++) {
+	const struct tcshm_slot *t = &s->h->slot[i];
+
+	*seq = __atomic_load_n( &t->seq, __ATOMIC_ACQUIRE);
+	if ( (*seq & 1) == 0 && t->serial == serial && t->format == format) return t;
+    }
+    return 0;
+}
+
+const void *tcshm_peek( struct tcshm *s, uint64_t serial, uint32_t format, struct tcshm_frame *f, uint32_t *token)
+{
+    const struct tcshm_slot *t = find_slot( s, serial, format, token);
+
+    if ( !t || t->length > s->h->slotSize) return 0;
+    f->serial = t->serial;
+    f->ms = t->ms;
+    f->format = t->format;
+    f->length = t->length;
+    f->width = t->width;
+    f->height = t->height;
+    return (const char *)s->h + s->h->dataOffset + (t - s->h->slot) * (uint64_t)s->h->slotSize;
+}
+
+int tcshm_still_valid( struct tcshm *s, uint64_t serial, uint32_t format, uint32_t token)
+{
+    uint32_t i;
+
+    __atomic_thread_fence( __ATOMIC_ACQUIRE);
+    for ( i = 0; i < s->h->slots; i++) {
+	const struct tcshm_slot *t = &s->h->slot[i];
+
+	if ( t->serial == serial && t->format == format) return __atomic_load_n( &t->seq, __ATOMIC_RELAXED) == token;
+    }
+    return 0;
+}
+
+int tcshm_read( struct tcshm *s, uint64_t serial, uint32_t format, void *buf, size_t size, struct tcshm_frame *f)
+{
+    uint32_t token;
+    const void *data = tcshm_peek( s, serial, format, f, &token);
+
+    if ( !data) return 0;
+    if ( f->length > size) return -1;
+    memcpy( buf, data, f->length);
+    return tcshm_still_valid( s, serial, format, token) ? f->length : 0;
+}
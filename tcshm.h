@@ -0,0 +1,79 @@
+/*
+** The shared memory frame ring tinycamd publishes with --shm NAME, and a
+** small client library for reading it, libtcshm.a. This header is all a
+** consumer needs:
+**
+**     struct tcshm *s = tcshm_open("/tinycamd");
+**     struct tcshm_frame f;
+**     unsigned long long serial = 0;
+**
+**     for (;;) {
+**         serial = tcshm_wait( s, serial, 1000);
+**         if ( tcshm_read( s, serial, TCSHM_JPEG, buf, sizeof(buf), &f) > 0) use( buf, &f);
+**     }
+**
+** The ring is a header, an array of slot descriptors, then the slots' data,
+** each slot starting on a page. tinycamd writes each frame into the oldest
+** slot under a sequence number, which is odd while the slot is being
+** written, then bumps futex and wakes anyone waiting on it. Readers never
+** write to the ring, so any number of them can't slow tinycamd down; one
+** that falls more than a few frames behind just finds its frame gone.
+*/
+#ifndef TCSHM_IS_IN
+#define TCSHM_IS_IN
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TCSHM_MAGIC   0x4d484354   // "TCHM"
+#define TCSHM_VERSION 1
+
+#define TCSHM_JPEG 1
+#define TCSHM_YUYV 2               // only with --shm-yuyv and a YUYV camera
+
+struct tcshm_slot {
+    uint32_t seq;                  // odd while being written
+    uint32_t format;
+    uint64_t serial;               // tinycamd's frame serial
+    int64_t ms;                    // capture time, ms since the epoch
+    uint32_t length;
+    uint32_t width, height;
+    uint32_t pad;
+};
+
+struct tcshm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotSize;             // bytes of data room in each slot
+    uint64_t dataOffset;           // where slot 0's data starts
+    uint64_t latest;               // serial of the newest whole frame
+    uint32_t futex;                // low 32 bits of latest, for FUTEX_WAIT
+    uint32_t pad;
+    struct tcshm_slot slot[];
+};
+
+struct tcshm;
+
+struct tcshm_frame {
+    uint64_t serial;
+    int64_t ms;
+    uint32_t format;
+    uint32_t length;
+    uint32_t width, height;
+};
+
+struct tcshm *tcshm_open( const char *name);           // 0 and errno if it can't
+void tcshm_close( struct tcshm *s);
+
+// Wait up to timeout_ms for a frame newer than after, returns the latest serial.
+uint64_t tcshm_wait( struct tcshm *s, uint64_t after, int timeout_ms);
+
+// Copy out a frame. Returns its length, 0 if it isn't there (any more), -1 if it won't fit.
+int tcshm_read( struct tcshm *s, uint64_t serial, uint32_t format, void *buf, size_t size, struct tcshm_frame *f);
+
+// Look at a frame in place. The data is only good if tcshm_still_valid() says so afterward.
+const void *tcshm_peek( struct tcshm *s, uint64_t serial, uint32_t format, struct tcshm_frame *f, uint32_t *token);
+int tcshm_still_valid( struct tcshm *s, uint64_t serial, uint32_t format, uint32_t token);
+
+#endif
@@ -10,14 +10,12 @@
 #include <sys/wait.h>
 #include <stdio.h>
 #include <errno.h>
-#include <jpeglib.h>
 #include <pwd.h>
+#include <sys/stat.h>
 
 #include "tinycamd.h"
 #include "httpd.h"
 
-#define MAXFRAME 60
-
 extern char setup_html[];
 extern int setup_html_size;
 extern char tinycamd_js[];
@@ -35,153 +33,676 @@ static void do_status_request( HTTPD_Request req)
   HTTPD_Send_Body(req, status,strlen(status));
 }
 
-#if 0
-static void put_image(const struct chunk *c, void *arg)
+static void put_single_image(const struct chunk *c, void *arg)
 {
   HTTPD_Request req = (HTTPD_Request)arg;
+  unsigned char *buffer, *b;
   int i,s=0;
 
+  HTTPD_Add_Header(req, "Cache-Control: no-cache");
+  HTTPD_Add_Header(req, "Pragma: no-cache");
+  HTTPD_Add_Header(req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
+  HTTPD_Add_Header(req, "Content-type: image/jpeg");
+
   for ( i = 0; c[i].data != 0; i++) s += c[i].length;
+  buffer = malloc( s);
+  if ( !buffer) fatal_f("Out of memory\n");
+  for ( i = 0, b = buffer; c[i].data != 0; i++) {
+      memcpy( b, c[i].data, c[i].length);
+      b += c[i].length;
+  }
+  HTTPD_Send_Body( req, buffer, s);
+  free(buffer);
+
+  log_f("image size = %d\n",s);
+}
+
+/*
+** Find NAME= in the query string of url and return what follows it.
+*/
+static const char *query_value( const char *url, const char *name)
+{
+    const char *q = strchr( url, '?');
+    int len = strlen(name);
 
-    FCGX_FPrintF(req->out, 
-		 "Content-type: image/jpeg\r\n"
-		 "Content-length: %d\r\n"
-		 "\r\n", s);
-    for ( i = 0; c[i].data != 0; i++) {
-	FCGX_PutStr( c[i].data, c[i].length, req->out);
+    while ( q) {
+	q++;
+	if ( strncmp( q, name, len) == 0 && q[len] == '=') return q+len+1;
+	q = strchr( q, '&');
     }
-    fprintf(stderr,"image size = %d\n",s);
+    return 0;
 }
-#endif
 
-static void put_single_image(const struct chunk *c, void *arg)
+static int query_int( const char *url, const char *name, int *val)
 {
-  HTTPD_Request req = (HTTPD_Request)arg;
-  int i,s=0;
+    const char *v = query_value( url, name);
 
-  HTTPD_Add_Header(req, "Cache-Control: no-cache");
-  HTTPD_Add_Header(req, "Pragma: no-cache");
-  HTTPD_Add_Header(req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
-  HTTPD_Add_Header(req, "Content-type: image/jpeg");
+    return v && sscanf( v, "%d", val) == 1;
+}
 
-  switch(camera_method) {
-    case CAMERA_METHOD_MJPEG:
-    case CAMERA_METHOD_JPEG:
-	{
-	    unsigned char *buffer, *b;
-	    for ( i = 0; c[i].data != 0; i++) s += c[i].length;
-	    buffer = malloc( s);
-	    for ( i = 0, b = buffer; c[i].data != 0; i++) {
-		memcpy( b, c[i].data, c[i].length);
-		b += c[i].length;
-	    }
-	    HTTPD_Send_Body( req, buffer, s);
-	    free(buffer);
+/*
+** What a request wants done to the frame. Zeros mean leave it alone.
+*/
+struct recipe {
+    struct view *view;
+    int denom;
+    int quality;
+    int flags;
+};
+
+/*
+** The frame as we serve it, which is rotated and flipped if we were asked.
+** MJPEG and JPEG are transformed in the DCT domain and stay JPEG, YUYV is
+** rearranged but left raw for the encoder. Either way it is done once per
+** frame and everything else works from it.
+*/
+static struct image *make_base( const struct chunk *c, void *arg)
+{
+    struct camera *cam = this_camera();
+    unsigned char *yuyv;
+    int w, h;
+
+    if ( cam->method != CAMERA_METHOD_YUYV) return transform_jpeg( c, cam->transform, 0);
+    if ( !c[0].data) return 0;   // no frame yet
+
+    yuyv = transform_yuyv( c[0].data, cam->width, cam->height, cam->transform, &w, &h);
+    return adopt_image( yuyv, w*h*2);
+}
+
+static int with_base_frame( frame_sender func, void *arg)
+{
+    if ( !this_camera()->transform) {
+	with_current_frame( func, arg);
+	return 1;
+    }
+    return with_derived_image( "base", make_base, 0, func, arg);
+}
+
+static void base_size( int *w, int *h)
+{
+    struct camera *cam = this_camera();
+
+    if ( cam->transform & TRANSFORM_TRANSPOSE) {
+	*w = cam->height & ~1;
+	*h = cam->width;
+    } else {
+	*w = cam->width;
+	*h = cam->height;
+    }
+}
+
+/*
+** Views are cut from the base frame, losslessly for JPEG. Like the base
+** frame, a view is made once per frame however many people watch it.
+*/
+static void view_size( struct view *v, int *w, int *h)
+{
+    int x = v->x & ~1;
+    int bw, bh;
+
+    base_size( &bw, &bh);
+    *w = ( x + v->width > bw) ? bw - x : v->width;
+    *h = ( v->y + v->height > bh) ? bh - v->y : v->height;
+    *w &= ~1;
+}
+
+struct cutting {
+    struct view *v;
+    struct image *im;
+};
+
+static void cut_view( const struct chunk *c, void *arg)
+{
+    struct cutting *k = (struct cutting *)arg;
+    struct view *v = k->v;
+
+    if ( this_camera()->method == CAMERA_METHOD_YUYV) {
+	unsigned char *yuyv;
+	int bw, bh, w, h;
+
+	if ( !c[0].data) return;
+	base_size( &bw, &bh);
+	yuyv = crop_yuyv( c[0].data, bw, bh, v->x, v->y, v->width, v->height, &w, &h);
+	if ( yuyv) k->im = adopt_image( yuyv, w*h*2);
+    } else {
+	k->im = crop_jpeg( c, v->x, v->y, v->width, v->height, 0);
+    }
+}
+
+static struct image *make_view( const struct chunk *c, void *arg)
+{
+    struct cutting k = { .v = (struct view *)arg };
+
+    with_base_frame( cut_view, &k);
+    return k.im;
+}
+
+static int with_source_frame( struct view *v, frame_sender func, void *arg)
+{
+    char key[96];
+
+    if ( !v) return with_base_frame( func, arg);
+    snprintf( key, sizeof(key), "view=%s", v->name);
+    return with_derived_image( key, make_view, v, func, arg);
+}
+
+struct cooking {
+    struct recipe *r;
+    struct image *im;
+};
+
+static void cook_image( const struct chunk *c, void *arg)
+{
+    struct cooking *k = (struct cooking *)arg;
+    struct recipe *r = k->r;
+    int q = r->quality ? r->quality : this_camera()->quality;
+    int w, h;
+
+    if ( this_camera()->method == CAMERA_METHOD_YUYV) {
+	if ( !c[0].data) return;   // no frame yet
+	if ( r->view) view_size( r->view, &w, &h);
+	else base_size( &w, &h);
+	if ( r->denom) {
+	    unsigned char *small;
+
+	    small = scale_yuyv( c[0].data, w, h, r->denom, &w, &h);
+	    if ( !small) return;
+	    k->im = encode_yuyv( small, w, h, q, r->flags);
+	    free( small);
+	} else {
+	    k->im = encode_yuyv( c[0].data, w, h, q, r->flags);
 	}
-      break;
-    case CAMERA_METHOD_YUYV:
-	{
-	    unsigned char *jpegBuffer;
-	    unsigned int jpegLeft = 1024*1024;
-	    unsigned int jpegSize = 0;
-	    struct jpeg_compress_struct cinfo = { .dest = 0};
-	    struct jpeg_destination_mgr dmgr;
-	    struct jpeg_error_mgr err;
-
-	    jpegBuffer = malloc(jpegLeft);
-	    if ( !jpegBuffer) fatal_f("Failed to allocate JPEG encoding buffer.\n");
-
-	    void init_destination(j_compress_ptr cinfo) {
-		struct jpeg_destination_mgr *d = cinfo->dest;
-		d->next_output_byte = jpegBuffer;
-		d->free_in_buffer = jpegLeft;
-	    }
-	    int empty_output_buffer(j_compress_ptr cinfo) {
-		//struct jpeg_destination_mgr *d = cinfo->dest;
-		log_f("eob\n");
-		return  TRUE;
-	    }
-	    void term_destination(j_compress_ptr cinfo) {
-		struct jpeg_destination_mgr *d = cinfo->dest;
-		log_f("termdest\n");
-		jpegSize = d->next_output_byte - jpegBuffer;
-	    }
-	    dmgr.init_destination = init_destination;
-	    dmgr.empty_output_buffer = empty_output_buffer;
-	    dmgr.term_destination = term_destination;
-
-	    cinfo.err = jpeg_std_error(&err);
-	    jpeg_create_compress(&cinfo);
-	    cinfo.image_width = video_width;
-	    cinfo.image_height = video_height;
-	    if ( mono) {
-		cinfo.input_components = 1;
-		cinfo.in_color_space = JCS_GRAYSCALE;
-	    } else {
-		cinfo.input_components = 3;
-		cinfo.in_color_space = JCS_YCbCr;
+    } else if ( r->denom) {
+	k->im = scale_jpeg( c, r->denom, q, r->flags);
+    } else if ( r->quality) {
+	k->im = requantize_jpeg( c, q, r->flags);
+    } else {
+	k->im = recode_jpeg( c, r->flags);
+    }
+}
+
+static struct image *make_image( const struct chunk *c, void *arg)
+{
+    struct cooking k = { .r = (struct recipe *)arg };
+
+    with_source_frame( k.r->view, cook_image, &k);
+    return k.im;
+}
+
+/*
+** Send func the image the recipe describes. With nothing to do to an MJPEG
+** frame it goes out as it came, otherwise it is made once per frame.
+*/
+static int with_recipe_image( struct recipe *r, frame_sender func, void *arg)
+{
+    struct camera *cam = this_camera();
+    char key[128];             // room for a 63 character view and every number
+
+    if ( !r->denom && !r->quality && !r->flags && cam->method != CAMERA_METHOD_YUYV) {
+	return with_source_frame( r->view, func, arg);
+    }
+
+    // the YUYV encode is done at the default quality if none was asked for
+    if ( cam->method == CAMERA_METHOD_YUYV && !r->quality) r->quality = cam->quality;
+
+    snprintf( key, sizeof(key), "%s,s=%d,q=%d,f=%d", r->view ? r->view->name : "", r->denom, r->quality, r->flags);
+    return with_derived_image( key, make_image, r, func, arg);
+}
+
+/*
+** The current frame as a plain /image.jpg would get it.
+*/
+int with_jpeg_frame( frame_sender func, void *arg)
+{
+    struct recipe r = { 0 };
+
+    return with_recipe_image( &r, func, arg);
+}
+
+static void release_image_cleanup( void *arg)
+{
+    if ( arg) release_image( (struct image *)arg);
+}
+
+/*
+** Send im and let go of it, also if the watchdog cancels us meanwhile.
+*/
+static void send_image_data( HTTPD_Request req, struct image *im)
+{
+    struct chunk c[2] = { { .data = im->data, .length = im->length }, { 0 } };
+
+    pthread_cleanup_push( release_image_cleanup, im);
+    put_single_image( c, req);
+    pthread_cleanup_pop( 1);
+}
+
+/*
+** /image.jpg?serial=N and ?at=ms come out of the history ring instead.
+*/
+static int send_history_image( HTTPD_Request req, const char *url)
+{
+    const char *at = query_value( url, "at");
+    struct image *im;
+    long long ms;
+    int serial;
+
+    if ( query_int( url, "serial", &serial)) im = history_by_serial( serial);
+    else if ( at && sscanf( at, "%lld", &ms) == 1) im = history_at( ms, 0);
+    else return 0;
+
+    if ( im) {
+	send_image_data( req, im);
+    } else {
+	HTTPD_Send_Status( req, 404, "Not Found");
+	HTTPD_Send_Body( req, "404 - Not in history", 20);
+    }
+    return 1;
+}
+
+/*
+** Fill in a recipe from quality=, optimize=, progressive= and scale=. Sends
+** a 400 and returns 0 if they make no sense.
+*/
+static int parse_recipe( HTTPD_Request req, const char *url, struct recipe *r)
+{
+    const char *scale = query_value( url, "scale");
+    int v;
+
+    if ( query_int( url, "quality", &v) && v >= 1 && v <= 100) r->quality = v;
+    if ( query_int( url, "optimize", &v) && v) r->flags |= JPEG_OPTIMIZE;
+    if ( query_int( url, "progressive", &v) && v) r->flags |= JPEG_PROGRESSIVE;
+
+    if ( scale) {
+	if ( sscanf( scale, "1/%d", &r->denom) != 1 && sscanf( scale, "1%%2F%d", &r->denom) != 1) r->denom = 0;
+	if ( r->denom != 2 && r->denom != 4 && r->denom != 8) {
+	    HTTPD_Send_Status( req, 400, "Bad Request");
+	    HTTPD_Send_Body( req, "400 - scale must be 1/2, 1/4 or 1/8", 35);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static void send_image( HTTPD_Request req, const char *url, struct view *view)
+{
+    struct recipe r = { .view = view };
+    int ok, fresh = 0, i;
+    long long down;
+    char header[64];
+
+    // history is only kept for the first camera
+    if ( !view && this_camera() == cameras && send_history_image( req, url)) return;
+    if ( !parse_recipe( req, url, &r)) return;
+
+    // fresh=1 waits a few seconds at most for a frame taken after we were asked,
+    // rather than the last one a stopped camera took
+    if ( query_int( url, "fresh", &fresh) && fresh) {
+	int s = frame_serial();
+
+	for ( i = 0; i < 10 && !wait_for_frame_timeout( s, 500); i++) ;
+    }
+
+    // a camera being reopened still has its last frame, say it is stale
+    if ( (down = camera_down_ms()) && frame_serial()) {
+	snprintf( header, sizeof(header), "X-Camera-Down-Ms: %lld", down);
+	HTTPD_Add_Header( req, "Warning: 110 tinycamd \"Response is Stale\"");
+	HTTPD_Add_Header( req, header);
+    }
+
+    ok = with_recipe_image( &r, &put_single_image, req);
+
+    if ( !ok) {
+	HTTPD_Send_Status( req, 503, "Service Unavailable");
+	HTTPD_Send_Body( req, "503 - No image", 14);
+    }
+}
+
+/*
+** Play back a stretch of the history ring as a multipart stream, at the pace
+** it was captured. Long gaps, like a stalled camera, are cut to a second.
+*/
+static void stream_history( HTTPD_Request req, const char *url)
+{
+    long long from = 0, to = 0x7fffffffffffffffLL, ms = 0, last = 0;
+    const char *v;
+    struct image *im;
+    char part[128];
+
+    if ( (v = query_value( url, "from"))) sscanf( v, "%lld", &from);
+    if ( (v = query_value( url, "to"))) sscanf( v, "%lld", &to);
+
+    im = history_at( from, &ms);
+    if ( im && ms < from) {
+	release_image( im);
+	im = history_after( from, &ms);
+    }
+    if ( !im || ms > to) {
+	if ( im) release_image( im);
+	HTTPD_Send_Status( req, 404, "Not Found");
+	HTTPD_Send_Body( req, "404 - Not in history", 20);
+	return;
+    }
+
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Pragma: no-cache");
+    HTTPD_Add_Header( req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
+    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=tinycamd");
+
+    while ( im && ms <= to) {
+	int ok;
+
+	if ( last && ms > last) usleep( ( ms - last > 1000 ? 1000 : ms - last) * 1000);
+	last = ms;
+
+	snprintf( part, sizeof(part), "--tinycamd\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", im->length);
+	ok = HTTPD_Send_Body_Chunk( req, part, strlen(part)) &&
+	     HTTPD_Send_Body_Chunk( req, im->data, im->length) &&
+	     HTTPD_Send_Body_Chunk( req, "\r\n", 2);
+	release_image( im);
+	if ( !ok) return;
+	HTTPD_Push( req);
+
+	im = history_after( last, &ms);
+    }
+    if ( im) release_image( im);
+    HTTPD_Send_Body_Chunk( req, "--tinycamd--\r\n", 14);
+}
+
+static long streamFrames = 0;
+static long streamSkipped = 0;
+
+/*
+** Copy a frame out, so a slow client doesn't keep the capture buffer.
+*/
+void copy_frame( const struct chunk *c, void *arg)
+{
+    struct image **im = (struct image **)arg;
+    unsigned int len = 0;
+    int i;
+
+    for ( i = 0; c[i].data; i++) len += c[i].length;
+    if ( len == 0) return;
+    *im = new_image( len);
+    for ( i = 0; c[i].data; i++) {
+	memcpy( (*im)->data + (*im)->length, c[i].data, c[i].length);
+	(*im)->length += c[i].length;
+    }
+}
+
+/*
+** A live multipart stream of /image.jpg, or of a view, taking the same
+** query parameters. With changes=1 a frame is only sent if it looks
+** different from the last one this client was sent, or if keepalive=
+** seconds (default 10) have gone by. Threshold= is how much, out of 255,
+** some part of the picture has to change (default 6).
+*/
+static void stream_images( HTTPD_Request req, const char *url, struct view *view)
+{
+    struct recipe r = { .view = view };
+    unsigned char sig[SIGNATURE_SIZE], sent[SIGNATURE_SIZE];
+    int changes = 0, keepalive = 10, threshold = 6, last = 0, haveSent = 0;
+    long long lastSent = 0;
+    char part[128];
+
+    if ( !parse_recipe( req, url, &r)) return;
+    query_int( url, "changes", &changes);
+    if ( this_camera() != cameras) changes = 0;   // motion only watches the first camera
+    query_int( url, "keepalive", &keepalive);
+    query_int( url, "threshold", &threshold);
+
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Pragma: no-cache");
+    HTTPD_Add_Header( req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
+    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=tinycamd");
+
+    for (;;) {
+	struct image *im = 0;
+	struct timespec now;
+	long long ms;
+	int ok, i;
+
+	clock_gettime( CLOCK_MONOTONIC, &now);
+	ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+
+	if ( changes) {
+	    int s = wait_for_signature( last, sig, 5);
+
+	    if ( s == 0) {
+		HTTPD_Push( req);   // nothing coming, but hold off the watchdog
+		continue;
 	    }
-	    jpeg_set_defaults(&cinfo);
-	    jpeg_set_quality(&cinfo, quality, TRUE);
-	    cinfo.dest = &dmgr;
-
-	    jpeg_start_compress( &cinfo, TRUE);
-	    {
-		const unsigned char *b = c[0].data;
-		int row = 0;
-		int col = 0;
-		JSAMPLE pix[video_width*3];
-		JSAMPROW rows[] = { pix};
-		JSAMPARRAY scanlines = rows;
-
-		for ( row = 0; row < video_height; row++) {
-		    JSAMPLE *p = pix;
-		    for ( col = 0; col < video_width; col+=2) {
-			*p++ = b[0];
-			if ( !mono) {
-			    *p++ = b[1];
-			    *p++ = b[3];
-			}
-			*p++ = b[2];
-			if ( !mono) {
-			    *p++ = b[1];
-			    *p++ = b[3];
-			}
-			b += 4;
-		    }
-		    jpeg_write_scanlines( &cinfo, scanlines, 1);
-		}
+	    last = s;
+	    for ( i = 0; haveSent && i < SIGNATURE_SIZE && abs( sig[i] - sent[i]) < threshold; i++) ;
+	    if ( haveSent && i == SIGNATURE_SIZE && ms - lastSent < keepalive * 1000LL) {
+		streamSkipped++;
+		HTTPD_Push( req);
+		continue;
 	    }
-	    jpeg_finish_compress( &cinfo);
+	} else {
+	    wait_for_frame( last);
+	    last = frame_serial();
+	}
 
-	    HTTPD_Send_Body( req, jpegBuffer, jpegSize);
-	    free(jpegBuffer);
+	if ( !with_recipe_image( &r, copy_frame, &im) || !im) continue;
+
+	pthread_cleanup_push( release_image_cleanup, im);
+	snprintf( part, sizeof(part), "--tinycamd\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", im->length);
+	ok = HTTPD_Send_Body_Chunk( req, part, strlen(part)) &&
+	     HTTPD_Send_Body_Chunk( req, im->data, im->length) &&
+	     HTTPD_Send_Body_Chunk( req, "\r\n", 2);
+	pthread_cleanup_pop( 1);
+	if ( !ok) return;
+	HTTPD_Push( req);
+
+	streamFrames++;
+	lastSent = ms;
+	if ( changes) {
+	    memcpy( sent, sig, sizeof(sent));
+	    haveSent = 1;
 	}
-      break;
-  }
+    }
+}
 
-  log_f("image size = %d\n",s);
+/*
+** /mosaic.jpg and /mosaic.mjpeg, every camera in one picture. The stream
+** gets a mosaic a tick, the same one everybody else watching gets.
+*/
+static void send_mosaic( HTTPD_Request req)
+{
+    int serial;
+    struct image *im = mosaic_image( 0, &serial);
+
+    if ( im) {
+	send_image_data( req, im);
+    } else {
+	HTTPD_Send_Status( req, 503, "Service Unavailable");
+	HTTPD_Send_Body( req, "503 - No image", 14);
+    }
 }
 
-#if 0
-static void stream_image( HTTPD_Request req)
+static void stream_mosaic( HTTPD_Request req)
 {
-    int i;
-    const char *boundary = "--myboundary\r\n";
+    int last = 0;
+    char part[128];
 
     HTTPD_Add_Header( req, "Cache-Control: no-cache");
     HTTPD_Add_Header( req, "Pragma: no-cache");
     HTTPD_Add_Header( req, "Expires: Thu, 01 Dec 1994 16:00:00 GMT");
-    HTTPD_Add_Header( req, "Content-Type: text/xml");
-    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=--myboundary");
+    HTTPD_Add_Header( req, "Content-Type: multipart/x-mixed-replace; boundary=tinycamd");
+
+    for (;;) {
+	struct image *im = mosaic_image( last, &last);
+	int ok;
+
+	if ( !im) {
+	    HTTPD_Push( req);
+	    continue;
+	}
+
+	pthread_cleanup_push( release_image_cleanup, im);
+	snprintf( part, sizeof(part), "--tinycamd\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", im->length);
+	ok = HTTPD_Send_Body_Chunk( req, part, strlen(part)) &&
+	     HTTPD_Send_Body_Chunk( req, im->data, im->length) &&
+	     HTTPD_Send_Body_Chunk( req, "\r\n", 2);
+	pthread_cleanup_pop( 1);
+	if ( !ok) return;
+	HTTPD_Push( req);
+    }
+}
+
+/*
+** /sync?cams=A,B&tolerance=MS, a frame from each camera, or those named,
+** all taken within tolerance of each other, default half a frame of the
+** first camera. They come as one multipart/mixed response, each part
+** saying whose frame it is and when it was taken.
+*/
+static void send_sync( HTTPD_Request req, const char *url)
+{
+    const char *names = query_value( url, "cams");
+    int count = 0, n = 0, size = 64, len = 0, tolerance, i;
+    struct camera **cams, *c;
+    struct synced *got;
+    char header[64];
+    long long skew;
+    char *b;
+
+    for ( c = cameras; c; c = c->next) count++;
+    cams = calloc( count, sizeof(*cams));
+    got = calloc( count, sizeof(*got));
+    if ( !cams || !got) fatal_f("Out of memory\n");
+
+    if ( !names) {
+	for ( c = cameras; c; c = c->next) cams[n++] = c;
+    } else {
+	while ( *names && *names != '&' && n < count) {
+	    int l = strcspn( names, ",&");
+
+	    if ( !(c = find_camera( names, l))) {
+		free( got);
+		free( cams);
+		HTTPD_Send_Status( req, 404, "Not Found");
+		HTTPD_Send_Body( req, "404 - No such camera", 20);
+		return;
+	    }
+	    cams[n++] = c;
+	    names += l;
+	    if ( *names == ',') names++;
+	}
+    }
+
+    tolerance = 500 / ( cameras->fps > 0 ? cameras->fps : 1);
+    query_int( url, "tolerance", &tolerance);
+
+    if ( n == 0 || !find_synced( cams, n, tolerance * 1000LL, got, &skew)) {
+	free( got);
+	free( cams);
+	HTTPD_Send_Status( req, 503, "Service Unavailable");
+	HTTPD_Send_Body( req, "503 - No frames close enough together", 37);
+	return;
+    }
+
+    // part headers are short but for the camera name, which can be any length
+    for ( i = 0; i < n; i++) size += 256 + strlen( got[i].camera->name) + ( got[i].im ? got[i].im->length : 0);
+    b = malloc( size);
+    if ( !b) fatal_f("Out of memory\n");
+    for ( i = 0; i < n; i++) {
+	struct image *im = got[i].im;
+
+	if ( !im) continue;
+	len += snprintf( b+len, size-len, "--tinycamd\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n"
+			 "X-Camera: %s\r\nX-Serial: %d\r\nX-Timestamp: %lld\r\nX-Timestamp-Us: %lld\r\n\r\n",
+			 im->length, got[i].camera->name, got[i].serial, got[i].ms, got[i].us);
+	memcpy( b+len, im->data, im->length);
+	len += im->length;
+	len += snprintf( b+len, size-len, "\r\n");
+	release_image( im);
+    }
+    len += snprintf( b+len, size-len, "--tinycamd--\r\n");
+    free( got);
+    free( cams);
+
+    pthread_cleanup_push( free, b);
+    snprintf( header, sizeof(header), "X-Sync-Skew-Us: %lld", skew);
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Content-Type: multipart/mixed; boundary=tinycamd");
+    HTTPD_Add_Header( req, header);
+    HTTPD_Send_Body( req, b, len);
+    pthread_cleanup_pop( 1);
+}
 
-    for(i = 0; i < MAXFRAME; i++) {
-      HTTPD_Send_Body_Chunk( req, boundary, sizeof(boundary)-1);
-      with_next_frame( &put_image, req);
-      HTTPD_Push(req);
+/*
+** /motion?after=SERIAL waits for a newer result, add moving=1 to wait for
+** one that is actually motion. Either way it gives up after a few seconds,
+** so the watchdog doesn't, and returns whatever is latest.
+*/
+static void send_motion( HTTPD_Request req, const char *url)
+{
+    const int size = 65536;   // a 1080p mask is about 8k
+    int after = 0, moving = 0, len;
+    char *b = malloc( size);
+
+    if ( !b) fatal_f("Out of memory\n");
+    query_int( url, "after", &after);
+    query_int( url, "moving", &moving);
+
+    pthread_cleanup_push( free, b);
+    len = motion_json( b, size, after, moving, query_value( url, "after") ? 8 : 0);
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Content-Type: application/json");
+    HTTPD_Send_Body( req, b, len);
+    pthread_cleanup_pop( 1);
+}
+
+static void send_events( HTTPD_Request req)
+{
+    const int size = 256*1024;
+    char *b = malloc( size);
+    int len;
+
+    if ( !b) fatal_f("Out of memory\n");
+    pthread_cleanup_push( free, b);
+    len = events_json( b, size);
+    HTTPD_Add_Header( req, "Cache-Control: no-cache");
+    HTTPD_Add_Header( req, "Content-Type: application/json");
+    HTTPD_Send_Body( req, b, len);
+    pthread_cleanup_pop( 1);
+}
+
+static void close_fd( void *arg)
+{
+    close( (int)(long)arg);
+}
+
+/*
+** An event file goes out as it is on disk, JPEGs back to back.
+*/
+static void send_event( HTTPD_Request req, const char *name)
+{
+    int fd = open_event( name);
+    struct stat st;
+    char header[64];
+    char buf[65536];
+
+    if ( fd < 0 || fstat( fd, &st) != 0) {
+	if ( fd >= 0) close( fd);
+	HTTPD_Send_Status( req, 404, "Not Found");
+	HTTPD_Send_Body( req, "404 - Not found", 15);
+	return;
     }
+
+    pthread_cleanup_push( close_fd, (void *)(long)fd);
+    snprintf( header, sizeof(header), "Content-Length: %lld", (long long)st.st_size);
+    HTTPD_Add_Header( req, "Content-Type: video/x-motion-jpeg");
+    HTTPD_Add_Header( req, header);
+    for (;;) {
+	int n = read( fd, buf, sizeof(buf));
+
+	if ( n < 0 && errno == EINTR) continue;
+	if ( n <= 0 || !HTTPD_Send_Body_Chunk( req, buf, n)) break;
+	HTTPD_Push( req);
+    }
+    pthread_cleanup_pop( 1);
 }
-#endif
 
 static void do_video_call( HTTPD_Request req, video_action action, int cid, int val)
 {
@@ -227,7 +748,7 @@ static int check_password( HTTPD_Request req, int setup) {
 
 static void handle_requests(HTTPD_Request req, const char *method, const char *rawUrl)
 {
-  int cid,val;
+  int cid,val,first;
   const char *url = rawUrl;
 
   if ( strncmp( rawUrl, url_prefix, strlen(url_prefix))) {
@@ -236,6 +757,25 @@ static void handle_requests(HTTPD_Request req, const char *method, const char *r
       url = rawUrl + strlen(url_prefix);
   }
 
+  /*
+  ** /cam/NAME/ in front of anything means that camera, otherwise it is the
+  ** first. History, motion and events are only kept for the first.
+  */
+  use_camera( 0);
+  if ( strncmp( url, "/cam/", 5) == 0) {
+      const char *end = strchr( url+5, '/');
+      struct camera *c = end ? find_camera( url+5, end - (url+5)) : 0;
+
+      if ( !c) {
+	  HTTPD_Send_Status( req, 404, "Not Found");
+	  HTTPD_Send_Body( req, "404 - No such camera", 20);
+	  return;
+      }
+      use_camera( c);
+      url = end;
+  }
+  first = this_camera() == cameras;
+
   log_f("Request: %s %s => %s\n", method, rawUrl, url);
   if ( strcmp(url,"/status")==0) {
     do_status_request(req);
@@ -250,10 +790,25 @@ static void handle_requests(HTTPD_Request req, const char *method, const char *r
   } else if ( strcmp(url,"/tinycamd.css")==0) {
       HTTPD_Add_Header( req, "Content-type: text/css");
       HTTPD_Send_Body(req, tinycamd_css,tinycamd_css_size);
-#if 0
-  } else if ( strcmp(url,"/image.replace")==0) {
-    stream_image(req);
-#endif
+  } else if ( strcmp(url,"/metrics")==0) {
+      char buf[8192];
+      int len = format_metrics( buf, sizeof(buf));
+
+      HTTPD_Add_Header( req, "Cache-Control: no-cache");
+      HTTPD_Add_Header( req, "Content-Type: text/plain; version=0.0.4");
+      HTTPD_Send_Body( req, buf, len);
+  } else if ( strcmp(url,"/motion")==0 || strncmp(url,"/motion?",8)==0) {
+      if ( !motion_detect || !first) {
+	  HTTPD_Send_Status( req, 404, "Not Found");
+	  HTTPD_Send_Body( req, "404 - Motion detection is off", 29);
+      } else if ( check_password(req, 0)) send_motion( req, url);
+  } else if ( strcmp(url,"/events")==0) {
+      if ( !event_dir || !first) {
+	  HTTPD_Send_Status( req, 404, "Not Found");
+	  HTTPD_Send_Body( req, "404 - Event recording is off", 28);
+      } else if ( check_password(req, 0)) send_events( req);
+  } else if ( strncmp(url,"/events/",8)==0 && first) {
+      if ( check_password(req, 0)) send_event( req, url+8);
   } else if ( strcmp(url,"/controls")==0) {
     do_video_call( req, list_controls,0,0);
   } else if ( sscanf(url,"/set?%d=%d",&cid,&val)==2 ) {
@@ -261,7 +816,44 @@ static void handle_requests(HTTPD_Request req, const char *method, const char *r
   } else if ( strcmp(url,"/")==0 ||
 	      strcmp( url, "/image.jpg") == 0 ||
 	      strncmp( url, "/image.jpg?", 11) == 0) {
-      if ( check_password(req, 0)) with_current_frame( &put_single_image, req);
+      if ( check_password(req, 0)) send_image( req, url, 0);
+  } else if ( strncmp( url, "/view/", 6) == 0) {
+      struct view *v;
+      int stream = 0;
+
+      for ( v = this_camera()->views; v; v = v->next) {
+	  int len = strlen(v->name);
+	  if ( strncmp( url+6, v->name, len) != 0) continue;
+	  if ( strncmp( url+6+len, ".jpg", 4) == 0 &&
+	       ( url[10+len] == 0 || url[10+len] == '?')) break;
+	  if ( strncmp( url+6+len, ".mjpeg", 6) == 0 &&
+	       ( url[12+len] == 0 || url[12+len] == '?')) {
+	      stream = 1;
+	      break;
+	  }
+      }
+      if ( !v) {
+	  HTTPD_Send_Status( req, 404, "Not Found");
+	  HTTPD_Send_Body( req, "404 - Not found", 15);
+      } else if ( check_password(req, 0)) {
+	  if ( stream) stream_images( req, url, v);
+	  else send_image( req, url, v);
+      }
+  } else if ( strcmp( url, "/stream.mjpeg") == 0 ||
+	      strncmp( url, "/stream.mjpeg?", 14) == 0) {
+      if ( check_password(req, 0)) stream_images( req, url, 0);
+  } else if ( ( strcmp( url, "/sync") == 0 || strncmp( url, "/sync?", 6) == 0) && first) {
+      if ( !sync_frames) {
+	  HTTPD_Send_Status( req, 404, "Not Found");
+	  HTTPD_Send_Body( req, "404 - Sync frames are off", 25);
+      } else if ( check_password(req, 0)) send_sync( req, url);
+  } else if ( strcmp( url, "/mosaic.jpg") == 0 && first) {
+      if ( check_password(req, 0)) send_mosaic( req);
+  } else if ( strcmp( url, "/mosaic.mjpeg") == 0 && first) {
+      if ( check_password(req, 0)) stream_mosaic( req);
+  } else if ( ( strcmp( url, "/history.mjpeg") == 0 ||
+		strncmp( url, "/history.mjpeg?", 15) == 0) && first) {
+      if ( check_password(req, 0)) stream_history( req, url);
   } else {
     HTTPD_Send_Status( req, 404, "Not Found");
     HTTPD_Send_Body( req, "404 - Not found", 15);
@@ -276,8 +868,8 @@ static void *sleeper(void *arg)
 
 int main(int argc, char **argv)
 {
-    pthread_t captureThread;
     pthread_t httpdThread;
+    struct camera *c;
 
     do_options(argc, argv);
 
@@ -294,17 +886,31 @@ int main(int argc, char **argv)
 	if ( fclose(pf)==EOF) fatal_f("Failed to close pid file %s: %s\n", pid_file, strerror(errno));
     }
 
-    open_device();
+    for ( c = cameras; c; c = c->next) open_device( c);
 
     if ( probe_only) {
-	probe_device();
+	for ( c = cameras; c; c = c->next) probe_device( c);
 	return 0;
     }
 
-    init_device();
-    start_capturing();
-
-    pthread_create( &captureThread, NULL, main_loop, NULL);
+    for ( c = cameras; c; c = c->next) init_device( c);
+    start_sync();      // sized by init_device(), filled by the capture threads
+    add_device_metrics();
+    for ( c = cameras; c; c = c->next) {
+	if ( pthread_create( &c->thread, NULL, main_loop, c)) fatal_f("Failed to start capture thread.\n");
+    }
+    start_history();
+    start_recorder();
+    start_events();    // hooks motion, so before it starts
+    add_metric( "stream_frames_total", "Frames sent to /stream.mjpeg clients.", &streamFrames);
+    add_metric( "stream_skipped_frames_total", "Unchanged frames not sent to changes=1 streams.", &streamSkipped);
+    start_motion();
+    start_shm();
+    start_snapshot();
+    start_rtsp();      // binds now, in case the port wants root
+    start_dmabuf();    // likewise before the chroot
+    start_mosaic();
+    start_governor();  // opens /proc/stat, so before the chroot
 
     /*
     ** I am so sorry. But glibc dynamically loads libgcc_s.so.1 to handle pthread_cancel, so
@@ -340,12 +946,13 @@ int main(int argc, char **argv)
             if ( setreuid(uid, uid)) fatal_f("Failed to setuid to `%s': %s\n", setuid_to, strerror(errno));
         }
     }
+    for ( c = cameras; c; c = c->next) check_reopen( c);
 
     httpdThread = HTTPD_Start( bind_name, handle_requests);
 
     for(;;) sleep(100);
 
-    close_device();
+    for ( c = cameras; c; c = c->next) close_device( c);
 
     return 0;
 }
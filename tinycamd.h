@@ -1,6 +1,8 @@
 #ifndef TINYCAMD_IS_IN
 #define TINYCAMD_IS_IN
 
+#include <pthread.h>
+
 enum io_method {
         IO_METHOD_READ,
         IO_METHOD_MMAP,
@@ -13,9 +15,6 @@ enum camera_method {
   CAMERA_METHOD_YUYV,
 };
 
-extern enum io_method io_method;
-extern enum camera_method camera_method;
-extern char *videodev_name;
 extern char *bind_name;
 extern char *url_prefix;
 extern char *pid_file;
@@ -29,38 +28,311 @@ extern int daemon_mode;
 
 void do_options(int argc, char **argv);
 
-
-extern int videodev;
-extern int video_width;
-extern int video_height;
-extern int quality;
-extern int mono;
-extern int fps;
 extern int probe_only;
 
+#define TRANSFORM_TRANSPOSE 1   // applied first
+#define TRANSFORM_FLIP_H    2
+#define TRANSFORM_FLIP_V    4
+
+/*
+** A named rectangle of the (rotated) frame, served as /view/NAME.jpg
+*/
+struct view {
+    struct view *next;
+    char *name;
+    int x, y, width, height;
+};
+
+/*
+** One camera, with its own capture thread and current frame. The first is
+** the default, the rest are served under /cam/NAME/. Threads work on the
+** camera use_camera() picked for them, or the first, see device.c
+*/
+struct buffer;
+struct frame;
+struct sync_ring;
+struct camera {
+    struct camera *next;
+    char *name;
+    char *device;
+    enum io_method io;
+    enum camera_method method;
+    int width, height;           // as the driver gave them
+    int quality;
+    int mono;
+    int fps;
+    int want_buffers;            // to ask the driver for
+    int latest;                  // publish only the newest of the frames ready
+    int transform;
+    struct view *views;
+
+    int fd;                      // the rest for device.c and frame.c
+    pthread_mutex_t mutex;
+    struct buffer *buffers;
+    unsigned int n_buffers;
+    unsigned int queued;         // buffers the driver has to fill
+    struct frame *current, *retired, *unused;
+    int serial;                  // futex word, bumped after each publication
+    int rejected;
+    pthread_t thread;
+    struct sync_ring *sync;      // zero unless --sync-frames, see sync.c
+    int streaming;               // the driver is capturing
+    long wanted;                 // monotonic second a reader last wanted a frame
+    int wakeups;                 // futex word for a stopped capture thread
+    long long started;           // when streaming last started, until the first frame
+    int frameGap;                // ms between frames the governor wants, zero for all
+    int mplane;                  // the driver only has the multi-planar API
+    int broken;                  // errno that lost the device, for the capture thread
+    long long lastFrame;         // monotonic us of the last frame, or of starting
+    long long downSince;         // monotonic us capture failed, zero while it works
+    int generation;              // bumped each time the device is reopened
+    int kicked;                  // restarted for a stall, since the last frame
+    int reopen;                  // the device can be opened again, see check_reopen()
+    long gauge[4];               // this camera's share of device.c's gauges, see set_gauge()
+};
+extern struct camera *cameras;
+
+struct camera *this_camera(void);
+void use_camera( struct camera *c);    // 0 for the first
+struct camera *find_camera( const char *name, int length);
+
+extern int history_seconds;     // zero for no history
+extern int history_megabytes;
+
+extern char *record_dir;        // zero for no recording
+extern int record_segment_seconds;
+extern int record_megabytes;
+
+extern int motion_detect;
+extern int motion_threshold;    // brightness change of a block that counts as moving
+extern int motion_trigger;      // moving blocks per thousand that counts as motion
+
+extern char *event_dir;         // zero for no event recording
+extern int event_pre_seconds;
+extern int event_post_seconds;
+extern int event_megabytes;
+
+extern char *shm_name;          // zero for no shared memory ring
+extern int shm_slots;
+extern int shm_yuyv;
+
+extern char *snapshot_file;     // zero for no latest frame file
+extern int snapshot_every;
+extern int snapshot_fsync;
+
+extern char *rtsp_bind;         // [addr:]port, zero for no RTSP
+extern char *rtsp_multicast;    // group[:port], zero for none
+extern int rtsp_ttl;
+
+extern int mosaic_fps;
+extern int mosaic_columns;      // zero for as square as it can be
+
+extern int sync_frames;         // zero for no /sync
+
+extern int idle_off;            // seconds without viewers before a camera stops, zero never
+
+extern int stall_seconds;       // without a frame before reopening the device, zero never
+
+extern char *dmabuf_socket;     // unix socket path, zero for no dma-buf export
+
+extern int hugepages;           // userp buffers in huge pages
+extern int lock_buffers;        // and locked in memory
+
+extern int governor;            // turn cameras down when the box is busy
+extern int min_fps;
+extern int min_quality;
+extern int cpu_high;            // percent busy that is too busy
+extern int cpu_low;             // percent busy that is quiet enough to turn back up
+
 struct chunk {
     const void *data;
     unsigned int length;
 };
 typedef void (*frame_sender) (const struct chunk *, void *);
+
+/*
+** Where things are in a JPEG frame, byte offsets of the markers.
+*/
+#define MAX_JPEG_TABLES 4
+struct jpeg_index {
+    unsigned int width, height;
+    unsigned int sof;
+    unsigned int dqt[MAX_JPEG_TABLES];
+    int n_dqt;
+    unsigned int dht[MAX_JPEG_TABLES];
+    int n_dht;                // zero if the camera left them out
+    unsigned int dri;         // restart interval, zero for none
+    unsigned int sos;
+    unsigned int scan;        // first byte of entropy coded data
+    unsigned int eoi;
+    int quality;              // estimated from the luminance DQT
+};
+int index_jpeg( const unsigned char *p, unsigned int len, struct jpeg_index *ix);
 typedef int (*video_action)( int fd, char *buf, int used, int cid, int val);
 
-void open_device();
-void init_device();
-void probe_device();
-void start_capturing();
-void *main_loop(void *args);
-void stop_capturing();
-void close_device();
+void open_device( struct camera *c);
+void init_device( struct camera *c);
+void probe_device( struct camera *c);
+void start_capturing( struct camera *c);
+void *main_loop( void *camera);
+void stop_capturing( struct camera *c);
+void close_device( struct camera *c);
+void check_reopen( struct camera *c);
+void add_device_metrics(void);
+int set_frame_rate( struct camera *c, int fps);
+int buffer_dmabuf( struct camera *c, unsigned int i, unsigned int *length, const void **start);
+long long camera_down_ms(void);
 int with_device( video_action func, char *buf, int size, int cid, int val);
 
-void do_probe();
+void do_probe( struct camera *c);
 
 #ifdef __LINUX_VIDEODEV2_H
 void new_frame( void *data, unsigned int length, struct v4l2_buffer *buf);
+void requeue_buffer( struct v4l2_buffer *buf);
 #endif
+int reclaim_frames(void);
+void keep_current_frame(void);
 void with_current_frame( frame_sender func, void *arg);
 void with_next_frame( frame_sender func, void *arg);
+int frame_serial(void);
+void wait_for_frame( int serial);
+int wait_for_frame_timeout( int serial, int ms);
+void wake_frame_waiters( struct camera *c);
+int current_frame_serial(void);
+long long current_frame_time(void);
+const struct jpeg_index *current_frame_index(void);
+int current_frame_buffer( const void **data, unsigned int *length);
+void want_frames(void);
+int frames_wanted( int seconds);
+int wait_for_demand( int ms);
+
+/*
+** Reference counted images, see cache.c
+*/
+struct image {
+    int refs;
+    unsigned int length;
+    unsigned int size;
+    unsigned char *data;
+};
+typedef struct image *(*image_maker)(const struct chunk *, void *);
+
+struct image *new_image( unsigned int size);
+struct image *adopt_image( unsigned char *data, unsigned int length);
+void grow_image( struct image *im, unsigned int size);
+void retain_image( struct image *im);
+void release_image( struct image *im);
+int with_derived_image( const char *key, image_maker make, void *makeArg, frame_sender func, void *arg);
+int derived_backlog(void);
+
+#define JPEG_OPTIMIZE    1   // per image Huffman tables
+#define JPEG_PROGRESSIVE 2
+
+struct image *encode_yuyv( const unsigned char *yuyv, int width, int height, int q, int flags);
+struct image *requantize_jpeg( const struct chunk *c, int q, int flags);
+struct image *recode_jpeg( const struct chunk *c, int flags);
+struct image *scale_jpeg( const struct chunk *c, int denom, int q, int flags);
+struct image *transform_jpeg( const struct chunk *c, int transform, int flags);
+struct image *crop_jpeg( const struct chunk *c, int x, int y, int w, int h, int flags);
+struct image *mosaic_jpeg( const struct chunk **tiles, int n, int cols, int flags, int *decoded);
+unsigned char *scale_yuyv( const unsigned char *yuyv, int width, int height, int n, int *ow, int *oh);
+unsigned char *transform_yuyv( const unsigned char *yuyv, int width, int height, int transform, int *ow, int *oh);
+unsigned char *crop_yuyv( const unsigned char *yuyv, int width, int height, int x, int y, int w, int h, int *ow, int *oh);
+
+int with_jpeg_frame( frame_sender func, void *arg);
+void copy_frame( const struct chunk *c, void *arg);   // arg is a struct image **
+
+/*
+** The last few seconds of frames, see history.c
+*/
+void start_history(void);
+struct image *history_by_serial( int serial);
+struct image *history_at( long long ms, long long *when);
+struct image *history_after( long long ms, long long *when);
+
+/*
+** Recordings on disk, see recorder.c
+*/
+struct record_index {
+    long long ms;              // capture time, ms since the epoch
+    unsigned int offset;       // in the .mjpeg file
+    unsigned int length;
+};
+
+#define RECORD_INDEX_BATCH 64
+struct recording {
+    int dir;                   // opened with open_recording_dir()
+    int fd, indexFd;           // -1 when closed
+    char name[32];
+    long long start;
+    unsigned int bytes, flushed;
+    struct record_index pending[RECORD_INDEX_BATCH];
+    int n_pending;
+    long errors;
+};
+
+int open_recording_dir( const char *path);
+int open_recording( struct recording *r, long long ms);
+int append_recording( struct recording *r, const struct chunk *c, long long ms);
+int write_chunks( int fd, const struct chunk *c);
+void close_recording( struct recording *r);
+int is_recording_name( const char *name);
+int list_recordings( int dir, char ***namesp);
+void prune_recordings( int dir, int megabytes, const char *keep);
+void start_recorder(void);
+
+/*
+** Motion in one frame, see motion.c. Positions are in pixels of the frame
+** as served, the mask has a byte per 8x8 block, 1 where it moved.
+*/
+struct motion {
+    int serial;
+    long long ms;
+    int score;                // moving blocks per thousand
+    int x, y, width, height;  // around everything that moved
+    int cols, rows;
+    const unsigned char *mask;
+    const unsigned char *signature;  // SIGNATURE_SIZE cells of average brightness
+};
+#define SIGNATURE_COLS 32
+#define SIGNATURE_ROWS 24
+#define SIGNATURE_SIZE (SIGNATURE_COLS * SIGNATURE_ROWS)
+typedef void (*motion_hook)( const struct motion *, void *);
+
+void start_motion(void);
+void add_motion_hook( motion_hook func, void *arg);
+int motion_json( char *buf, int size, int after, int moving, int seconds);
+int wait_for_signature( int after, unsigned char *sig, int seconds);
+
+void start_events(void);
+int events_json( char *buf, int size);
+int open_event( const char *name);
+
+void start_shm(void);
+void start_snapshot(void);
+void start_rtsp(void);
+void start_mosaic(void);
+struct image *mosaic_image( int after, int *serial);
+void start_governor(void);
+void start_dmabuf(void);
+
+/*
+** Frames from several cameras taken together, see sync.c
+*/
+struct synced {
+    struct camera *camera;
+    struct image *im;         // as /cam/NAME/image.jpg would have served it
+    int serial;
+    long long ms;             // capture time, ms since the epoch
+    long long us;             // driver timestamp, monotonic microseconds
+};
+
+void start_sync(void);
+void sync_frame( const struct chunk *c, int serial, long long ms, long long us);
+int find_synced( struct camera **cams, int n, long long tolerance, struct synced *out, long long *skew);
+
+void add_metric( const char *name, const char *help, const long *value);
+int format_metrics( char *buf, int size);
 
 int list_controls( int fd, char *buf, int used, int cid, int val);
 int set_control( int fd, char *buf, int used, int cid, int val);
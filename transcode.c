@@ -0,0 +1,927 @@
+/*
+** JPEG plumbing which works on frames without pulling them out into
+** pixels whenever it can. Everything here reads from a chunk array, the
+** same thing with_current_frame() hands out, so an MJPEG frame and its
+** inserted DHT never need to be glued together first.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "tinycamd.h"
+
+/*
+** libjpeg's default error handler calls exit(), which is rude for a daemon
+** fed by a USB camera that hands us a broken frame now and then. Errors in
+** here just abandon the image.
+*/
+struct jerr {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+static void jerr_exit( j_common_ptr cinfo)
+{
+    struct jerr *e = (struct jerr *)cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp( e->jmp, 1);
+}
+
+static void jerr_output( j_common_ptr cinfo)
+{
+    char buf[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, buf);
+    log_f("libjpeg: %s\n", buf);
+}
+
+static struct jpeg_error_mgr *jerr_init( struct jerr *e)
+{
+    jpeg_std_error( &e->pub);
+    e->pub.error_exit = jerr_exit;
+    e->pub.output_message = jerr_output;
+    return &e->pub;
+}
+
+/*
+** A source manager that walks a chunk array.
+*/
+struct chunk_source {
+    struct jpeg_source_mgr pub;
+    const struct chunk *c;
+};
+
+static const JOCTET fake_eoi[] = { 0xff, JPEG_EOI };
+
+static void chunk_init_source( j_decompress_ptr cinfo)
+{
+}
+
+static boolean chunk_fill_input_buffer( j_decompress_ptr cinfo)
+{
+    struct chunk_source *s = (struct chunk_source *)cinfo->src;
+
+    while ( s->c->data && s->c->length == 0) s->c++;
+
+    if ( s->c->data) {
+	s->pub.next_input_byte = s->c->data;
+	s->pub.bytes_in_buffer = s->c->length;
+	s->c++;
+    } else {
+	// Truncated frame, let libjpeg finish it with grey.
+	WARNMS( cinfo, JWRN_JPEG_EOF);
+	s->pub.next_input_byte = fake_eoi;
+	s->pub.bytes_in_buffer = sizeof(fake_eoi);
+    }
+    return TRUE;
+}
+
+static void chunk_skip_input_data( j_decompress_ptr cinfo, long num_bytes)
+{
+    struct jpeg_source_mgr *s = cinfo->src;
+
+    while ( num_bytes > (long)s->bytes_in_buffer) {
+	num_bytes -= s->bytes_in_buffer;
+	chunk_fill_input_buffer( cinfo);
+    }
+    if ( num_bytes > 0) {
+	s->next_input_byte += num_bytes;
+	s->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void chunk_term_source( j_decompress_ptr cinfo)
+{
+}
+
+static void chunk_src( j_decompress_ptr cinfo, struct chunk_source *s, const struct chunk *c)
+{
+    s->pub.init_source = chunk_init_source;
+    s->pub.fill_input_buffer = chunk_fill_input_buffer;
+    s->pub.skip_input_data = chunk_skip_input_data;
+    s->pub.resync_to_restart = jpeg_resync_to_restart;
+    s->pub.term_source = chunk_term_source;
+    s->pub.next_input_byte = 0;
+    s->pub.bytes_in_buffer = 0;
+    s->c = c;
+    cinfo->src = &s->pub;
+}
+
+/*
+** A destination manager that grows an image as it goes.
+*/
+struct image_dest {
+    struct jpeg_destination_mgr pub;
+    struct image *im;
+    unsigned int initial;
+};
+
+static void image_init_destination( j_compress_ptr cinfo)
+{
+    struct image_dest *d = (struct image_dest *)cinfo->dest;
+
+    d->im = new_image( d->initial);
+    d->pub.next_output_byte = d->im->data;
+    d->pub.free_in_buffer = d->im->size;
+}
+
+static boolean image_empty_output_buffer( j_compress_ptr cinfo)
+{
+    struct image_dest *d = (struct image_dest *)cinfo->dest;
+    unsigned int old = d->im->size;
+
+    // libjpeg considers the whole buffer written when it calls us
+    grow_image( d->im, old*2);
+    d->pub.next_output_byte = d->im->data + old;
+    d->pub.free_in_buffer = d->im->size - old;
+    return TRUE;
+}
+
+static void image_term_destination( j_compress_ptr cinfo)
+{
+    struct image_dest *d = (struct image_dest *)cinfo->dest;
+
+    d->im->length = d->im->size - d->pub.free_in_buffer;
+}
+
+static void image_dst( j_compress_ptr cinfo, struct image_dest *d, unsigned int initial)
+{
+    d->pub.init_destination = image_init_destination;
+    d->pub.empty_output_buffer = image_empty_output_buffer;
+    d->pub.term_destination = image_term_destination;
+    d->im = 0;
+    d->initial = initial < 4096 ? 4096 : initial;
+    cinfo->dest = &d->pub;
+}
+
+/*
+** The lossless knobs, applied to any compressor we set up.
+*/
+static void set_jpeg_flags( j_compress_ptr cinfo, int flags)
+{
+    if ( flags & JPEG_OPTIMIZE) cinfo->optimize_coding = TRUE;
+    if ( flags & JPEG_PROGRESSIVE) jpeg_simple_progression( cinfo);
+}
+
+static unsigned int chunk_length( const struct chunk *c)
+{
+    unsigned int s = 0;
+
+    for ( ; c->data != 0; c++) s += c->length;
+    return s;
+}
+
+/*
+** Encode a YUYV image of the given size.
+*/
+struct image *encode_yuyv( const unsigned char *yuyv, int width, int height, int q, int flags)
+{
+    struct jpeg_compress_struct cinfo;
+    struct image_dest dest;
+    struct jerr err;
+    int mono = this_camera()->mono;
+    JSAMPLE *pix;
+
+    pix = malloc( width*3*sizeof(JSAMPLE));
+    if ( !pix) fatal_f("Failed to allocate JPEG encoding buffer.\n");
+
+    cinfo.err = jerr_init( &err);
+    jpeg_create_compress( &cinfo);
+    image_dst( &cinfo, &dest, width*height/4);
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &cinfo);
+	if ( dest.im) release_image( dest.im);
+	free( pix);
+	return 0;
+    }
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    if ( mono) {
+	cinfo.input_components = 1;
+	cinfo.in_color_space = JCS_GRAYSCALE;
+    } else {
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+    }
+    jpeg_set_defaults( &cinfo);
+    jpeg_set_quality( &cinfo, q, TRUE);
+    set_jpeg_flags( &cinfo, flags);
+
+    jpeg_start_compress( &cinfo, TRUE);
+    {
+	const unsigned char *b = yuyv;
+	JSAMPROW rows[] = { pix};
+	int row, col;
+
+	for ( row = 0; row < height; row++) {
+	    JSAMPLE *p = pix;
+	    for ( col = 0; col < width; col+=2) {
+		*p++ = b[0];
+		if ( !mono) {
+		    *p++ = b[1];
+		    *p++ = b[3];
+		}
+		*p++ = b[2];
+		if ( !mono) {
+		    *p++ = b[1];
+		    *p++ = b[3];
+		}
+		b += 4;
+	    }
+	    jpeg_write_scanlines( &cinfo, rows, 1);
+	}
+    }
+    jpeg_finish_compress( &cinfo);
+    jpeg_destroy_compress( &cinfo);
+    free( pix);
+
+    return dest.im;
+}
+
+/*
+** These are the IJG tables, in natural order, that jpeg_set_quality() scales.
+*/
+static const unsigned int std_luminance_quant_tbl[DCTSIZE2] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+static const unsigned int std_chrominance_quant_tbl[DCTSIZE2] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+/*
+** Requantize a JPEG to a coarser table without leaving the DCT domain.
+** Each new step is the IJG table for quality q, but never finer than the
+** step the camera used, so the coefficients only ever get divided down.
+*/
+struct image *requantize_jpeg( const struct chunk *c, int q, int flags)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    jvirt_barray_ptr *coef;
+    UINT16 oldq[NUM_QUANT_TBLS][DCTSIZE2];
+    int scale = jpeg_quality_scaling(q);
+    int t, ci, k;
+
+    src.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    jpeg_create_compress( &dst);
+    chunk_src( &src, &source, c);
+    image_dst( &dst, &dest, chunk_length(c));
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &src);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &src, TRUE);
+    coef = jpeg_read_coefficients( &src);
+    jpeg_copy_critical_parameters( &src, &dst);
+
+    for ( t = 0; t < NUM_QUANT_TBLS; t++) {
+	JQUANT_TBL *qt = dst.quant_tbl_ptrs[t];
+	const unsigned int *basic = t ? std_chrominance_quant_tbl : std_luminance_quant_tbl;
+
+	if ( !qt) continue;
+	for ( k = 0; k < DCTSIZE2; k++) {
+	    long v = ((long)basic[k] * scale + 50L) / 100L;
+
+	    if ( v < 1) v = 1;
+	    if ( v > 255) v = 255;
+	    oldq[t][k] = qt->quantval[k];
+	    if ( v > qt->quantval[k]) qt->quantval[k] = v;
+	}
+    }
+
+    for ( ci = 0; ci < src.num_components; ci++) {
+	jpeg_component_info *comp = &src.comp_info[ci];
+	const UINT16 *from = oldq[comp->quant_tbl_no];
+	const UINT16 *to = dst.quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+	JDIMENSION row, col;
+
+	for ( row = 0; row < comp->height_in_blocks; row++) {
+	    JBLOCKARRAY b = (*src.mem->access_virt_barray)((j_common_ptr)&src, coef[ci], row, 1, TRUE);
+
+	    for ( col = 0; col < comp->width_in_blocks; col++) {
+		JCOEF *blk = b[0][col];
+
+		for ( k = 0; k < DCTSIZE2; k++) {
+		    long v = (long)blk[k] * from[k];
+
+		    if ( from[k] == to[k] || v == 0) continue;
+		    if ( v > 0) blk[k] = (v + to[k]/2) / to[k];
+		    else blk[k] = -((-v + to[k]/2) / to[k]);
+		}
+	    }
+	}
+    }
+
+    set_jpeg_flags( &dst, flags);
+    jpeg_write_coefficients( &dst, coef);
+    jpeg_finish_compress( &dst);
+    jpeg_finish_decompress( &src);
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &src);
+
+    return dest.im;
+}
+
+/*
+** Losslessly rewrite the entropy coding of a JPEG, as jpegtran does. The
+** camera's generic tables, or the fixed DHT we put in, are replaced with
+** ones built for this frame, and the scans made progressive if asked.
+*/
+struct image *recode_jpeg( const struct chunk *c, int flags)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    jvirt_barray_ptr *coef;
+
+    src.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    jpeg_create_compress( &dst);
+    chunk_src( &src, &source, c);
+    image_dst( &dst, &dest, chunk_length(c));
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &src);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &src, TRUE);
+    coef = jpeg_read_coefficients( &src);
+    jpeg_copy_critical_parameters( &src, &dst);
+    set_jpeg_flags( &dst, flags);
+    jpeg_write_coefficients( &dst, coef);
+    jpeg_finish_compress( &dst);
+    jpeg_finish_decompress( &src);
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &src);
+
+    return dest.im;
+}
+
+/*
+** Shrink a JPEG by 2, 4, or 8 by letting libjpeg do a reduced size IDCT, then
+** encode the little one. At 1/8 the IDCT is just the DC coefficient. We stay
+** in YCbCr the whole way so there is no colour conversion either.
+*/
+struct image *scale_jpeg( const struct chunk *c, int denom, int q, int flags)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    JSAMPARRAY rows;
+
+    src.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    jpeg_create_compress( &dst);
+    chunk_src( &src, &source, c);
+    image_dst( &dst, &dest, chunk_length(c)/denom);
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &src);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &src, TRUE);
+    src.scale_num = 1;
+    src.scale_denom = denom;
+    src.dct_method = JDCT_IFAST;
+    src.do_fancy_upsampling = FALSE;
+    src.out_color_space = ( src.jpeg_color_space == JCS_GRAYSCALE) ? JCS_GRAYSCALE : JCS_YCbCr;
+    jpeg_start_decompress( &src);
+
+    dst.image_width = src.output_width;
+    dst.image_height = src.output_height;
+    dst.input_components = src.output_components;
+    dst.in_color_space = src.out_color_space;
+    jpeg_set_defaults( &dst);
+    jpeg_set_quality( &dst, q, TRUE);
+    set_jpeg_flags( &dst, flags);
+    dst.dct_method = JDCT_IFAST;
+    jpeg_start_compress( &dst, TRUE);
+
+    rows = (*src.mem->alloc_sarray)((j_common_ptr)&src, JPOOL_IMAGE,
+				     src.output_width * src.output_components, 1);
+    while ( src.output_scanline < src.output_height) {
+	jpeg_read_scanlines( &src, rows, 1);
+	jpeg_write_scanlines( &dst, rows, 1);
+    }
+
+    jpeg_finish_compress( &dst);
+    jpeg_finish_decompress( &src);
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &src);
+
+    return dest.im;
+}
+
+/*
+** Rotate and flip a JPEG without decoding it, as jpegtran does. Whole
+** blocks move around the image and inside each block a transpose swaps
+** coefficients while a flip negates the odd frequencies. The image is
+** trimmed to whole MCUs first, otherwise the partial ones at the right and
+** bottom would end up at the left and top.
+*/
+struct image *transform_jpeg( const struct chunk *c, int transform, int flags)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    jvirt_barray_ptr *coef;
+    jvirt_barray_ptr out[MAX_COMPONENTS];
+    JDIMENSION width, height, bw[MAX_COMPONENTS], bh[MAX_COMPONENTS];
+    int transpose = transform & TRANSFORM_TRANSPOSE;
+    int ci, t, u, v;
+
+    src.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    jpeg_create_compress( &dst);
+    chunk_src( &src, &source, c);
+    image_dst( &dst, &dest, chunk_length(c));
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &src);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &src, TRUE);
+
+    width = src.image_width / (src.max_h_samp_factor * DCTSIZE) * (src.max_h_samp_factor * DCTSIZE);
+    height = src.image_height / (src.max_v_samp_factor * DCTSIZE) * (src.max_v_samp_factor * DCTSIZE);
+    if ( width == 0 || height == 0) ERREXIT( &src, JERR_EMPTY_IMAGE);
+
+    // the output arrays must be requested before the coefficients are read
+    for ( ci = 0; ci < src.num_components; ci++) {
+	jpeg_component_info *comp = &src.comp_info[ci];
+
+	bw[ci] = width * comp->h_samp_factor / (src.max_h_samp_factor * DCTSIZE);
+	bh[ci] = height * comp->v_samp_factor / (src.max_v_samp_factor * DCTSIZE);
+	out[ci] = (*src.mem->request_virt_barray)((j_common_ptr)&src, JPOOL_IMAGE, FALSE,
+						   transpose ? bh[ci] : bw[ci],
+						   transpose ? bw[ci] : bh[ci],
+						   transpose ? comp->h_samp_factor : comp->v_samp_factor);
+    }
+
+    coef = jpeg_read_coefficients( &src);
+    jpeg_copy_critical_parameters( &src, &dst);
+    dst.image_width = transpose ? height : width;
+    dst.image_height = transpose ? width : height;
+
+    if ( transpose) {
+	for ( ci = 0; ci < dst.num_components; ci++) {
+	    jpeg_component_info *comp = &dst.comp_info[ci];
+	    int h = comp->h_samp_factor;
+
+	    comp->h_samp_factor = comp->v_samp_factor;
+	    comp->v_samp_factor = h;
+	}
+	for ( t = 0; t < NUM_QUANT_TBLS; t++) {
+	    JQUANT_TBL *qt = dst.quant_tbl_ptrs[t];
+
+	    if ( !qt) continue;
+	    for ( v = 0; v < DCTSIZE; v++) {
+		for ( u = v+1; u < DCTSIZE; u++) {
+		    UINT16 q = qt->quantval[v*DCTSIZE+u];
+
+		    qt->quantval[v*DCTSIZE+u] = qt->quantval[u*DCTSIZE+v];
+		    qt->quantval[u*DCTSIZE+v] = q;
+		}
+	    }
+	}
+    }
+
+    for ( ci = 0; ci < src.num_components; ci++) {
+	JDIMENSION dw = transpose ? bh[ci] : bw[ci];
+	JDIMENSION dh = transpose ? bw[ci] : bh[ci];
+	JDIMENSION row, col;
+
+	for ( row = 0; row < dh; row++) {
+	    JBLOCKROW d = (*src.mem->access_virt_barray)((j_common_ptr)&src, out[ci], row, 1, TRUE)[0];
+	    JDIMENSION y = (transform & TRANSFORM_FLIP_V) ? dh-1-row : row;
+
+	    for ( col = 0; col < dw; col++) {
+		JDIMENSION x = (transform & TRANSFORM_FLIP_H) ? dw-1-col : col;
+		JCOEF *s, *o = d[col];
+
+		if ( transpose) s = (*src.mem->access_virt_barray)((j_common_ptr)&src, coef[ci], x, 1, FALSE)[0][y];
+		else s = (*src.mem->access_virt_barray)((j_common_ptr)&src, coef[ci], y, 1, FALSE)[0][x];
+
+		for ( v = 0; v < DCTSIZE; v++) {
+		    for ( u = 0; u < DCTSIZE; u++) {
+			JCOEF k = transpose ? s[u*DCTSIZE+v] : s[v*DCTSIZE+u];
+
+			if ( (transform & TRANSFORM_FLIP_H) && (u & 1)) k = -k;
+			if ( (transform & TRANSFORM_FLIP_V) && (v & 1)) k = -k;
+			o[v*DCTSIZE+u] = k;
+		    }
+		}
+	    }
+	}
+    }
+
+    set_jpeg_flags( &dst, flags);
+    jpeg_write_coefficients( &dst, out);
+    jpeg_finish_compress( &dst);
+    jpeg_finish_decompress( &src);
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &src);
+
+    return dest.im;
+}
+
+/*
+** Losslessly cut a rectangle out of a JPEG. The top left corner is moved
+** up and left to an MCU boundary so that blocks can be copied whole, which
+** makes the view a little bigger than asked for.
+*/
+struct image *crop_jpeg( const struct chunk *c, int x, int y, int w, int h, int flags)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    jvirt_barray_ptr *coef;
+    jvirt_barray_ptr out[MAX_COMPONENTS];
+    JDIMENSION bx[MAX_COMPONENTS], by[MAX_COMPONENTS], bw[MAX_COMPONENTS], bh[MAX_COMPONENTS];
+    int mcuw, mcuh, ci;
+
+    src.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    jpeg_create_compress( &dst);
+    chunk_src( &src, &source, c);
+    image_dst( &dst, &dest, chunk_length(c));
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &src);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &src, TRUE);
+
+    mcuw = src.max_h_samp_factor * DCTSIZE;
+    mcuh = src.max_v_samp_factor * DCTSIZE;
+    w += x % mcuw;
+    h += y % mcuh;
+    x -= x % mcuw;
+    y -= y % mcuh;
+    if ( x < 0 || y < 0 || x >= (int)src.image_width || y >= (int)src.image_height) ERREXIT( &src, JERR_EMPTY_IMAGE);
+    if ( x + w > (int)src.image_width) w = src.image_width - x;
+    if ( y + h > (int)src.image_height) h = src.image_height - y;
+    if ( w <= 0 || h <= 0) ERREXIT( &src, JERR_EMPTY_IMAGE);
+
+    for ( ci = 0; ci < src.num_components; ci++) {
+	jpeg_component_info *comp = &src.comp_info[ci];
+
+	bx[ci] = x / mcuw * comp->h_samp_factor;
+	by[ci] = y / mcuh * comp->v_samp_factor;
+	bw[ci] = (w + mcuw - 1) / mcuw * comp->h_samp_factor;
+	bh[ci] = (h + mcuh - 1) / mcuh * comp->v_samp_factor;
+	out[ci] = (*src.mem->request_virt_barray)((j_common_ptr)&src, JPOOL_IMAGE, TRUE,
+						   bw[ci], bh[ci], comp->v_samp_factor);
+    }
+
+    coef = jpeg_read_coefficients( &src);
+    jpeg_copy_critical_parameters( &src, &dst);
+    dst.image_width = w;
+    dst.image_height = h;
+
+    for ( ci = 0; ci < src.num_components; ci++) {
+	jpeg_component_info *comp = &src.comp_info[ci];
+	JDIMENSION row, n = bw[ci];
+
+	// the last MCU of the frame may be all the source has
+	if ( bx[ci] + n > comp->width_in_blocks) n = comp->width_in_blocks - bx[ci];
+
+	for ( row = 0; row < bh[ci] && by[ci] + row < comp->height_in_blocks; row++) {
+	    JBLOCKROW d = (*src.mem->access_virt_barray)((j_common_ptr)&src, out[ci], row, 1, TRUE)[0];
+	    JBLOCKROW s = (*src.mem->access_virt_barray)((j_common_ptr)&src, coef[ci], by[ci]+row, 1, FALSE)[0];
+
+	    memcpy( d, s + bx[ci], n * sizeof(JBLOCK));
+	}
+    }
+
+    set_jpeg_flags( &dst, flags);
+    jpeg_write_coefficients( &dst, out);
+    jpeg_finish_compress( &dst);
+    jpeg_finish_decompress( &src);
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &src);
+
+    return dest.im;
+}
+
+/*
+** Copy a tile's blocks into cell cx,cy of the mosaic, moving them to the
+** mosaic's quantization if the tile's differs. Blocks past the cell are
+** dropped, so a too big tile is cut at the right and bottom.
+*/
+static void copy_tile( j_decompress_ptr ref, jvirt_barray_ptr *out, j_decompress_ptr src, jvirt_barray_ptr *coef,
+		       int cx, int cy, int cellw, int cellh)
+{
+    int ci, k;
+
+    for ( ci = 0; ci < ref->num_components; ci++) {
+	jpeg_component_info *rc = &ref->comp_info[ci], *sc = &src->comp_info[ci];
+	const UINT16 *from = sc->quant_table->quantval;
+	const UINT16 *to = rc->quant_table->quantval;
+	JDIMENSION bw = cellw / (ref->max_h_samp_factor * DCTSIZE) * rc->h_samp_factor;
+	JDIMENSION bh = cellh / (ref->max_v_samp_factor * DCTSIZE) * rc->v_samp_factor;
+	JDIMENSION w = sc->width_in_blocks < bw ? sc->width_in_blocks : bw;
+	JDIMENSION h = sc->height_in_blocks < bh ? sc->height_in_blocks : bh;
+	int same = memcmp( from, to, sizeof(UINT16) * DCTSIZE2) == 0;
+	JDIMENSION row, col;
+
+	for ( row = 0; row < h; row++) {
+	    JBLOCKROW d = (*ref->mem->access_virt_barray)((j_common_ptr)ref, out[ci], cy*bh + row, 1, TRUE)[0] + cx*bw;
+	    JBLOCKROW s = (*src->mem->access_virt_barray)((j_common_ptr)src, coef[ci], row, 1, FALSE)[0];
+
+	    if ( same) {
+		memcpy( d, s, w * sizeof(JBLOCK));
+		continue;
+	    }
+	    for ( col = 0; col < w; col++) {
+		for ( k = 0; k < DCTSIZE2; k++) {
+		    long v = (long)s[col][k] * from[k];
+		    long limit = k ? 1023 : 2047;   // what baseline Huffman can carry
+
+		    if ( v >= 0) v = (v + to[k]/2) / to[k];
+		    else v = -((-v + to[k]/2) / to[k]);
+		    if ( v > limit) v = limit;
+		    if ( v < -limit) v = -limit;
+		    d[col][k] = v;
+		}
+	    }
+	}
+    }
+}
+
+/*
+** Put one tile in the mosaic. Returns 1 if it went in, 0 if its sampling or
+** size means its blocks can't be copied, and -1 if it is broken. With any
+** set it goes in whatever its size, for tiles fit_tile() already made.
+*/
+static int place_tile( j_decompress_ptr ref, jvirt_barray_ptr *out, const struct chunk *c,
+		       int cx, int cy, int cellw, int cellh, int any)
+{
+    struct jpeg_decompress_struct src;
+    struct chunk_source source;
+    struct jerr err;
+    jvirt_barray_ptr *coef;
+    int ci;
+
+    src.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    chunk_src( &src, &source, c);
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_decompress( &src);
+	return -1;
+    }
+
+    jpeg_read_header( &src, TRUE);
+    if ( !any) {
+	int fits = src.num_components == ref->num_components && src.jpeg_color_space == ref->jpeg_color_space &&
+	    src.image_width <= cellw && src.image_height <= cellh;
+
+	for ( ci = 0; fits && ci < src.num_components; ci++) {
+	    fits = src.comp_info[ci].h_samp_factor == ref->comp_info[ci].h_samp_factor &&
+		src.comp_info[ci].v_samp_factor == ref->comp_info[ci].v_samp_factor;
+	}
+	if ( !fits) {
+	    jpeg_destroy_decompress( &src);
+	    return 0;
+	}
+    }
+
+    coef = jpeg_read_coefficients( &src);
+    copy_tile( ref, out, &src, coef, cx, cy, cellw, cellh);
+    jpeg_finish_decompress( &src);
+    jpeg_destroy_decompress( &src);
+    return 1;
+}
+
+/*
+** A tile whose blocks can't be copied is decoded at the largest of 1, 1/2,
+** 1/4 or 1/8 that fits the cell, and encoded again with the mosaic's
+** sampling and tables, so that its blocks can be.
+*/
+static struct image *fit_tile( const struct chunk *c, j_decompress_ptr ref, int cellw, int cellh)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    JSAMPARRAY rows, wide = 0;
+    unsigned int table[DCTSIZE2];
+    int gray = ref->num_components == 1;
+    int ci, t, k;
+    JDIMENSION x;
+
+    src.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &src);
+    jpeg_create_compress( &dst);
+    chunk_src( &src, &source, c);
+    image_dst( &dst, &dest, chunk_length(c));
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &src);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &src, TRUE);
+    src.scale_num = 1;
+    src.dct_method = JDCT_IFAST;
+    src.do_fancy_upsampling = FALSE;
+    src.out_color_space = ( gray || src.jpeg_color_space == JCS_GRAYSCALE) ? JCS_GRAYSCALE : JCS_YCbCr;
+    for ( src.scale_denom = 1; src.scale_denom < 8; src.scale_denom *= 2) {
+	jpeg_calc_output_dimensions( &src);
+	if ( src.output_width <= cellw && src.output_height <= cellh) break;
+    }
+    jpeg_start_decompress( &src);
+
+    dst.image_width = src.output_width < cellw ? src.output_width : cellw;
+    dst.image_height = src.output_height < cellh ? src.output_height : cellh;
+    dst.input_components = gray ? 1 : 3;
+    dst.in_color_space = gray ? JCS_GRAYSCALE : JCS_YCbCr;
+    jpeg_set_defaults( &dst);
+    for ( t = 0; t < NUM_QUANT_TBLS; t++) {
+	if ( !ref->quant_tbl_ptrs[t]) continue;
+	for ( k = 0; k < DCTSIZE2; k++) table[k] = ref->quant_tbl_ptrs[t]->quantval[k];
+	jpeg_add_quant_table( &dst, t, table, 100, TRUE);
+    }
+    for ( ci = 0; ci < dst.num_components; ci++) {
+	dst.comp_info[ci].h_samp_factor = ref->comp_info[ci].h_samp_factor;
+	dst.comp_info[ci].v_samp_factor = ref->comp_info[ci].v_samp_factor;
+	dst.comp_info[ci].quant_tbl_no = ref->comp_info[ci].quant_tbl_no;
+    }
+    dst.dct_method = JDCT_IFAST;
+    jpeg_start_compress( &dst, TRUE);
+
+    rows = (*src.mem->alloc_sarray)((j_common_ptr)&src, JPOOL_IMAGE,
+				     src.output_width * src.output_components, 1);
+    // a gray camera in a colour mosaic gets neutral chroma
+    if ( !gray && src.output_components == 1) {
+	wide = (*src.mem->alloc_sarray)((j_common_ptr)&src, JPOOL_IMAGE, src.output_width * 3, 1);
+    }
+    while ( dst.next_scanline < dst.image_height) {
+	jpeg_read_scanlines( &src, rows, 1);
+	if ( wide) {
+	    for ( x = 0; x < src.output_width; x++) {
+		wide[0][3*x] = rows[0][x];
+		wide[0][3*x+1] = wide[0][3*x+2] = CENTERJSAMPLE;
+	    }
+	}
+	jpeg_write_scanlines( &dst, wide ? wide : rows, 1);
+    }
+
+    jpeg_finish_compress( &dst);
+    jpeg_abort_decompress( &src);   // a cut tile leaves lines unread
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &src);
+
+    return dest.im;
+}
+
+/*
+** Tile several JPEGs into one, cols across, each in a cell the size of the
+** first rounded up to whole MCUs. The first one's sampling and tables are
+** the mosaic's, and tiles which share its sampling are copied block by
+** block without leaving the DCT domain. Missing tiles, a 0 in tiles, and
+** the rest of a cell a small tile doesn't cover are black. *decoded counts
+** the tiles that had to go through fit_tile().
+*/
+struct image *mosaic_jpeg( const struct chunk **tiles, int n, int cols, int flags, int *decoded)
+{
+    struct jpeg_decompress_struct ref;
+    struct jpeg_compress_struct dst;
+    struct chunk_source source;
+    struct image_dest dest;
+    struct jerr err;
+    jvirt_barray_ptr *coef;
+    jvirt_barray_ptr out[MAX_COMPONENTS];
+    unsigned int length = 0;
+    int first, rows, mcuw, mcuh, cellw, cellh, ci, i;
+    JDIMENSION row, col;
+
+    for ( first = 0; first < n && !tiles[first]; first++) ;
+    if ( first == n) return 0;
+    for ( i = 0; i < n; i++) if ( tiles[i]) length += chunk_length( tiles[i]);
+    rows = (n + cols - 1) / cols;
+
+    ref.err = dst.err = jerr_init( &err);
+    jpeg_create_decompress( &ref);
+    jpeg_create_compress( &dst);
+    chunk_src( &ref, &source, tiles[first]);
+    image_dst( &dst, &dest, length);
+
+    if ( setjmp( err.jmp)) {
+	jpeg_destroy_compress( &dst);
+	jpeg_destroy_decompress( &ref);
+	if ( dest.im) release_image( dest.im);
+	return 0;
+    }
+
+    jpeg_read_header( &ref, TRUE);
+
+    mcuw = ref.max_h_samp_factor * DCTSIZE;
+    mcuh = ref.max_v_samp_factor * DCTSIZE;
+    cellw = (ref.image_width + mcuw - 1) / mcuw * mcuw;
+    cellh = (ref.image_height + mcuh - 1) / mcuh * mcuh;
+
+    // the output arrays must be requested before the coefficients are read
+    for ( ci = 0; ci < ref.num_components; ci++) {
+	jpeg_component_info *comp = &ref.comp_info[ci];
+
+	out[ci] = (*ref.mem->request_virt_barray)((j_common_ptr)&ref, JPOOL_IMAGE, TRUE,
+						   cols * cellw / mcuw * comp->h_samp_factor,
+						   rows * cellh / mcuh * comp->v_samp_factor,
+						   comp->v_samp_factor);
+    }
+
+    coef = jpeg_read_coefficients( &ref);
+
+    // zeros are grey, a luminance DC of -1024 is black
+    {
+	jpeg_component_info *comp = &ref.comp_info[0];
+	int q = comp->quant_table->quantval[0];
+
+	for ( row = 0; row < rows * cellh / mcuh * comp->v_samp_factor; row++) {
+	    JBLOCKROW d = (*ref.mem->access_virt_barray)((j_common_ptr)&ref, out[0], row, 1, TRUE)[0];
+
+	    for ( col = 0; col < cols * cellw / mcuw * comp->h_samp_factor; col++) d[col][0] = -((1024 + q/2) / q);
+	}
+    }
+
+    for ( i = 0; i < n; i++) {
+	if ( !tiles[i]) continue;
+	if ( i == first) {
+	    copy_tile( &ref, out, &ref, coef, i % cols, i / cols, cellw, cellh);
+	} else if ( place_tile( &ref, out, tiles[i], i % cols, i / cols, cellw, cellh, 0) == 0) {
+	    struct image *im = fit_tile( tiles[i], &ref, cellw, cellh);
+
+	    if ( im) {
+		struct chunk c[2] = { { .data = im->data, .length = im->length }, { 0 } };
+
+		place_tile( &ref, out, c, i % cols, i / cols, cellw, cellh, 1);
+		release_image( im);
+		(*decoded)++;
+	    }
+	}
+    }
+
+    jpeg_copy_critical_parameters( &ref, &dst);
+    dst.image_width = cols * cellw;
+    dst.image_height = rows * cellh;
+    set_jpeg_flags( &dst, flags);
+    jpeg_write_coefficients( &dst, out);
+    jpeg_finish_compress( &dst);
+    jpeg_finish_decompress( &ref);
+    jpeg_destroy_compress( &dst);
+    jpeg_destroy_decompress( &ref);
+
+    return dest.im;
+}
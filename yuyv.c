@@ -0,0 +1,199 @@
+/*
+** Pixel work on raw YUYV frames, for when the camera can't do JPEG and we
+** are about to pay for an encode anyway.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tinycamd.h"
+
+/*
+** Add a row of bytes into a row of 16 bit sums.
+*/
+static void accumulate_row( unsigned short *sum, const unsigned char *row, int len)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i z = _mm_setzero_si128();
+
+    for ( ; i + 16 <= len; i += 16) {
+	__m128i b = _mm_loadu_si128( (const __m128i *)(row+i));
+	__m128i lo = _mm_loadu_si128( (const __m128i *)(sum+i));
+	__m128i hi = _mm_loadu_si128( (const __m128i *)(sum+i+8));
+
+	lo = _mm_add_epi16( lo, _mm_unpacklo_epi8( b, z));
+	hi = _mm_add_epi16( hi, _mm_unpackhi_epi8( b, z));
+	_mm_storeu_si128( (__m128i *)(sum+i), lo);
+	_mm_storeu_si128( (__m128i *)(sum+i+8), hi);
+    }
+#endif
+    for ( ; i < len; i++) sum[i] += row[i];
+}
+
+/*
+** Box filter a YUYV image down by n (2, 4 or 8) in each direction. The
+** output width is rounded down to keep whole Y0 U Y1 V macropixels.
+** Returns a malloc()ed image and sets *ow and *oh.
+*/
+unsigned char *scale_yuyv( const unsigned char *yuyv, int width, int height, int n, int *ow, int *oh)
+{
+    int w = (width / n) & ~1;
+    int h = height / n;
+    int stride = width * 2;
+    int half = n / 2;
+    int area = n * n;
+    unsigned short *sum;
+    unsigned char *out, *o;
+    int row, k, j;
+
+    *ow = w;
+    *oh = h;
+    if ( w <= 0 || h <= 0) return 0;
+
+    sum = malloc( stride * sizeof(*sum));
+    o = out = malloc( w * h * 2);
+    if ( !sum || !out) fatal_f("Out of memory\n");
+
+    for ( row = 0; row < h; row++) {
+	memset( sum, 0, stride * sizeof(*sum));
+	for ( k = 0; k < n; k++) accumulate_row( sum, yuyv + (row*n + k)*stride, stride);
+
+	// each output macropixel covers n input macropixels
+	for ( j = 0; j < w/2; j++) {
+	    const unsigned short *s = sum + j*n*4;
+	    unsigned int y0 = 0, y1 = 0, u = 0, v = 0;
+
+	    for ( k = 0; k < n; k++, s += 4) {
+		if ( k < half) y0 += s[0] + s[2];
+		else y1 += s[0] + s[2];
+		u += s[1];
+		v += s[3];
+	    }
+	    *o++ = (y0 + area/2) / area;
+	    *o++ = (u + area/2) / area;
+	    *o++ = (y1 + area/2) / area;
+	    *o++ = (v + area/2) / area;
+	}
+    }
+
+    free( sum);
+    return out;
+}
+
+/*
+** Mirror a row of macropixels. Y0 U Y1 V comes out as Y1 U Y0 V.
+*/
+static void mirror_row( unsigned char *out, const unsigned char *in, int width)
+{
+    const unsigned char *s = in + width*2;
+    int n = width / 2;
+
+#ifdef __SSE2__
+    const __m128i keep = _mm_set1_epi32( 0xff00ff00);
+    const __m128i low = _mm_set1_epi32( 0x000000ff);
+    const __m128i high = _mm_set1_epi32( 0x00ff0000);
+
+    for ( ; n >= 4; n -= 4, out += 16) {
+	__m128i x;
+
+	s -= 16;
+	x = _mm_loadu_si128( (const __m128i *)s);
+	x = _mm_shuffle_epi32( x, _MM_SHUFFLE(0,1,2,3));
+	x = _mm_or_si128( _mm_and_si128( x, keep),
+			  _mm_or_si128( _mm_and_si128( _mm_srli_epi32( x, 16), low),
+					_mm_and_si128( _mm_slli_epi32( x, 16), high)));
+	_mm_storeu_si128( (__m128i *)out, x);
+    }
+#endif
+    for ( ; n > 0; n--, out += 4) {
+	s -= 4;
+	out[0] = s[2];
+	out[1] = s[1];
+	out[2] = s[0];
+	out[3] = s[3];
+    }
+}
+
+/*
+** Apply a TRANSFORM_* combination to a YUYV image before it is encoded.
+** Flips are whole macropixel moves. A transpose has to pair up pixels from
+** two source rows, so their chroma is averaged. Returns a malloc()ed image
+** and sets *ow and *oh.
+*/
+unsigned char *transform_yuyv( const unsigned char *yuyv, int width, int height, int transform, int *ow, int *oh)
+{
+    int stride = width * 2;
+    unsigned char *out;
+    int x, y;
+
+    if ( !(transform & TRANSFORM_TRANSPOSE)) {
+	*ow = width;
+	*oh = height;
+	out = malloc( stride * height);
+	if ( !out) fatal_f("Out of memory\n");
+
+	for ( y = 0; y < height; y++) {
+	    const unsigned char *in = yuyv + stride * ( (transform & TRANSFORM_FLIP_V) ? height-1-y : y);
+
+	    if ( transform & TRANSFORM_FLIP_H) mirror_row( out + stride*y, in, width);
+	    else memcpy( out + stride*y, in, stride);
+	}
+	return out;
+    }
+
+    *ow = height & ~1;
+    *oh = width;
+    out = malloc( *ow * *oh * 2);
+    if ( !out) fatal_f("Out of memory\n");
+
+    for ( y = 0; y < *oh; y++) {
+	unsigned char *o = out + y * *ow * 2;
+	int sx = (transform & TRANSFORM_FLIP_V) ? *oh-1-y : y;
+	const unsigned char *col = yuyv + (sx & ~1)*2;
+
+	for ( x = 0; x < *ow; x += 2, o += 4) {
+	    int sy0 = (transform & TRANSFORM_FLIP_H) ? *ow-1-x : x;
+	    int sy1 = (transform & TRANSFORM_FLIP_H) ? *ow-2-x : x+1;
+	    const unsigned char *p0 = col + sy0*stride;
+	    const unsigned char *p1 = col + sy1*stride;
+
+	    o[0] = p0[ (sx&1) ? 2 : 0];
+	    o[1] = (p0[1] + p1[1] + 1) >> 1;
+	    o[2] = p1[ (sx&1) ? 2 : 0];
+	    o[3] = (p0[3] + p1[3] + 1) >> 1;
+	}
+    }
+    return out;
+}
+
+/*
+** Cut a rectangle out of a YUYV image. The left edge and width are rounded
+** down to even so macropixels stay whole. Returns a malloc()ed image and
+** sets *ow and *oh, or 0 if there is nothing left.
+*/
+unsigned char *crop_yuyv( const unsigned char *yuyv, int width, int height, int x, int y, int w, int h, int *ow, int *oh)
+{
+    unsigned char *out;
+    int row;
+
+    x &= ~1;
+    if ( x < 0 || y < 0 || x >= width || y >= height) return 0;
+    if ( x + w > width) w = width - x;
+    if ( y + h > height) h = height - y;
+    w &= ~1;
+    if ( w <= 0 || h <= 0) return 0;
+
+    out = malloc( w * h * 2);
+    if ( !out) fatal_f("Out of memory\n");
+    for ( row = 0; row < h; row++) {
+	memcpy( out + row*w*2, yuyv + ((y+row)*width + x)*2, w*2);
+    }
+    *ow = w;
+    *oh = h;
+    return out;
+}